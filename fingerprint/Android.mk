@@ -6,10 +6,13 @@ LOCAL_INIT_RC := android.hardware.biometrics.fingerprint@2.1-service.sony.rc
 LOCAL_PROPRIETARY_MODULE := true
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_SRC_FILES := \
-    $(call all-subdir-cpp-files) \
+    $(filter-out tests/% sim/%,$(call all-subdir-cpp-files)) \
     QSEEComFunc.c \
     ion_buffer.c \
-    common.c
+    common.c \
+    event_mux.c \
+    irq_filter.c \
+    tz_trace.c
 
 LOCAL_CFLAGS += -DFINGERPRINT_TYPE_EGISTEC
 LOCAL_CFLAGS += \
@@ -18,6 +21,13 @@ LOCAL_CFLAGS += \
 # Define dynamic power management for everything but the following platforms:
 LOCAL_CFLAGS += -DHAS_DYNAMIC_POWER_MANAGEMENT
 
+# The QSEECom library and the sensor device node can be replaced, for example
+# with stand-ins that emulate the TZ app and the sensor IRQ (see
+# libQSEEComSim in Android.bp for the host):
+# LOCAL_CFLAGS += \
+#     -DQSEE_LIBRARY=\"libQSEEComAPI.so\" \
+#     -DFINGERPRINT_DEVICE_PATH=\"/dev/fingerprint\"
+
 # This file heavily depends on fpc_ implementations from the
 # above fpc_imp_* files. There is no sensible default file
 # on some platforms, so just remove the file altogether:
@@ -33,3 +43,6 @@ LOCAL_SHARED_LIBRARIES := \
     liblog \
     libutils
 
+LOCAL_STATIC_LIBRARIES := \
+    libuinput_emitter
+
@@ -20,6 +20,7 @@
 // #define LOG_NDEBUG 0
 
 #include "BiometricsFingerprint.h"
+#include "tz_trace.h"
 
 #include "android-base/macros.h"
 
@@ -30,6 +31,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include <cutils/properties.h>
+
 namespace fpc {
 
 using ::android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo;
@@ -37,20 +42,57 @@ using ::android::hardware::biometrics::fingerprint::V2_1::FingerprintError;
 using ::android::hardware::biometrics::fingerprint::V2_1::RequestStatus;
 using namespace ::SynchronizedWorker;
 
-BiometricsFingerprint::BiometricsFingerprint() : mWt(this) {
-    if (fpc_init(&fpc, mWt.getEventFd()) < 0)
+// Time the worker needs to be idle before updated templates are written
+// to storage. Updates from consecutive authentications are coalesced
+// into a single store.
+constexpr auto template_store_delay_ms = 2000;
+
+// Delay before reloading the TZ app, doubled for every consecutive reload.
+constexpr auto app_reload_backoff_min_ms = 100;
+constexpr auto app_reload_backoff_max_ms = 3200;
+
+BiometricsFingerprint::BiometricsFingerprint()
+    : mWt(this),
+      mWakeOnFinger(property_get_bool(WAKE_ON_FINGER_PROPERTY, false)),
+      mPower("fpc", [this](bool on) {
+          // The linger timer powers down from its own thread:
+          std::lock_guard<std::mutex> lock(mFpcMutex);
+          if (!fpc)
+              return -ENODEV;
+          return fpc_set_power(&fpc->event, on ? FPC_PWRON : FPC_PWROFF);
+      }) {
+}
+
+void BiometricsFingerprint::Init() {
+    if (InitDevice() < 0)
         LOG_ALWAYS_FATAL("Could not init FPC device");
 
     mWt.Start();
 }
 
+int BiometricsFingerprint::InitDevice() {
+    int rc = fpc_init(&fpc, mWt.getEventFd());
+    if (rc < 0)
+        return rc;
+
+    fpc->event.on_eventfd = [](void *wt) -> int {
+        return static_cast<Thread *>(wt)->runPosted();
+    };
+    fpc->event.on_eventfd_ctx = &mWt;
+    return rc;
+}
+
 BiometricsFingerprint::~BiometricsFingerprint() {
     ALOGV(__func__);
+    mInit.Wait(__func__);
     if (fpc == nullptr) {
         ALOGE("%s: No valid device", __func__);
         return;
     }
     mWt.Stop();
+    FlushTemplates();
+    mPower.Flush();
+    std::lock_guard<std::mutex> lock(mFpcMutex);
     fpc_close(&fpc);
 }
 
@@ -88,6 +130,8 @@ Return<RequestStatus> BiometricsFingerprint::ErrorFilter(int32_t error) {
 
 Return<uint64_t> BiometricsFingerprint::setNotify(
     const sp<IBiometricsFingerprintClientCallback> &clientCallback) {
+    // enumerate() and remove() use mClientCallback without taking its mutex:
+    auto call = mCalls.Enter();
     std::lock_guard<std::mutex> lock(mClientCallbackMutex);
     mClientCallback = clientCallback;
     // This is here because HAL 2.1 doesn't have a way to propagate a
@@ -98,7 +142,13 @@ Return<uint64_t> BiometricsFingerprint::setNotify(
 }
 
 Return<uint64_t> BiometricsFingerprint::preEnroll() {
-    enroll_challenge = fpc_load_auth_challenge(fpc);
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    // The worker owns the command buffer. Enrolling is about to replace any
+    // ongoing operation, which must not hold up the caller until it ends:
+    enroll_challenge = mWt.post([this] { return fpc_load_auth_challenge(fpc); },
+                                WhenBusy::Cancel)
+                           .get();
     ALOGI("%s : Challenge is : %ju", __func__, enroll_challenge);
     return enroll_challenge;
 }
@@ -106,6 +156,9 @@ Return<uint64_t> BiometricsFingerprint::preEnroll() {
 Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69> &hat,
                                                     uint32_t gid ATTRIBUTE_UNUSED,
                                                     uint32_t timeoutSec ATTRIBUTE_UNUSED) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     const hw_auth_token_t *authToken =
         reinterpret_cast<const hw_auth_token_t *>(hat.data());
 
@@ -128,18 +181,29 @@ Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69
 }
 
 Return<RequestStatus> BiometricsFingerprint::postEnroll() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: Resetting challenge", __func__);
     enroll_challenge = 0;
     return RequestStatus::SYS_OK;
 }
 
 Return<uint64_t> BiometricsFingerprint::getAuthenticatorId() {
-    uint64_t id = fpc_load_db_id(fpc);
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
+    // A cache miss waits for an ongoing operation to end, instead of
+    // cancelling it:
+    uint64_t id = mPrintCache.GetAuthenticatorId([this] {
+        return mWt.post([this] { return static_cast<uint64_t>(fpc_load_db_id(fpc)); }).get();
+    });
     ALOGI("%s : ID : %ju", __func__, id);
     return id;
 }
 
 Return<RequestStatus> BiometricsFingerprint::cancel() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
+    mIdlePredictor.OnCommand();
     ALOGI("%s", __func__);
 
     if (mWt.Resume()) {
@@ -152,6 +216,9 @@ Return<RequestStatus> BiometricsFingerprint::cancel() {
 }
 
 Return<RequestStatus> BiometricsFingerprint::enumerate() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     const uint64_t devId = reinterpret_cast<uint64_t>(this);
     if (mClientCallback == nullptr) {
         ALOGE("Client callback not set");
@@ -160,33 +227,35 @@ Return<RequestStatus> BiometricsFingerprint::enumerate() {
 
     ALOGV(__func__);
 
-    if (!mWt.Pause())
-        return RequestStatus::SYS_EBUSY;
-
-    fpc_fingerprint_index_t print_indices;
-    int rc = fpc_get_print_index(fpc, &print_indices);
+    // Prints that are not cached are loaded once an ongoing operation
+    // ended, without cancelling it:
+    std::vector<uint32_t> prints;
+    int rc = mPrintCache.GetPrints(prints, [this](auto &prints) {
+        return mWt.post([this, &prints] { return LoadPrints(prints); }).get();
+    });
 
     if (!rc) {
-        if (!print_indices.print_count)
+        if (prints.empty())
             // When there are no fingers, the service still needs to know that (potentially async)
             // enumeration has finished. By convention, send fid=0 and remaining=0 to signal this:
             mClientCallback->onEnumerate(devId, 0, gid, 0);
         else
-            for (size_t i = 0; i < print_indices.print_count; i++) {
-                ALOGD("%s : found print : %lu at index %zu", __func__, (unsigned long)print_indices.prints[i], i);
+            for (size_t i = 0; i < prints.size(); i++) {
+                ALOGD("%s : found print : %lu at index %zu", __func__, (unsigned long)prints[i], i);
 
-                uint32_t remaining_templates = (uint32_t)(print_indices.print_count - i - 1);
+                uint32_t remaining_templates = (uint32_t)(prints.size() - i - 1);
 
-                mClientCallback->onEnumerate(devId, print_indices.prints[i], gid, remaining_templates);
+                mClientCallback->onEnumerate(devId, prints[i], gid, remaining_templates);
             }
     }
 
-    mWt.Resume();
-
     return ErrorFilter(rc);
 }
 
 Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     const uint64_t devId = reinterpret_cast<uint64_t>(this);
 
     if (mClientCallback == nullptr) {
@@ -194,40 +263,46 @@ Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)
         return RequestStatus::SYS_EINVAL;
     }
 
-    if (!mWt.Pause())
-        return RequestStatus::SYS_EBUSY;
-
-    int rc = 0;
-
-    if (fid == 0) {
-        // Delete all fingerprints when fid is zero:
-        ALOGD("Deleting all fingerprints for gid %d", gid);
+    // Removal waits for an ongoing operation to end, the TZ app may not
+    // change the print set while identifying or enrolling:
+    int rc = mWt.post([this, devId, gid, fid] {
+        int rc = 0;
+
+        if (fid == 0) {
+            // Delete all fingerprints when fid is zero:
+            ALOGD("Deleting all fingerprints for gid %d", gid);
+
+            std::vector<uint32_t> prints;
+            rc = mPrintCache.GetPrints(prints, [this](auto &prints) { return LoadPrints(prints); });
+            if (!rc)
+                for (auto remaining = prints.size(); remaining--;) {
+                    auto fid = prints[remaining];
+                    ALOGD("Deleting print %d, %zu remaining", fid, remaining);
+                    rc = fpc_del_print_id(fpc, fid);
+                    if (rc)
+                        break;
+                    mClientCallback->onRemoved(devId, fid, gid, remaining);
+                }
+        } else {
+            ALOGD("Removing finger %u for gid %u", fid, gid);
+            rc = fpc_del_print_id(fpc, fid);
+            if (!rc)
+                mClientCallback->onRemoved(devId, fid, gid, 0);
+        }
 
-        fpc_fingerprint_index_t print_indices;
-        rc = fpc_get_print_index(fpc, &print_indices);
-        if (!rc)
-            for (auto remaining = print_indices.print_count; remaining--;) {
-                auto fid = print_indices.prints[remaining];
-                ALOGD("Deleting print %d, %d remaining", fid, remaining);
-                rc = fpc_del_print_id(fpc, fid);
-                if (rc)
-                    break;
-                mClientCallback->onRemoved(devId, fid, gid, remaining);
-            }
-    } else {
-        ALOGD("Removing finger %u for gid %u", fid, gid);
-        rc = fpc_del_print_id(fpc, fid);
-        if (!rc)
-            mClientCallback->onRemoved(devId, fid, gid, 0);
-    }
+        mPrintCache.Invalidate();
 
-    if (rc) {
-        mClientCallback->onError(devId, FingerprintError::ERROR_UNABLE_TO_REMOVE, 0);
-    } else {
-        rc = fpc_store_user_db(fpc, db_path);
-    }
+        if (rc) {
+            mClientCallback->onError(devId, FingerprintError::ERROR_UNABLE_TO_REMOVE, 0);
+        } else {
+            rc = fpc_store_user_db(fpc, db_path);
+            if (!rc)
+                mTemplatesDirty = false;
+        }
 
-    mWt.Resume();
+        WarmPrintCache();
+        return rc;
+    }).get();
 
     return ErrorFilter(rc);
 }
@@ -237,6 +312,8 @@ int BiometricsFingerprint::__setActiveGroup(uint32_t gid) {
     bool created_empty_db = false;
     struct stat sb;
 
+    mPrintCache.Invalidate();
+
     if (stat(db_path, &sb) == -1) {
         // No existing database, load an empty one
         if ((result = fpc_load_empty_db(fpc)) != 0) {
@@ -266,11 +343,17 @@ int BiometricsFingerprint::__setActiveGroup(uint32_t gid) {
             return result;
         }
     }
+
+    if (!result)
+        WarmPrintCache();
     return result;
 }
 
 Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid,
                                                             const hidl_string &storePath) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     int result;
 
     if (storePath.size() >= PATH_MAX || storePath.size() <= 0) {
@@ -281,23 +364,28 @@ Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid,
         return RequestStatus::SYS_EINVAL;
     }
 
-    sprintf(db_path, "%s/user.db", storePath.c_str());
-    this->gid = gid;
-
-    ALOGI("%s : storage path set to : %s", __func__, db_path);
+    // Switching users must not wait for an authentication of the previous
+    // one to end:
+    result = mWt.post([this, gid, &storePath] {
+        // Pending updates belong to the database of the previous group:
+        FlushTemplates();
 
-    if (!mWt.Pause())
-        return RequestStatus::SYS_EBUSY;
+        sprintf(db_path, "%s/user.db", storePath.c_str());
+        this->gid = gid;
 
-    result = __setActiveGroup(gid);
+        ALOGI("%s : storage path set to : %s", __func__, db_path);
 
-    mWt.Resume();
+        return __setActiveGroup(gid);
+    }, WhenBusy::Cancel).get();
 
     return ErrorFilter(result);
 }
 
 Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operation_id,
                                                           uint32_t gid ATTRIBUTE_UNUSED) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     err_t r;
 
     ALOGI("%s: operation_id=%ju", __func__, operation_id);
@@ -316,27 +404,186 @@ Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operation_id,
     return success ? RequestStatus::SYS_OK : RequestStatus::SYS_EAGAIN;
 }
 
+Return<void> BiometricsFingerprint::debug(const hidl_handle &handle, const hidl_vec<hidl_string> & /* options */) {
+    if (handle == nullptr || handle->numFds < 1) {
+        ALOGE("%s: Missing file descriptor", __func__);
+        return Void();
+    }
+
+    const int fd = handle->data[0];
+    mInit.Dump(fd);
+    if (!mInit.IsReady())
+        return Void();
+
+    mTracer.Dump(fd);
+    mCalls.Dump(fd);
+    mIdlePredictor.Dump(fd);
+    mPower.Dump(fd);
+    mWt.Dump(fd);
+    tz_trace_dump(fd);
+    {
+        // RecoverFromError() may be replacing fpc on the worker:
+        std::lock_guard<std::mutex> lock(mFpcMutex);
+        if (fpc) {
+            dprintf(fd, "Capture wakelock: %u extensions, %u avoided\n",
+                    fpc->wakelock.extensions, fpc->wakelock.skipped);
+            irq_filter_dump(&fpc->event.irq, fd);
+            fpc_uinput_dump(&fpc->uinput, fd);
+            fpc_dump_buffers(fpc, fd);
+        } else {
+            dprintf(fd, "TZ app is being reloaded\n");
+        }
+    }
+    dprintf(fd, "Error recovery: %u sensor resets, %u database reloads, %u TZ app reloads\n",
+            mSensorResets.load(), mDbReloads.load(), mAppReloads.load());
+    return Void();
+}
+
+/**
+ * Recover from an unexpected TZ error, escalating with the number of
+ * consecutive failures:
+ *  1. Reset the sensor, and have the TZ app set it up again;
+ *  2. Reload the user database into the running TZ app;
+ *  3. Reload the whole TZ app, after a backoff that grows with every
+ *     reload since the last successful match.
+ *
+ * @return false when the current operation has to be aborted.
+ */
+bool BiometricsFingerprint::RecoverFromError(unsigned int failures) {
+    int result;
+
+    if (failures <= 1) {
+        ALOGW("%s: Resetting sensor", __func__);
+        ++mSensorResets;
+        if (fpc_reinit_sensor(fpc) == 0)
+            return true;
+    }
+
+    if (failures <= 2) {
+        ALOGW("%s: Reloading user database", __func__);
+        ++mDbReloads;
+        // Reloading drops template updates that were not stored yet:
+        FlushTemplates();
+        if (__setActiveGroup(gid) == 0)
+            return true;
+    }
+
+    /*
+     * Reinitialize the TZ app and parameters
+     * to clear the TZ error generated by flooding it
+     */
+    const auto backoff_ms = std::min(app_reload_backoff_min_ms << std::min(mAppReloadStreak, 5u),
+                                     app_reload_backoff_max_ms);
+    ALOGW("%s: Reloading TZ app in %d ms", __func__, backoff_ms);
+    ++mAppReloads;
+    ++mAppReloadStreak;
+
+    FlushTemplates();
+    {
+        std::lock_guard<std::mutex> lock(mFpcMutex);
+        result = fpc_close(&fpc);
+    }
+    LOG_ALWAYS_FATAL_IF(result < 0, "REINITIALIZE: Failed to close fpc: %d", result);
+    // Wait out the backoff, unless a new request comes in. The app is
+    // always brought back up, so that the request can be handled.
+    mWt.isEventAvailable(backoff_ms);
+    {
+        std::lock_guard<std::mutex> lock(mFpcMutex);
+        result = InitDevice();
+    }
+    LOG_ALWAYS_FATAL_IF(result < 0, "REINITIALIZE: Failed to init fpc: %d", result);
+    // Closing and initializing powered down the sensor:
+    mPower.Resync();
+    mPrintCache.Invalidate();
+#ifdef USE_FPC_YOSHINO
+    int grp_err = __setActiveGroup(gid);
+    if (grp_err)
+        ALOGE("%s : Cannot reinitialize database", __func__);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int BiometricsFingerprint::LoadPrints(std::vector<uint32_t> &prints) {
+    fpc_fingerprint_index_t print_indices;
+    int rc = fpc_get_print_index(fpc, &print_indices);
+    if (!rc)
+        prints.assign(print_indices.prints, print_indices.prints + print_indices.print_count);
+    return rc;
+}
+
+void BiometricsFingerprint::WarmPrintCache() {
+    std::vector<uint32_t> prints;
+    mPrintCache.GetPrints(prints, [this](auto &prints) { return LoadPrints(prints); });
+    mPrintCache.GetAuthenticatorId([this] { return static_cast<uint64_t>(fpc_load_db_id(fpc)); });
+}
+
+void BiometricsFingerprint::UpdateTemplate() {
+    auto trace = mTracer.Trace(UnlockStage::TemplateUpdate);
+    int result = fpc_update_template(fpc);
+    if (result < 0)
+        ALOGE("Error updating template: %d", result);
+    else if (result)
+        mTemplatesDirty = true;
+}
+
+/**
+ * Write updated templates to storage.
+ *
+ * Must be called from the worker thread, or while it is paused.
+ */
+int BiometricsFingerprint::FlushTemplates() {
+    if (!mTemplatesDirty)
+        return 0;
+
+    ALOGI("Storing db");
+    int result = fpc_store_user_db(fpc, db_path);
+    if (result)
+        ALOGE("Error storing database: %d", result);
+    else
+        mTemplatesDirty = false;
+    return result;
+}
+
 void BiometricsFingerprint::IdleAsync() {
     ALOGD(__func__);
     int rc;
 
+    // Work posted while the worker was busy or paused:
+    if (mWt.runPosted())
+        return;
+
+    if (mTemplatesDirty) {
+        // Give the service a chance to start another authentication before
+        // storing, so that back-to-back template updates end up in a single
+        // store.
+        if (mWt.waitForStateRequest(template_store_delay_ms))
+            return;
+        FlushTemplates();
+    }
+
     if (!fpc_navi_supported(fpc)) {
         WorkHandler::IdleAsync();
         return;
     }
 
-    // Wait for a new state for at most 500ms before entering navigation mode.
-    // This gives the service some time to execute multiple commands on the HAL
+    // Give the service some time to execute multiple commands on the HAL
     // sequentially before needlessly going into navigation mode and exit it
-    // almost immediately after.
-    else if (mWt.isEventAvailable(500)) {
-        ALOGD("%s: EXIT: Handle event instead of navigation", __func__);
-        return;
-    }
+    // almost immediately after. How long is up to the predictor.
+    for (int delay; (delay = mIdlePredictor.NavigationDelay());)
+        if (mWt.waitForStateRequest(delay)) {
+            ALOGD("%s: EXIT: Handle event instead of navigation", __func__);
+            mIdlePredictor.NavigationSkipped();
+            return;
+        }
 
     ALOGD("%s: Start gesture polling", __func__);
 
-    if (fpc_set_power(&fpc->event, FPC_PWRON) < 0) {
+    auto transition_start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    auto power = mPower.Acquire();
+    if (!power) {
         ALOGE("Error starting device");
         return;
     }
@@ -344,16 +591,22 @@ void BiometricsFingerprint::IdleAsync() {
     rc = fpc_navi_enter(fpc);
     ALOGE_IF(rc, "Failed to enter navigation state: rc=%d", rc);
 
-    if (!rc) {
+    const bool entered = !rc;
+    if (entered) {
+        mIdlePredictor.NavigationEntered(systemTime(SYSTEM_TIME_MONOTONIC) - transition_start);
+
         rc = fpc_navi_poll(fpc);
         ALOGE_IF(rc, "Failed to poll navigation: rc=%d", rc);
 
+        transition_start = systemTime(SYSTEM_TIME_MONOTONIC);
         rc = fpc_navi_exit(fpc);
         ALOGE_IF(rc, "Failed to exit navigation: rc=%d", rc);
     }
 
-    if (fpc_set_power(&fpc->event, FPC_PWROFF) < 0)
-        ALOGE("Error stopping device");
+    power.Release();
+
+    if (entered)
+        mIdlePredictor.NavigationExited(systemTime(SYSTEM_TIME_MONOTONIC) - transition_start);
 }
 
 void BiometricsFingerprint::EnrollAsync() {
@@ -369,7 +622,8 @@ void BiometricsFingerprint::EnrollAsync() {
         return;
     }
 
-    if (fpc_set_power(&fpc->event, FPC_PWRON) < 0) {
+    auto power = mPower.Acquire();
+    if (!power) {
         ALOGE("Error starting device");
         mClientCallback->onError(devId, FingerprintError::ERROR_UNABLE_TO_PROCESS, 0);
         return;
@@ -385,7 +639,8 @@ void BiometricsFingerprint::EnrollAsync() {
     while ((status = fpc_capture_image(fpc)) >= 0) {
         ALOGD("%s : Got Input status=%d", __func__, status);
 
-        if (mWt.isEventAvailable()) {
+        // Only a state request ends the operation, posted work runs here:
+        if (mWt.runPosted()) {
             mClientCallback->onError(devId, FingerprintError::ERROR_CANCELED, 0);
             break;
         }
@@ -409,6 +664,7 @@ void BiometricsFingerprint::EnrollAsync() {
             } else if (ret == 0) {
                 uint32_t print_id = 0;
                 int print_index = fpc_enroll_end(fpc, &print_id);
+                mPrintCache.Invalidate();
 
                 if (print_index < 0) {
                     ALOGE("%s : Error getting new print index : %d", __func__, print_index);
@@ -416,9 +672,11 @@ void BiometricsFingerprint::EnrollAsync() {
                     break;
                 }
 
-                fpc_store_user_db(fpc, db_path);
+                if (!fpc_store_user_db(fpc, db_path))
+                    mTemplatesDirty = false;
                 ALOGI("%s : Got print id : %lu", __func__, (unsigned long)print_id);
                 mClientCallback->onEnrollResult(devId, print_id, gid, 0);
+                WarmPrintCache();
                 break;
             } else {
                 ALOGE("Error in enroll step, aborting enroll: %d\n", ret);
@@ -428,16 +686,16 @@ void BiometricsFingerprint::EnrollAsync() {
         }
     }
 
-    if (fpc_set_power(&fpc->event, FPC_PWROFF) < 0)
-        ALOGE("Error stopping device");
+    fpc_session_release(&fpc->event, &fpc->wakelock);
+    power.Release();
 
     if (status < 0)
         mClientCallback->onError(devId, FingerprintError::ERROR_HW_UNAVAILABLE, 0);
 }
 
 void BiometricsFingerprint::AuthenticateAsync() {
-    int result;
     int status = 1;
+    unsigned int failures = 0;
 
     const uint64_t devId = reinterpret_cast<uint64_t>(this);
 
@@ -447,32 +705,59 @@ void BiometricsFingerprint::AuthenticateAsync() {
         return;
     }
 
-    if (fpc_set_power(&fpc->event, FPC_PWRON) < 0) {
+    auto power = mPower.Acquire();
+    if (!power) {
         ALOGE("Error starting device");
         mClientCallback->onError(devId, FingerprintError::ERROR_UNABLE_TO_PROCESS, 0);
         return;
     }
 
     fpc_auth_start(fpc);
+    fpc->wake_on_finger = mWakeOnFinger;
 
-    while ((status = fpc_capture_image(fpc)) >= 0) {
+    for (;;) {
+        status = fpc_capture_image(fpc);
         ALOGV("%s : Got Input with status %d", __func__, status);
 
-        if (mWt.isEventAvailable()) {
+        // Only a state request ends the operation, posted work runs here:
+        if (mWt.runPosted()) {
             mClientCallback->onError(devId, FingerprintError::ERROR_CANCELED, 0);
             break;
         }
 
+        if (status < 0) {
+            // A sensor or TZ app that failed to recover fails the capture:
+            ALOGE("%s : Capture failed: %d", __func__, status);
+            if (!RecoverFromError(++failures))
+                break;
+            fpc->wake_on_finger = mWakeOnFinger;
+            continue;
+        }
+
         FingerprintAcquiredInfo hidlStatus = (FingerprintAcquiredInfo)status;
 
         if (hidlStatus <= FingerprintAcquiredInfo::ACQUIRED_TOO_FAST)
             mClientCallback->onAcquired(devId, hidlStatus, 0);
 
         if (status == FINGERPRINT_ACQUIRED_GOOD) {
+            const auto &timing = fpc->capture_timing;
+            if (timing.finger_down_ns) {
+                mTracer.FingerDown(timing.finger_down_ns);
+                mTracer.Record(UnlockStage::Wake, timing.finger_down_ns, timing.capture_begin_ns);
+                if (timing.wake_key_ns)
+                    mTracer.Record(UnlockStage::WakeKey, timing.finger_down_ns, timing.wake_key_ns);
+                mTracer.Record(UnlockStage::Capture, timing.capture_begin_ns, timing.capture_end_ns);
+            }
+
             uint32_t print_id = 0;
+            auto identify_trace = mTracer.Trace(UnlockStage::Identify);
             int verify_state = fpc_auth_step(fpc, &print_id);
+            identify_trace.End();
             ALOGI("%s : Auth step = %d", __func__, verify_state);
 
+            if (verify_state >= 0 || verify_state == -EAGAIN)
+                failures = 0;
+
             /* After getting something that ought to have been
              * recognizable: Either send proper notification, or
              * dummy one where fid=zero stands for unrecognized.
@@ -480,21 +765,16 @@ void BiometricsFingerprint::AuthenticateAsync() {
             uint32_t fid = 0;
 
             if (verify_state >= 0) {
-                result = fpc_update_template(fpc);
-                if (result < 0) {
-                    ALOGE("Error updating template: %d", result);
-                } else if (result) {
-                    ALOGI("Storing db");
-                    result = fpc_store_user_db(fpc, db_path);
-                    if (result) ALOGE("Error storing database: %d", result);
-                }
-
+                // The template is updated after reporting the result, and
+                // stored to disk once the HAL is idle (see IdleAsync).
                 if (print_id > 0) {
                     hw_auth_token_t hat;
                     ALOGI("%s : Got print id : %u", __func__, print_id);
 
                     if (auth_challenge) {
+                        auto hat_trace = mTracer.Trace(UnlockStage::HatFetch);
                         fpc_get_hw_auth_obj(fpc, &hat, sizeof(hw_auth_token_t));
+                        hat_trace.End();
 
                         ALOGW_IF(auth_challenge != hat.challenge,
                                  "Local auth challenge %ju does not match hat challenge %ju",
@@ -514,46 +794,50 @@ void BiometricsFingerprint::AuthenticateAsync() {
                     }
 
                     fid = print_id;
+                    mAppReloadStreak = 0;
 
                     const uint8_t *hat2 = reinterpret_cast<const uint8_t *>(&hat);
                     const hidl_vec<uint8_t> token(std::vector<uint8_t>(hat2, hat2 + sizeof(hat)));
 
-                    mClientCallback->onAuthenticated(devId, fid, gid, token);
+                    {
+                        auto trace = mTracer.Trace(UnlockStage::Authenticated);
+                        mClientCallback->onAuthenticated(devId, fid, gid, token);
+                    }
+                    UpdateTemplate();
+                    mTracer.Finish(true);
                     break;
                 } else {
                     ALOGI("%s : Got print id : %u", __func__, print_id);
-                    mClientCallback->onAuthenticated(devId, fid, gid, hidl_vec<uint8_t>());
+                    {
+                        auto trace = mTracer.Trace(UnlockStage::Authenticated);
+                        mClientCallback->onAuthenticated(devId, fid, gid, hidl_vec<uint8_t>());
+                    }
+                    UpdateTemplate();
+                    mTracer.Finish(false);
                 }
 
             } else if (verify_state == -EAGAIN) {
                 ALOGI("%s : retrying due to receiving -EAGAIN", __func__);
-                mClientCallback->onAuthenticated(devId, fid, gid, hidl_vec<uint8_t>());
-            } else {
-                /*
-                 * Reinitialize the TZ app and parameters
-                 * to clear the TZ error generated by flooding it
-                 */
-                result = fpc_close(&fpc);
-                LOG_ALWAYS_FATAL_IF(result < 0, "REINITIALIZE: Failed to close fpc: %d", result);
-                sleep(1);
-                result = fpc_init(&fpc, mWt.getEventFd());
-                LOG_ALWAYS_FATAL_IF(result < 0, "REINITIALIZE: Failed to init fpc: %d", result);
-#ifdef USE_FPC_YOSHINO
-                int grp_err = __setActiveGroup(gid);
-                if (grp_err)
-                    ALOGE("%s : Cannot reinitialize database", __func__);
-#else
+                {
+                    auto trace = mTracer.Trace(UnlockStage::Authenticated);
+                    mClientCallback->onAuthenticated(devId, fid, gid, hidl_vec<uint8_t>());
+                }
+                mTracer.Finish(false);
+            } else if (!RecoverFromError(++failures)) {
                 // Break out of the loop, and make sure ERROR_HW_UNAVAILABLE
                 // is raised afterwards, similar to the stock hal:
                 status = -1;
                 break;
-#endif
+            } else {
+                // Recovery may have reloaded the TZ app, and fpc with it:
+                fpc->wake_on_finger = mWakeOnFinger;
             }
         }
     }
 
-    if (fpc_set_power(&fpc->event, FPC_PWROFF) < 0)
-        ALOGE("Error stopping device");
+    fpc->wake_on_finger = false;
+    fpc_session_release(&fpc->event, &fpc->wakelock);
+    power.Release();
 
     if (status < 0)
         mClientCallback->onError(devId, FingerprintError::ERROR_HW_UNAVAILABLE, 0);
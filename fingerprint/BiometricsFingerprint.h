@@ -17,7 +17,13 @@
 #ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_BIOMETRICSFINGERPRINT_H
 #define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_BIOMETRICSFINGERPRINT_H
 
+#include "DeferredInit.h"
+#include "HalCallSerializer.h"
+#include "IdlePredictor.h"
+#include "PrintCache.h"
+#include "SensorPowerDomain.h"
 #include "SynchronizedWorkerThread.h"
+#include "UnlockLatencyTracer.h"
 
 #include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
 #include <hardware/fingerprint.h>
@@ -25,6 +31,7 @@
 #include <hidl/Status.h>
 #include <log/log.h>
 
+#include <atomic>
 #include <mutex>
 
 extern "C" {
@@ -35,6 +42,7 @@ namespace fpc {
 
 using ::android::sp;
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
@@ -60,6 +68,9 @@ struct BiometricsFingerprint : public IBiometricsFingerprint, public ::Synchroni
     Return<RequestStatus> setActiveGroup(uint32_t gid, const hidl_string &storePath) override;
     Return<RequestStatus> authenticate(uint64_t operationId, uint32_t gid) override;
 
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void> debug(const hidl_handle &handle, const hidl_vec<hidl_string> &options) override;
+
     // Methods from ::SynchronizedWorker::WorkHandler
     inline ::SynchronizedWorker::Thread &getWorker() override {
         return mWt;
@@ -71,16 +82,53 @@ struct BiometricsFingerprint : public IBiometricsFingerprint, public ::Synchroni
    private:
     static Return<RequestStatus> ErrorFilter(int32_t error);
 
+    // Runs on mInit: initializes the device and starts the worker
+    void Init();
+
+    // Initializes fpc, and lets it run work posted to mWt while navigating
+    int InitDevice();
+
     // Internal machinery to set the active group
     int __setActiveGroup(uint32_t gid);
 
+    // Fetches the print ids from TZ; must run on the worker, or while it is paused
+    int LoadPrints(std::vector<uint32_t> &prints);
+
+    // Refills mPrintCache after it was invalidated, on the worker, so that
+    // queries during a later operation need not wait for it to end
+    void WarmPrintCache();
+
+    // Brings the TZ app back after an unexpected error, see the implementation
+    bool RecoverFromError(unsigned int failures);
+
+    // Template updates are persisted lazily, see FlushTemplates()
+    void UpdateTemplate();
+    int FlushTemplates();
+
     ::SynchronizedWorker::Thread mWt;
     char db_path[255];
     fpc_imp_data_t *fpc = NULL;
+    // Held by RecoverFromError() while replacing fpc, and by debug() and
+    // the mPower linger timer while using it from other threads:
+    std::mutex mFpcMutex;
     sp<IBiometricsFingerprintClientCallback> mClientCallback = NULL;
     std::mutex mClientCallbackMutex;
+    HalCallSerializer mCalls;
     uint32_t gid;
     uint64_t auth_challenge, enroll_challenge;
+    bool mTemplatesDirty = false;
+    // See WAKE_ON_FINGER_PROPERTY:
+    const bool mWakeOnFinger;
+    UnlockLatencyTracer mTracer;
+    PrintCache mPrintCache;
+    IdlePredictor mIdlePredictor;
+    SensorPowerDomain mPower;
+    // Number of times each recovery tier was used:
+    std::atomic<uint32_t> mSensorResets{0}, mDbReloads{0}, mAppReloads{0};
+    // TZ app reloads since the last successful match, for the backoff of
+    // RecoverFromError(); only touched by the worker:
+    unsigned int mAppReloadStreak = 0;
+    DeferredInit mInit{"fpc", [this] { Init(); }};
 };
 
 }  // namespace fpc
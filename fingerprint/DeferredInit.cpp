@@ -0,0 +1,56 @@
+#include "DeferredInit.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <exception>
+
+#define LOG_TAG "FPC DeferredInit"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+DeferredInit::DeferredInit(const char *name, std::function<void()> init)
+    : mName(name), mStart(systemTime(SYSTEM_TIME_MONOTONIC)) {
+    mReady = std::async(std::launch::async, [this, init = std::move(init)] {
+        try {
+            init();
+        } catch (const std::exception &e) {
+            LOG_ALWAYS_FATAL("Failed to initialize %s: %s", mName, e.what());
+        }
+
+        mDuration = systemTime(SYSTEM_TIME_MONOTONIC) - mStart;
+        ALOGI("Initialized %s in %" PRId64 "ms", mName, ns2ms(mDuration.load()));
+    }).share();
+}
+
+DeferredInit::~DeferredInit() {
+    mReady.wait();
+}
+
+void DeferredInit::Wait(const char *caller) {
+    if (IsReady())
+        return;
+
+    ALOGI("%s: Waiting for %s to initialize", caller, mName);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    mReady.wait();
+    nsecs_t waited = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    ++mWaits;
+    mWaitedNs += waited;
+    ALOGI("%s: Waited %" PRId64 "ms for %s to initialize", caller, ns2ms(waited), mName);
+}
+
+bool DeferredInit::IsReady() const {
+    return mReady.wait_for(std::chrono::seconds::zero()) == std::future_status::ready;
+}
+
+void DeferredInit::Dump(int fd) {
+    if (IsReady())
+        dprintf(fd, "Deferred init of %s: took %" PRId64 "ms", mName, ns2ms(mDuration.load()));
+    else
+        dprintf(fd, "Deferred init of %s: running for %" PRId64 "ms", mName,
+                ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - mStart));
+    dprintf(fd, ", %u calls waited %" PRId64 "ms for it\n", mWaits.load(), ns2ms(mWaitedNs.load()));
+}
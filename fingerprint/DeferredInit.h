@@ -0,0 +1,43 @@
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <atomic>
+#include <functional>
+#include <future>
+
+/**
+ * Runs the slow part of HAL initialization (loading trustlets, sensor
+ * calibration) on a background thread, so that the service can register
+ * right away instead of holding up the boot for it.
+ *
+ * HAL calls that need the initialized sensor wait for it through Wait().
+ * A failing initialization aborts the service, like it did when done in
+ * the constructor.
+ *
+ * Must be the last member of its owner: it is constructed after everything
+ * init uses, and destroyed (waiting for init to finish) before that.
+ */
+class DeferredInit {
+   public:
+    DeferredInit(const char *name, std::function<void()> init);
+    ~DeferredInit();
+
+    DeferredInit(const DeferredInit &) = delete;
+    DeferredInit &operator=(const DeferredInit &) = delete;
+
+    // Blocks until initialization completed:
+    void Wait(const char *caller);
+    bool IsReady() const;
+
+    void Dump(int fd);
+
+   private:
+    const char *mName;
+    const nsecs_t mStart;
+    std::atomic<nsecs_t> mDuration{0};
+    // Calls that had to wait, and for how long in total:
+    std::atomic<uint32_t> mWaits{0};
+    std::atomic<nsecs_t> mWaitedNs{0};
+    std::shared_future<void> mReady;
+};
@@ -1,76 +1,56 @@
 #include "EventMultiplexer.h"
 
-#if PLATFORM_SDK_VERSION >= 28
-#include <bits/epoll_event.h>
-#endif
-#include <errno.h>
-#include <string.h>
-#include <sys/epoll.h>
-#include <unistd.h>
-
 #define LOG_TAG "FPC Mux"
 #define LOG_NDEBUG 0
 #include <log/log.h>
 
-EventMultiplexer::EventMultiplexer(int dev_fd, int event_fd) : dev_fd(dev_fd), event_fd(event_fd) {
-    int rc = 0;
-
-    epoll_fd = epoll_create1(0);
-    LOG_ALWAYS_FATAL_IF(epoll_fd < 0, "Failed to create epoll: %s", strerror(errno));
+EventMultiplexer::EventMultiplexer(int dev_fd, int event_fd, unsigned long irq_level_ioctl) {
+    int rc = event_mux_init(&mux);
+    LOG_ALWAYS_FATAL_IF(rc, "Failed to create multiplexer");
 
-    struct epoll_event ev = {
-        .data.fd = event_fd,
-        .events = EPOLLIN,
-    };
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
-    LOG_ALWAYS_FATAL_IF(rc, "Failed to add eventfd %d to epoll: %s", event_fd, strerror(errno));
+    // Control events have priority over finger events, since
+    // this is probably a request to cancel the current operation.
+    rc = event_mux_add(&mux, event_fd, static_cast<int>(WakeupReason::Event), nullptr, nullptr);
+    LOG_ALWAYS_FATAL_IF(rc, "Failed to add eventfd %d to epoll", event_fd);
 
-    ev = {
-        .data.fd = dev_fd,
-        .events = EPOLLIN,
-    };
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
-    LOG_ALWAYS_FATAL_IF(rc, "Failed to add fingerprint device %d to epoll: %s", dev_fd, strerror(errno));
+    irq_filter_init(&irq, dev_fd, irq_level_ioctl);
+    rc = event_mux_add(&mux, dev_fd, static_cast<int>(WakeupReason::Finger), irq_filter_handle, &irq);
+    LOG_ALWAYS_FATAL_IF(rc, "Failed to add fingerprint device %d to epoll", dev_fd);
 }
 
 EventMultiplexer::~EventMultiplexer() {
-    close(epoll_fd);
+    event_mux_destroy(&mux);
 }
 
-WakeupReason EventMultiplexer::waitForEvent(int timeoutSec) {
-    constexpr auto EVENT_COUNT = 2;
-    struct epoll_event events[EVENT_COUNT];
-    ALOGD("%s: TimeoutSec = %d", __func__, timeoutSec);
-    int cnt = epoll_wait(epoll_fd, events, EVENT_COUNT, 1000 * timeoutSec);
+WakeupReason EventMultiplexer::waitForEvent(int timeoutMs) {
+    ALOGD("%s: TimeoutMs = %d", __func__, timeoutMs);
+    return waitForEventUntil(event_mux_deadline_ms(timeoutMs));
+}
 
-    if (cnt < 0) {
-        ALOGE("%s: epoll_wait failed: %s", __func__, strerror(errno));
-        // Let the current operation continue as if nothing happened:
-        return WakeupReason::Timeout;
-    }
+WakeupReason EventMultiplexer::waitForEventUntil(nsecs_t deadline) {
+    int rc = event_mux_wait_until(&mux, deadline);
 
-    if (!cnt) {
-        ALOGD("%s: WakeupReason = Timeout", __func__);
-        return WakeupReason::Timeout;
+    switch (rc) {
+        case EVENT_MUX_ERROR:
+            // Let the current operation continue as if nothing happened:
+        case EVENT_MUX_TIMEOUT:
+            ALOGD("%s: WakeupReason = Timeout", __func__);
+            return WakeupReason::Timeout;
     }
 
-    bool finger_event = false;
+    const auto reason = static_cast<WakeupReason>(rc);
+    ALOGD("%s: WakeupReason = %s", __func__, reason == WakeupReason::Event ? "Event" : "Finger");
+    return reason;
+}
 
-    for (auto ei = 0; ei < cnt; ++ei)
-        if (events[ei].events & EPOLLIN) {
-            // Control events have priority over finger events, since
-            // this is probably a request to cancel the current operation.
-            if (events[ei].data.fd == event_fd) {
-                ALOGD("%s: WakeupReason = Event", __func__);
-                return WakeupReason::Event;
-            } else if (events[ei].data.fd == dev_fd) {
-                finger_event = true;
-            }
-        }
+void EventMultiplexer::reportCapture(bool finger) {
+    irq_filter_report(&irq, finger);
+}
 
-    // This should never happen, as only event_fd and dev_fd are added to the epoll:
-    LOG_ALWAYS_FATAL_IF(!finger_event, "Invalid wakeup source!");
+nsecs_t EventMultiplexer::backoffDeadline() const {
+    return irq_filter_backoff_deadline_ns(&irq);
+}
 
-    ALOGD("%s: WakeupReason = Finger", __func__);
-    return WakeupReason::Finger;
+void EventMultiplexer::Dump(int fd) const {
+    irq_filter_dump(&irq, fd);
 }
@@ -1,19 +1,40 @@
 #pragma once
 
+#include <utils/Timers.h>
+
+#include "event_mux.h"
+#include "irq_filter.h"
+
 enum class WakeupReason {
     Timeout,
     Event,
     Finger,  // Hardware
 };
 
+/**
+ * Waits for the worker eventfd and the fingerprint device, see event_mux.h.
+ * Wakeups of the device are filtered, see irq_filter.h.
+ */
 class EventMultiplexer {
-    int dev_fd;
-    int epoll_fd;
-    int event_fd;
+    event_mux_t mux;
+    irq_filter_t irq;
 
    public:
-    EventMultiplexer(int event_fd, int dev_fd);
+    // irq_level_ioctl reads the level of the IRQ line from dev_fd:
+    EventMultiplexer(int dev_fd, int event_fd, unsigned long irq_level_ioctl);
     ~EventMultiplexer();
 
-    WakeupReason waitForEvent(int timeoutSec = -1);
+    // The multiplexer refers to irq:
+    EventMultiplexer(const EventMultiplexer &) = delete;
+    EventMultiplexer &operator=(const EventMultiplexer &) = delete;
+
+    WakeupReason waitForEvent(int timeoutMs = -1);
+    // Wait until an absolute SYSTEM_TIME_MONOTONIC deadline, or forever when negative:
+    WakeupReason waitForEventUntil(nsecs_t deadline);
+
+    // Whether the capture after a Finger wakeup found a finger:
+    void reportCapture(bool finger);
+    // Until when finger detection should not be armed, or -1:
+    nsecs_t backoffDeadline() const;
+    void Dump(int fd) const;
 };
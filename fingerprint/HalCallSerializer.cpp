@@ -0,0 +1,49 @@
+#include "HalCallSerializer.h"
+
+#include <stdio.h>
+
+HalCallSerializer::Unserialized::Unserialized(HalCallSerializer &serializer)
+    : mSerializer(serializer), mBegin(systemTime(SYSTEM_TIME_MONOTONIC)) {
+}
+
+HalCallSerializer::Unserialized::~Unserialized() {
+    mSerializer.mBypassed.Add(systemTime(SYSTEM_TIME_MONOTONIC) - mBegin);
+}
+
+void HalCallSerializer::Stats::Add(nsecs_t ns) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(ns, std::memory_order_relaxed);
+
+    auto prev = max.load(std::memory_order_relaxed);
+    while (prev < ns && !max.compare_exchange_weak(prev, ns, std::memory_order_relaxed))
+        ;
+}
+
+std::unique_lock<std::mutex> HalCallSerializer::Enter() {
+    std::unique_lock<std::mutex> lock(mMutex, std::try_to_lock);
+    if (lock.owns_lock())
+        return lock;
+
+    // Only contended calls are timed:
+    const auto begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    lock.lock();
+    mWaits.Add(systemTime(SYSTEM_TIME_MONOTONIC) - begin);
+    return lock;
+}
+
+void HalCallSerializer::Dump(int fd) const {
+    const auto waits = mWaits.count.load(std::memory_order_relaxed);
+    const auto bypassed = mBypassed.count.load(std::memory_order_relaxed);
+
+    dprintf(fd, "HAL calls: %u waited on another call", waits);
+    if (waits)
+        dprintf(fd, " for %.1fms on average, %.1fms at most",
+                ns2us(mWaits.total.load(std::memory_order_relaxed) / waits) / 1000.,
+                ns2us(mWaits.max.load(std::memory_order_relaxed)) / 1000.);
+    dprintf(fd, "; %u unserialized calls", bypassed);
+    if (bypassed)
+        dprintf(fd, " took %.1fms on average, %.1fms at most",
+                ns2us(mBypassed.total.load(std::memory_order_relaxed) / bypassed) / 1000.,
+                ns2us(mBypassed.max.load(std::memory_order_relaxed)) / 1000.);
+    dprintf(fd, "\n");
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Serializes the HAL calls that change the session state (client callback,
+ * active group, challenges, the requested operation), now that binder
+ * calls are served by several threads.
+ *
+ * cancel() and getAuthenticatorId() do not enter it: cancel() only queues
+ * a state request for the worker, which is safe from any thread, and must
+ * never wait behind a slow setActiveGroup() or remove(). The latency of
+ * those unserialized calls is recorded for the debug dump, next to the time
+ * serialized calls spent waiting on each other.
+ *
+ * Unserialized calls, debug() included, may only touch state that is
+ * synchronized on its own: the worker's request queue, PrintCache, the TZ
+ * buffer lock of QSEETrustlet, atomics, or a lock of their own (see
+ * tests/HalCallSerializerTest.cpp for the cancel() latency under load).
+ * The only exception are the plain statistics counters of the C code
+ * (IRQ filter, uinput), which debug() prints as a best-effort snapshot.
+ */
+class HalCallSerializer {
+   public:
+    class Unserialized {
+        HalCallSerializer &mSerializer;
+        nsecs_t mBegin;
+
+       public:
+        Unserialized(HalCallSerializer &);
+        ~Unserialized();
+        Unserialized(const Unserialized &) = delete;
+        Unserialized &operator=(const Unserialized &) = delete;
+    };
+
+    // Held for the duration of a serialized call:
+    [[nodiscard]] std::unique_lock<std::mutex> Enter();
+    // Times a call that bypasses the serialization:
+    [[nodiscard]] inline Unserialized Bypass() {
+        return Unserialized(*this);
+    }
+
+    void Dump(int fd) const;
+
+   private:
+    struct Stats {
+        std::atomic<uint32_t> count{0};
+        std::atomic<nsecs_t> total{0}, max{0};
+
+        void Add(nsecs_t);
+    };
+
+    std::mutex mMutex;
+    // Time serialized calls waited for the previous one to finish:
+    Stats mWaits;
+    // Duration of unserialized calls:
+    Stats mBypassed;
+};
@@ -0,0 +1,117 @@
+#include "IdlePredictor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define LOG_TAG "FPC IdlePredictor"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace {
+
+// DRM connector power state of the primary panel: "On" or "Off".
+constexpr auto screen_state_path = "/sys/class/drm/card0-DSI-1/dpms";
+// How often to check whether the screen turned on again:
+constexpr auto screen_recheck_ms = 1000;
+// Gaps longer than this are considered to be between bursts:
+constexpr auto burst_window = ms2ns(3000);
+// Navigation should last this many times its own transition cost to be worth it:
+constexpr auto amortize_factor = 4;
+constexpr auto max_holdoff = ms2ns(5000);
+
+// Moving average with a weight of 1/4 for the new sample:
+nsecs_t ewma(nsecs_t average, nsecs_t sample) {
+    return average + (sample - average) / 4;
+}
+
+}  // namespace
+
+bool IdlePredictor::IsScreenOn() {
+    char state[8] = {};
+
+    int fd = open(screen_state_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Without a screen state, behave as if the screen is always on:
+        ALOGV("%s: Failed to open %s: %s", __func__, screen_state_path, strerror(errno));
+        return true;
+    }
+    ssize_t len = read(fd, state, sizeof(state) - 1);
+    close(fd);
+
+    return len <= 0 || strncmp(state, "Off", 3);
+}
+
+void IdlePredictor::OnCommand() {
+    const auto now = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mLastCommand && now - mLastCommand < burst_window)
+        mBurstGap = ewma(mBurstGap, now - mLastCommand);
+    mLastCommand = now;
+}
+
+int IdlePredictor::NavigationDelay() {
+    if (!IsScreenOn()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mScreenOffReported) {
+            ALOGD("%s: Screen is off, not entering navigation", __func__);
+            ++mScreenOff;
+            mScreenOffReported = true;
+        }
+        return screen_recheck_ms;
+    }
+
+    const auto now = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mScreenOffReported = false;
+
+    // Wait until the current burst has likely ended:
+    const auto deadline = mLastCommand + std::max(2 * mBurstGap, mHoldoff);
+    if (now >= deadline)
+        return 0;
+
+    // Round up, to not wake up right before the deadline:
+    return std::max<int>(1, (deadline - now + ms2ns(1) - 1) / ms2ns(1));
+}
+
+void IdlePredictor::NavigationEntered(nsecs_t transition_cost) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mNavigationStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    mEnterCost = transition_cost;
+    ++mEntered;
+}
+
+void IdlePredictor::NavigationExited(nsecs_t transition_cost) {
+    const auto now = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mTransitionCost = ewma(mTransitionCost, mEnterCost + transition_cost);
+
+    if (now - mNavigationStart < amortize_factor * mTransitionCost) {
+        ++mAborted;
+        mHoldoff = std::min(2 * mHoldoff + amortize_factor * mTransitionCost, max_holdoff);
+        ALOGD("%s: Navigation aborted after %" PRId64 "ms, holding off for %" PRId64 "ms",
+              __func__, ns2ms(now - mNavigationStart), ns2ms(mHoldoff));
+    } else {
+        mHoldoff /= 2;
+    }
+}
+
+void IdlePredictor::NavigationSkipped() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mSkipped;
+}
+
+void IdlePredictor::Dump(int fd) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    dprintf(fd, "Navigation: %u entered, %u aborted, %u skipped, %u times screen off\n",
+            mEntered, mAborted, mSkipped, mScreenOff);
+    dprintf(fd, "  burst gap %" PRId64 "ms, transition cost %" PRId64 "ms, holdoff %" PRId64 "ms\n",
+            ns2ms(mBurstGap), ns2ms(mTransitionCost), ns2ms(mHoldoff));
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Decides when it is worth entering navigation mode while idle.
+ *
+ * Entering navigation powers up the sensor and costs a number of TZ calls,
+ * and the same again to leave it. The framework usually sends its commands
+ * in bursts (cancel, enumerate, setActiveGroup, authenticate, ...), and
+ * entering navigation in between only to exit it again right after is a
+ * waste of power.
+ *
+ * The gaps between commands within a burst are tracked, and navigation is
+ * held off until the current burst has likely ended. Navigation sessions
+ * that are aborted before they amortized their own transition cost grow an
+ * additional holdoff; sessions that last shrink it again. Navigation is not
+ * entered at all while the screen is off.
+ */
+class IdlePredictor {
+   public:
+    /**
+     * Record the arrival of a HAL command that interrupts the worker.
+     * Can be called from any thread.
+     */
+    void OnCommand();
+
+    /**
+     * @return 0 when navigation should be entered now, otherwise the time
+     *         in ms to wait for a new command before asking again.
+     */
+    int NavigationDelay();
+
+    // Report the start and the end of a navigation session:
+    void NavigationEntered(nsecs_t transition_cost);
+    void NavigationExited(nsecs_t transition_cost);
+
+    /**
+     * Called when a command arrived while waiting on NavigationDelay(),
+     * meaning that a navigation session was avoided.
+     */
+    void NavigationSkipped();
+
+    void Dump(int fd);
+
+   private:
+    static bool IsScreenOn();
+
+    std::mutex mMutex;
+    nsecs_t mLastCommand = 0;
+    // Moving averages of the gap between commands within a burst, and of
+    // the time it takes to enter and exit navigation. The initial burst gap
+    // keeps the old behaviour of waiting 500ms before entering navigation.
+    nsecs_t mBurstGap = ms2ns(250);
+    nsecs_t mTransitionCost = ms2ns(20);
+    nsecs_t mHoldoff = 0;
+    nsecs_t mNavigationStart = 0, mEnterCost = 0;
+    bool mScreenOffReported = false;
+
+    uint32_t mEntered = 0, mAborted = 0, mSkipped = 0, mScreenOff = 0;
+};
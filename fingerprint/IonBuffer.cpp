@@ -13,7 +13,7 @@ IonBuffer::~IonBuffer() {
     qcom_km_ion_dealloc(&ion_info);
 }
 
-IonBuffer::IonBuffer(IonBuffer &&other) {
+IonBuffer::IonBuffer(IonBuffer &&other) : ion_info{.ion_fd = -1, .ifd_data_fd = -1, .ion_sbuffer = nullptr, .req_len = 0, .sbuf_len = 0} {
     std::swap(ion_info, other.ion_info);
 }
 
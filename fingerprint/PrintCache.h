@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/**
+ * Cache of the print ids and authenticator id of the active group.
+ *
+ * This allows answering enumerate() and similar queries without pausing the
+ * worker thread or talking to TZ. Invalidate() must be called whenever the
+ * set of prints changes (enroll, remove) or a different database is loaded
+ * (setActiveGroup).
+ *
+ * Values are loaded through a caller-provided function, outside of the lock,
+ * so that the loader is free to synchronize with the worker thread. A value
+ * loaded while the cache was invalidated is returned, but not cached.
+ */
+class PrintCache {
+    std::mutex mMutex;
+    uint64_t mGeneration = 0;
+    std::optional<std::vector<uint32_t>> mPrints;
+    std::optional<uint64_t> mAuthenticatorId;
+
+   public:
+    /**
+     * @param load int(std::vector<uint32_t> &), returning non-zero on error.
+     * @return 0, or the error returned by \p load.
+     */
+    template <typename Load>
+    int GetPrints(std::vector<uint32_t> &prints, Load &&load) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mPrints) {
+            prints = *mPrints;
+            return 0;
+        }
+        const auto generation = mGeneration;
+        lock.unlock();
+
+        prints.clear();
+        int rc = load(prints);
+        if (rc)
+            return rc;
+
+        lock.lock();
+        if (generation == mGeneration)
+            mPrints = prints;
+        return 0;
+    }
+
+    /**
+     * @param load uint64_t(), returning the authenticator id.
+     */
+    template <typename Load>
+    uint64_t GetAuthenticatorId(Load &&load) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mAuthenticatorId)
+            return *mAuthenticatorId;
+        const auto generation = mGeneration;
+        lock.unlock();
+
+        uint64_t id = load();
+
+        lock.lock();
+        if (generation == mGeneration)
+            mAuthenticatorId = id;
+        return id;
+    }
+
+    void Invalidate() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mGeneration;
+        mPrints.reset();
+        mAuthenticatorId.reset();
+    }
+};
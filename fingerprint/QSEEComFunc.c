@@ -24,11 +24,14 @@
 //#define LOG_NDEBUG 0
 
 //#define USE_QSEE_WRAPPER 1
+// QSEE_LIBRARY can be overridden from the build, see Android.mk:
+#ifndef QSEE_LIBRARY
 #ifdef USE_QSEE_WRAPPER
 #define QSEE_LIBRARY "libDSEEComAPI.so"
 #else
 #define QSEE_LIBRARY "libQSEEComAPI.so"
 #endif
+#endif
 
 #include <log/log.h>
 
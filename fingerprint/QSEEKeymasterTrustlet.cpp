@@ -29,7 +29,7 @@ MasterKey QSEEKeymasterTrustlet::GetKey() {
     req->cmd_id = 0x205;
     req->auth_type = 0x02;
 
-    int rc = SendCommand(*lockedBuffer, sizeof(keymaster_cmd_t), *lockedBuffer, 0x2400);
+    int rc = SendCommand(*lockedBuffer, sizeof(keymaster_cmd_t), *lockedBuffer, 0x2400, 0, req->cmd_id);
     if (rc)
         throw FormatException("keymaster master key retrieval failed, rc = %d", rc);
 
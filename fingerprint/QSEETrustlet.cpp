@@ -5,6 +5,7 @@
 #include <string.h>
 #include <algorithm>
 #include "FormatException.hpp"
+#include "tz_trace.h"
 
 #define LOG_TAG "FPC QSEETrustlet"
 // #define LOG_NDEBUG 0
@@ -21,7 +22,7 @@ QSEETrustlet::shutdown_app_def QSEETrustlet::shutdown_app = nullptr;
 QSEETrustlet::send_cmd_def QSEETrustlet::send_cmd = nullptr;
 QSEETrustlet::send_modified_cmd_def QSEETrustlet::send_modified_cmd = nullptr;
 
-QSEETrustlet::QSEETrustlet(const char *app_name, uint32_t shared_buffer_size, const char *path) {
+QSEETrustlet::QSEETrustlet(const char *app_name, uint32_t shared_buffer_size, const char *path) : mAppName(app_name) {
     EnsureInitialized();
 
     int rc = start_app(&mHandle, path, app_name, shared_buffer_size);
@@ -34,13 +35,14 @@ QSEETrustlet::~QSEETrustlet() {
         shutdown_app(&mHandle);
 }
 
-QSEETrustlet::QSEETrustlet(QSEETrustlet &&other) : mHandle(other.mHandle) {
+QSEETrustlet::QSEETrustlet(QSEETrustlet &&other) : mHandle(other.mHandle), mAppName(other.mAppName) {
     // Make the moved-from object invalid (preventing unlock()).
     other.mHandle = nullptr;
 }
 
 QSEETrustlet &QSEETrustlet::operator=(QSEETrustlet &&other) {
     std::swap(mHandle, other.mHandle);
+    std::swap(mAppName, other.mAppName);
     return *this;
 }
 
@@ -115,10 +117,18 @@ const void *QSEETrustlet::LockedIONBuffer::operator*() const {
     return mTrustlet->mHandle->ion_sbuffer;
 }
 
-int QSEETrustlet::SendCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len) {
-    return send_cmd(mHandle, send_buf, sbuf_len, rcv_buf, rbuf_len);
+int QSEETrustlet::SendCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len,
+                              uint32_t trace_group, uint32_t trace_cmd) {
+    const auto trace_begin = tz_trace_begin();
+    int rc = send_cmd(mHandle, send_buf, sbuf_len, rcv_buf, rbuf_len);
+    tz_trace_end(trace_begin, mAppName, trace_group, trace_cmd, sbuf_len + rbuf_len, rc);
+    return rc;
 }
 
-int QSEETrustlet::SendModifiedCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len, QSEECom_ion_fd_info *ifd_data) {
-    return send_modified_cmd(mHandle, send_buf, sbuf_len, rcv_buf, rbuf_len, ifd_data);
+int QSEETrustlet::SendModifiedCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len, QSEECom_ion_fd_info *ifd_data,
+                                      uint32_t trace_group, uint32_t trace_cmd, uint32_t ion_bytes) {
+    const auto trace_begin = tz_trace_begin();
+    int rc = send_modified_cmd(mHandle, send_buf, sbuf_len, rcv_buf, rbuf_len, ifd_data);
+    tz_trace_end(trace_begin, mAppName, trace_group, trace_cmd, sbuf_len + rbuf_len + ion_bytes, rc);
+    return rc;
 }
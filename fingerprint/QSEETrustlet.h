@@ -38,12 +38,19 @@ class QSEETrustlet {
     friend class LockedIONBuffer;
 
     LockedIONBuffer GetLockedBuffer();
-    int SendCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len);
-    int SendModifiedCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len, QSEECom_ion_fd_info *ifd_data);
+    /**
+     * The trace group and command identify the command in tz_trace_dump(),
+     * ion_bytes is the size of the data passed through ION buffers.
+     */
+    int SendCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len,
+                    uint32_t trace_group = 0, uint32_t trace_cmd = 0);
+    int SendModifiedCommand(const void *send_buf, uint32_t sbuf_len, void *rcv_buf, uint32_t rbuf_len, QSEECom_ion_fd_info *ifd_data,
+                            uint32_t trace_group = 0, uint32_t trace_cmd = 0, uint32_t ion_bytes = 0);
 
    private:
     std::mutex mBufferMutex;
     QSEECom_handle *mHandle = nullptr;
+    const char *mAppName;
 
     typedef int (*start_app_def)(struct QSEECom_handle **clnt_handle, const char *path, const char *fname, uint32_t sb_size);
     typedef int (*shutdown_app_def)(struct QSEECom_handle **clnt_handle);
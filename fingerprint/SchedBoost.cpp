@@ -0,0 +1,203 @@
+#include "SchedBoost.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <cutils/properties.h>
+
+#define LOG_TAG "FPC SchedBoost"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace {
+
+constexpr auto fifo_priority_property = "persist.vendor.fingerprint.boost.fifo_priority";
+constexpr auto uclamp_min_property = "persist.vendor.fingerprint.boost.uclamp_min";
+constexpr auto cpus_property = "persist.vendor.fingerprint.boost.cpus";
+
+constexpr auto uclamp_max_value = 1024;
+
+// From the uapi headers, which the libc headers do not provide:
+struct sched_attr_v1 {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+    uint32_t sched_util_min;
+    uint32_t sched_util_max;
+};
+constexpr uint64_t sched_flag_keep_all = 0x08 | 0x10;
+constexpr uint64_t sched_flag_util_clamp_min = 0x20;
+
+// Parses a CPU list like "0,4-7" into \p cpus:
+bool ParseCpuList(const char *list, cpu_set_t &cpus) {
+    CPU_ZERO(&cpus);
+
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+            return false;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, &cpus);
+
+        if (*end == ',')
+            ++end;
+        else if (*end)
+            return false;
+        list = end;
+    }
+
+    return CPU_COUNT(&cpus);
+}
+
+}  // namespace
+
+SchedBoost::SchedBoost()
+    : mFifoPriority(std::clamp(property_get_int32(fifo_priority_property, 0), 0,
+                               sched_get_priority_max(SCHED_FIFO))),
+      mUclampMin(std::clamp(property_get_int32(uclamp_min_property, 0), 0, uclamp_max_value)) {
+    char cpus[PROPERTY_VALUE_MAX];
+    if (property_get(cpus_property, cpus, "") > 0) {
+        mHasCpus = ParseCpuList(cpus, mCpus);
+        ALOGE_IF(!mHasCpus, "Invalid CPU list \"%s\" in %s", cpus, cpus_property);
+    }
+
+    ALOGI("Boosting authenticate and enroll with fifo_priority=%d uclamp_min=%u cpus=%s",
+          mFifoPriority, mUclampMin, mHasCpus ? cpus : "any");
+}
+
+SchedBoost::~SchedBoost() {
+    if (mSchedStatFd >= 0)
+        close(mSchedStatFd);
+}
+
+bool SchedBoost::ReadSchedStat(uint64_t &run_ns, uint64_t &wait_ns) {
+    if (mSchedStatFd < 0) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", gettid());
+        mSchedStatFd = open(path, O_RDONLY | O_CLOEXEC);
+        if (mSchedStatFd < 0)
+            return false;
+    }
+
+    char stat[64];
+    ssize_t len = pread(mSchedStatFd, stat, sizeof(stat) - 1, 0);
+    if (len <= 0) {
+        // Opened by a thread that is gone, reopen on the next call:
+        close(mSchedStatFd);
+        mSchedStatFd = -1;
+        return false;
+    }
+    stat[len] = '\0';
+    return sscanf(stat, "%" SCNu64 " %" SCNu64, &run_ns, &wait_ns) == 2;
+}
+
+bool SchedBoost::SetUclampMin(uint32_t value) {
+    sched_attr_v1 attr = {};
+    attr.size = sizeof(attr);
+    attr.sched_flags = sched_flag_keep_all | sched_flag_util_clamp_min;
+    attr.sched_util_min = value;
+
+    if (syscall(__NR_sched_setattr, 0, &attr, 0)) {
+        ALOGW("Failed to set uclamp.min to %u, disabling: %s", value, strerror(errno));
+        mUclampSupported = false;
+        return false;
+    }
+    return true;
+}
+
+void SchedBoost::Apply() {
+    if (mApplied)
+        return;
+    mApplied = true;
+
+    if (!ReadSchedStat(mStartRunNs, mStartWaitNs))
+        mStartRunNs = mStartWaitNs = 0;
+
+    if (mFifoPriority && mFifoSupported) {
+        struct sched_param param = {.sched_priority = mFifoPriority};
+        mFifoApplied = !sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
+        if (!mFifoApplied) {
+            ALOGW("Failed to switch to SCHED_FIFO, disabling: %s", strerror(errno));
+            mFifoSupported = false;
+        }
+    }
+
+    if (mUclampMin && mUclampSupported)
+        mUclampApplied = SetUclampMin(mUclampMin);
+
+    if (mHasCpus && mCpusSupported) {
+        mCpusApplied = !sched_getaffinity(0, sizeof(mSavedCpus), &mSavedCpus) &&
+                       !sched_setaffinity(0, sizeof(mCpus), &mCpus);
+        if (!mCpusApplied) {
+            ALOGW("Failed to set the CPU affinity, disabling: %s", strerror(errno));
+            mCpusSupported = false;
+        }
+    }
+}
+
+void SchedBoost::Revert() {
+    if (!mApplied)
+        return;
+    mApplied = false;
+
+    if (mFifoApplied) {
+        struct sched_param param = {.sched_priority = 0};
+        ALOGE_IF(sched_setscheduler(0, SCHED_OTHER, &param), "Failed to revert to SCHED_OTHER: %s",
+                 strerror(errno));
+        mFifoApplied = false;
+    }
+
+    if (mUclampApplied) {
+        SetUclampMin(0);
+        mUclampApplied = false;
+    }
+
+    if (mCpusApplied) {
+        ALOGE_IF(sched_setaffinity(0, sizeof(mSavedCpus), &mSavedCpus),
+                 "Failed to restore the CPU affinity: %s", strerror(errno));
+        mCpusApplied = false;
+    }
+
+    uint64_t run_ns, wait_ns;
+    if (!mStartRunNs || !ReadSchedStat(run_ns, wait_ns))
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mSessions;
+    mRunNs += run_ns - mStartRunNs;
+    mWaitNs += wait_ns - mStartWaitNs;
+    mMaxWaitNs = std::max(mMaxWaitNs, wait_ns - mStartWaitNs);
+}
+
+void SchedBoost::Dump(int fd) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    dprintf(fd, "Scheduling boost: fifo_priority=%d%s uclamp_min=%u%s cpus=%s%s\n",
+            mFifoPriority, mFifoSupported ? "" : " (unsupported)",
+            mUclampMin, mUclampSupported ? "" : " (unsupported)",
+            mHasCpus ? "restricted" : "any", mCpusSupported ? "" : " (unsupported)");
+    dprintf(fd, "  %u sessions: %" PRIu64 "ms running, %" PRIu64 "ms waiting on a run-queue "
+                "(max %" PRIu64 "ms in a session)\n",
+            mSessions, mRunNs / 1000000, mWaitNs / 1000000, mMaxWaitNs / 1000000);
+}
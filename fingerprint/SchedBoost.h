@@ -0,0 +1,63 @@
+#pragma once
+
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Scheduling boost for the worker thread while it authenticates or enrolls,
+ * so that matching a finger does not queue behind the foreground app when
+ * the user is waiting for the device to unlock.
+ *
+ * Configured through properties, each of which is off when unset:
+ *  - persist.vendor.fingerprint.boost.fifo_priority: run as SCHED_FIFO
+ *    with this priority (1-99);
+ *  - persist.vendor.fingerprint.boost.uclamp_min: minimum utilization clamp
+ *    (1-1024), on kernels that support it;
+ *  - persist.vendor.fingerprint.boost.cpus: CPU list to run on, like "4-7".
+ *
+ * The time spent waiting on a run-queue during boosted operations is
+ * recorded either way, to judge the effect of these settings.
+ */
+class SchedBoost {
+   public:
+    SchedBoost();
+    ~SchedBoost();
+
+    SchedBoost(const SchedBoost &) = delete;
+    SchedBoost &operator=(const SchedBoost &) = delete;
+
+    // Must be called from the thread to boost:
+    void Apply();
+    void Revert();
+
+    void Dump(int fd);
+
+   private:
+    // Reads the run and run-queue wait time of the calling thread, in ns:
+    bool ReadSchedStat(uint64_t &run_ns, uint64_t &wait_ns);
+
+    bool SetUclampMin(uint32_t value);
+
+    int mFifoPriority;
+    uint32_t mUclampMin;
+    bool mHasCpus = false;
+    cpu_set_t mCpus;
+
+    // Reset when the kernel or the policy rejects a setting:
+    std::atomic<bool> mFifoSupported{true}, mUclampSupported{true}, mCpusSupported{true};
+
+    // Only used by the boosted thread:
+    bool mApplied = false, mFifoApplied = false, mUclampApplied = false, mCpusApplied = false;
+    // Its schedstat file, kept open so that reverting stays cheap when an
+    // operation is cancelled:
+    int mSchedStatFd = -1;
+    cpu_set_t mSavedCpus;
+    uint64_t mStartRunNs = 0, mStartWaitNs = 0;
+
+    std::mutex mMutex;
+    uint32_t mSessions = 0;
+    uint64_t mRunNs = 0, mWaitNs = 0, mMaxWaitNs = 0;
+};
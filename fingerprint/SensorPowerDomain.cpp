@@ -0,0 +1,137 @@
+#include "SensorPowerDomain.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <cutils/properties.h>
+
+#define LOG_TAG "FPC PowerDomain"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace {
+
+constexpr auto linger_property = "persist.vendor.fingerprint.power_linger_ms";
+
+}  // namespace
+
+SensorPowerDomain::SensorPowerDomain(const char *name, std::function<int(bool)> set_power)
+    : mName(name),
+      mSetPower(std::move(set_power)),
+      mLinger(ms2ns(std::max(0, property_get_int32(linger_property, default_linger_ms)))),
+      mTimer(&SensorPowerDomain::TimerLoop, this) {
+    ALOGI("%s: Powering down %" PRId64 "ms after the last user", mName, ns2ms(mLinger));
+}
+
+SensorPowerDomain::~SensorPowerDomain() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit = true;
+        ALOGW_IF(mRefs, "%s: Destroyed with %u references held", mName, mRefs);
+        if (mPowered)
+            SetPower(false);
+    }
+    mCondition.notify_one();
+    mTimer.join();
+}
+
+int SensorPowerDomain::SetPower(bool on) {
+    int rc = mSetPower(on);
+    if (rc < 0) {
+        ALOGE("%s: Failed to power %s: %d", mName, on ? "up" : "down", rc);
+        ++mFailures;
+        return rc;
+    }
+
+    ALOGV("%s: Powered %s", mName, on ? "up" : "down");
+    mPowered = on;
+    if (on)
+        ++mPowerUps;
+    else
+        ++mPowerDowns;
+    return 0;
+}
+
+SensorPowerDomain::Reference SensorPowerDomain::Acquire() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mPowerOffAt = 0;
+    if (mPowered) {
+        if (!mRefs)
+            ++mReused;
+    } else if (SetPower(true) < 0) {
+        if (!mRefs)
+            // Don't leave the sensor in an unknown state:
+            mSetPower(false);
+        return Reference();
+    }
+
+    ++mRefs;
+    return Reference(this);
+}
+
+void SensorPowerDomain::Release() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        LOG_ALWAYS_FATAL_IF(!mRefs, "%s: Released more references than acquired", mName);
+        if (--mRefs)
+            return;
+
+        if (!mLinger) {
+            SetPower(false);
+            return;
+        }
+        mPowerOffAt = systemTime(SYSTEM_TIME_MONOTONIC) + mLinger;
+    }
+    mCondition.notify_one();
+}
+
+void SensorPowerDomain::Flush() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mRefs || !mPowered)
+        return;
+
+    mPowerOffAt = 0;
+    SetPower(false);
+}
+
+void SensorPowerDomain::Resync() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const bool on = mRefs;
+
+    ALOGD("%s: Resync to %s", mName, on ? "on" : "off");
+    mPowerOffAt = 0;
+    SetPower(on);
+}
+
+void SensorPowerDomain::TimerLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!mExit) {
+        if (!mPowerOffAt) {
+            mCondition.wait(lock);
+            continue;
+        }
+
+        const auto now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (now < mPowerOffAt) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(mPowerOffAt - now));
+            continue;
+        }
+
+        mPowerOffAt = 0;
+        if (!mRefs && mPowered)
+            SetPower(false);
+    }
+}
+
+void SensorPowerDomain::Dump(int fd) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    dprintf(fd, "Power (%s): %s, %u users, linger %" PRId64 "ms\n",
+            mName, mPowered ? "on" : "off", mRefs, ns2ms(mLinger));
+    dprintf(fd, "  %u power-ups, %u power-downs, %u reused while lingering, %u failures\n",
+            mPowerUps, mPowerDowns, mReused, mFailures);
+}
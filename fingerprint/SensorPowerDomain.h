@@ -0,0 +1,116 @@
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * Reference-counted power state of the sensor.
+ *
+ * Every operation that needs the sensor holds a Reference for its duration.
+ * The sensor is powered up by the first reference and only powered down
+ * after the last one has been released for the linger time, so that
+ * back-to-back operations (a failed match followed by a retry, or
+ * authentication followed by navigation) keep using the powered sensor.
+ *
+ * The linger time defaults to default_linger_ms and can be overridden with
+ * the persist.vendor.fingerprint.power_linger_ms property; 0 powers down
+ * immediately, like before.
+ */
+class SensorPowerDomain {
+   public:
+    /**
+     * @param set_power Switches the sensor on or off, returns a negative
+     *                  value on failure. Called with an internal lock held,
+     *                  from the caller of Acquire() or from the linger timer.
+     */
+    SensorPowerDomain(const char *name, std::function<int(bool)> set_power);
+    ~SensorPowerDomain();
+
+    SensorPowerDomain(const SensorPowerDomain &) = delete;
+    SensorPowerDomain &operator=(const SensorPowerDomain &) = delete;
+
+    class Reference {
+        SensorPowerDomain *mDomain;
+
+       public:
+        explicit Reference(SensorPowerDomain *domain = nullptr) : mDomain(domain) {}
+        Reference(Reference &&other) : mDomain(other.mDomain) {
+            other.mDomain = nullptr;
+        }
+        ~Reference() {
+            Release();
+        }
+
+        Reference &operator=(Reference &&other) {
+            Release();
+            std::swap(mDomain, other.mDomain);
+            return *this;
+        }
+
+        /**
+         * False when powering up the sensor failed.
+         */
+        explicit operator bool() const {
+            return mDomain;
+        }
+
+        void Release() {
+            if (mDomain)
+                mDomain->Release();
+            mDomain = nullptr;
+        }
+    };
+
+    /**
+     * Power up the sensor, unless it is already.
+     *
+     * @return A reference keeping the sensor powered, which is empty when
+     *         powering up failed.
+     */
+    Reference Acquire();
+
+    /**
+     * Power down now when no references are held, instead of waiting
+     * for the linger time. Call before the device is closed.
+     */
+    void Flush();
+
+    /**
+     * Apply the wanted power state again, after the device was
+     * power-cycled behind our back (for example by a reinitialization).
+     */
+    void Resync();
+
+    void Dump(int fd);
+
+   private:
+    static constexpr auto default_linger_ms = 500;
+
+    void Release();
+    void TimerLoop();
+    // Must be called with mMutex held:
+    int SetPower(bool on);
+
+    const char *mName;
+    const std::function<int(bool)> mSetPower;
+    const nsecs_t mLinger;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    unsigned mRefs = 0;
+    bool mPowered = false;
+    // Power down at this time, when non-zero:
+    nsecs_t mPowerOffAt = 0;
+    bool mExit = false;
+
+    uint32_t mPowerUps = 0, mPowerDowns = 0, mReused = 0, mFailures = 0;
+
+    // Started last, after everything it uses is initialized:
+    std::thread mTimer;
+};
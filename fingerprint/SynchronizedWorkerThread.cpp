@@ -22,6 +22,10 @@
 #include <sys/poll.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 #define LOG_TAG "FPC WT"
 // #define LOG_NDEBUG 0
 #include <log/log.h>
@@ -44,18 +48,21 @@ static const char *AsyncStateToChar(const AsyncState state) {
 
 #undef ENUM_STR
 
-    ALOGE("%s: Unknown enum state %d", __func__, state);
+    ALOGE("%s: Unknown enum state %d", __func__, static_cast<int>(state));
     return "UNKNOWN (SEE PREVIOUS ERROR)";
 }
 
 void WorkHandler::IdleAsync() {
     // The default implementation blocks indefinitely
-    getWorker().isEventAvailable(-1);
+    getWorker().waitForStateRequest(-1);
 }
 
 Thread::Thread(WorkHandler *handler) : mHandler(handler) {
     LOG_ALWAYS_FATAL_IF(!mHandler, "WorkHandler is null!");
 
+    for (size_t i = 0; i < mQueue.size(); ++i)
+        mQueue[i].slot_seq = i;
+
     event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     LOG_ALWAYS_FATAL_IF(event_fd < 0, "Failed to create eventfd: %s", strerror(errno));
 }
@@ -86,74 +93,298 @@ void Thread::RunThread() {
                 mHandler->IdleAsync();
                 break;
             case AsyncState::Pause:
-                isEventAvailable(-1);
-                // Poll always returns if the data in the eventfd is non-zero.
+                // Wait like a worker that was paused while parked, so that
+                // Resume() and a Pause() right after it need no handoff.
+                // Posted work is held back until the pause ends:
+                mPark = Park::PausedAwake;
+                unpark();
                 break;
             case AsyncState::Authenticate:
+                mBoost.Apply();
                 mHandler->AuthenticateAsync();
+                mBoost.Revert();
                 break;
             case AsyncState::Enroll:
+                mBoost.Apply();
                 mHandler->EnrollAsync();
+                mBoost.Revert();
                 break;
-            case AsyncState::Stop:
+            case AsyncState::Stop: {
                 ALOGI("Stopping Thread");
+                std::unique_lock<std::mutex> lock(mPostMutex);
+                mAcceptPosts = false;
+                lock.unlock();
+                // Don't leave anyone waiting for a result:
+                runPosted();
                 return;
+            }
             default:
                 ALOGW("Unexpected AsyncState %s", AsyncStateToChar(nextState));
                 break;
         }
-        currentState = AsyncState::Idle;
+        mCurrentState = AsyncState::Idle;
+        // Work that waited for the operation or pause to end, before the
+        // next state may start another one:
+        runPosted();
     }
 }
 
 void Thread::Start() {
+    {
+        std::lock_guard<std::mutex> lock(mPostMutex);
+        mAcceptPosts = true;
+    }
     thread = std::thread(ThreadStart, this);
 }
 
 void Thread::Stop() {
-    std::unique_lock<std::mutex> writerLock(mEventWriterMutex);
-    std::unique_lock<std::mutex> threadLock(mThreadMutex);
+    std::lock_guard<std::mutex> lock(mWaitMutex);
 
     if (thread.joinable()) {
         ALOGW("Requesting thread to stop");
-        auto success = waitForState(AsyncState::Stop, writerLock, threadLock);
+        auto success = waitForStateLocked(AsyncState::Stop);
         LOG_ALWAYS_FATAL_IF(!success, "Failed to stop thread!");
         thread.join();
     }
 }
 
 bool Thread::Pause() {
+    // A parked worker is paused where it waits, without a handoff:
+    auto park = Park::Parked;
+    if (!mPending && mPark.compare_exchange_strong(park, Park::Paused)) {
+        ALOGV("Paused parked thread");
+        return true;
+    }
+
     ALOGV("Waiting for thread to pause");
     return waitForState(AsyncState::Pause);
 }
 
 bool Thread::Resume() {
-    ALOGV("Requesting thread to resume");
-    return moveToState(AsyncState::Idle);
+    auto park = Park::Paused;
+    if (!mPark.compare_exchange_strong(park, Park::Parked) &&
+        !(park == Park::PausedAwake && mPark.compare_exchange_strong(park, Park::Parked))) {
+        ALOGV("Requesting thread to resume");
+        return moveToState(AsyncState::Idle);
+    }
+
+    ALOGV("Resumed parked thread");
+    // A worker that is still waiting only needs to run held back work:
+    if (park == Park::PausedAwake || mPostedCount) {
+        int rc = eventfd_write(event_fd, 1);
+        ALOGE_IF(rc, "%s: Failed to write event-available to eventfd: %d", __func__, rc);
+    }
+    return true;
 }
 
 AsyncState Thread::consumeState() {
-    std::unique_lock<std::mutex> lock(mThreadMutex);
+    struct {
+        AsyncState state = AsyncState::Invalid;
+        bool waited = false;
+        uint64_t wait_seq = 0;
+    } pick;
     eventfd_t stateAvailable;
-    AsyncState state = AsyncState::Idle;
+    unsigned consumed = 0;
+
+    for (;;) {
+        auto &request = mQueue[mDequeuePos % queue_size];
+        if (request.slot_seq.load(std::memory_order_acquire) != mDequeuePos + 1) {
+            if (mEnqueuePos.load(std::memory_order_acquire) == mDequeuePos)
+                // Empty:
+                break;
+            // Claimed, and about to be published. Picking it up in this pass
+            // saves restarting the new state for it right away:
+            std::this_thread::yield();
+            continue;
+        }
+        const auto seq = mDequeuePos + 1;
+
+        if (pick.state != AsyncState::Invalid) {
+            if (request.state == pick.state) {
+                ALOGV("%s: Merging %s", __func__, AsyncStateToChar(request.state));
+            } else if (pick.state == AsyncState::Pause && request.state == AsyncState::Idle) {
+                ALOGV("%s: Pause and resume cancel out", __func__);
+                if (pick.waited)
+                    resolveWaiter(pick.wait_seq, false);
+                if (request.waited)
+                    resolveWaiter(seq, false);
+                pick = {};
+                request.slot_seq.store(mDequeuePos + queue_size, std::memory_order_release);
+                ++mDequeuePos;
+                ++consumed;
+                continue;
+            } else if (pick.waited) {
+                // Must be entered, handle the rest on the next pass:
+                break;
+            } else {
+                ALOGV("%s: %s superseded by %s", __func__, AsyncStateToChar(pick.state),
+                      AsyncStateToChar(request.state));
+                pick = {};
+            }
+        }
 
-    int rc = eventfd_read(event_fd, &stateAvailable);
-    // When data is read, stateAvailable will be non-zero.
-    if (!rc) {
-        LOG_ALWAYS_FATAL_IF(desiredState == AsyncState::Invalid,
-                            "Requested state is invalid!");
-        state = desiredState;
+        pick.state = request.state;
+        if (request.waited) {
+            pick.waited = true;
+            pick.wait_seq = seq;
+        }
+
+        request.slot_seq.store(mDequeuePos + queue_size, std::memory_order_release);
+        ++mDequeuePos;
+        ++consumed;
+    }
+
+    // Producers signal the eventfd before publishing their request, so this
+    // clears the signal of everything consumed above; a signal left behind
+    // would interrupt the new state for nothing. Requests that are still
+    // queued, or were queued meanwhile by a producer that saw requests
+    // pending and did not write the eventfd, signal it again.
+    // Posted work gets to run in, or cancel, the new state, like it would
+    // have if it had arrived later:
+    eventfd_read(event_fd, &stateAvailable);
+    if (mPending.fetch_sub(consumed) != consumed || mPostedCount) {
+        int wrc = eventfd_write(event_fd, 1);
+        ALOGE_IF(wrc, "%s: Failed to write event-available to eventfd: %d", __func__, wrc);
+    }
+
+    auto state = pick.state;
+    if (state == AsyncState::Invalid) {
+        // Woken up for posted work, or requests that cancelled out:
+        ALOGV_IF(!consumed, "%s: Woken up without requests", __func__);
+        state = AsyncState::Idle;
     }
 
     ALOGV("%s: Consumed state %s", __func__, AsyncStateToChar(state));
 
-    currentState = state;
-    desiredState = AsyncState::Invalid;
+    mCurrentState = state;
+    if (pick.waited)
+        resolveWaiter(pick.wait_seq, true);
+
+    return state;
+}
+
+void Thread::resolveWaiter(uint64_t seq, bool entered) {
+    mWaitOutcome = seq << 1 | entered;
 
-    lock.unlock();
+    if (mWaiting) {
+        // Serialize with the waiter checking mWaitOutcome, to not lose
+        // the notification:
+        std::lock_guard<std::mutex> lock(mNotifyMutex);
+    }
     mThreadStateChanged.notify_all();
+}
 
-    return state;
+bool Thread::postTask(std::function<void()> task, WhenBusy when_busy) {
+    {
+        std::lock_guard<std::mutex> lock(mPostMutex);
+        if (!mAcceptPosts)
+            return false;
+        mPosted.push_back({std::move(task), when_busy});
+        ++mPostedCount;
+    }
+
+    int rc = eventfd_write(event_fd, 1);
+    ALOGE_IF(rc, "%s: Failed to write event-available to eventfd: %d", __func__, rc);
+    return true;
+}
+
+static bool IsBusy(AsyncState state) {
+    return state == AsyncState::Authenticate || state == AsyncState::Enroll;
+}
+
+bool Thread::runPosted() {
+    eventfd_t value;
+    std::deque<Posted> tasks;
+    bool cancel = false;
+
+    // Woken up for a state request only: leave the eventfd signalled for
+    // consumeState(), instead of draining and rewriting it.
+    if (mPending && !mPostedCount)
+        return true;
+
+    // Drain the eventfd before taking the work, so that work posted
+    // afterwards leaves it signalled:
+    eventfd_read(event_fd, &value);
+
+    if (mPostedCount) {
+        std::lock_guard<std::mutex> lock(mPostMutex);
+        if (IsBusy(mCurrentState)) {
+            // Deferred work is picked up again once the operation ended, by
+            // RunThread():
+            cancel = std::any_of(mPosted.begin(), mPosted.end(), [](const auto &posted) {
+                return posted.when_busy == WhenBusy::Cancel;
+            });
+        } else {
+            tasks.swap(mPosted);
+            mPostedCount -= tasks.size();
+        }
+    }
+
+    for (auto &posted : tasks)
+        posted.task();
+    ALOGV_IF(!tasks.empty(), "%s: Ran %zu tasks", __func__, tasks.size());
+
+    if (!mPending && !cancel)
+        return false;
+
+    // The eventfd write of the state request, or of the cancelling work, may
+    // have been drained above:
+    int rc = eventfd_write(event_fd, 1);
+    ALOGE_IF(rc, "%s: Failed to write event-available to eventfd: %d", __func__, rc);
+    return true;
+}
+
+bool Thread::waitForStateRequest(int timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    for (;;) {
+        if (runPosted())
+            return true;
+
+        int remaining = timeout;
+        if (timeout > 0)
+            remaining = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                 deadline - std::chrono::steady_clock::now())
+                                                 .count());
+        if (!park(remaining))
+            return false;
+    }
+}
+
+bool Thread::park(int timeout) {
+    mPark = Park::Parked;
+    bool available = isEventAvailable(timeout);
+    // Whatever woke up a worker that was paused meanwhile may be stale:
+    return unpark() || available;
+}
+
+bool Thread::unpark() {
+    for (bool paused = false;; paused = true) {
+        auto park = Park::Parked;
+        if (mPark.compare_exchange_strong(park, Park::Running))
+            return paused;
+
+        // A state request ends the pause, and is consumed next:
+        if (mPending) {
+            if (mPark.compare_exchange_strong(park, Park::Running))
+                return true;
+            continue;
+        }
+
+        // Anything else, posted work and timeouts included, waits until
+        // Resume(), which wakes the worker once it is marked awake. Requests
+        // are checked after draining, which may have eaten their signal:
+        if (park == Park::Paused && !mPark.compare_exchange_strong(park, Park::PausedAwake))
+            continue;
+        eventfd_t value;
+        eventfd_read(event_fd, &value);
+        if (mPark == Park::PausedAwake && !mPending)
+            isEventAvailable(-1);
+    }
+}
+
+void Thread::Dump(int fd) {
+    mBoost.Dump(fd);
 }
 
 bool Thread::isEventAvailable(int timeout) const {
@@ -175,59 +406,94 @@ bool Thread::isEventAvailable(int timeout) const {
     return available;
 }
 
-bool Thread::moveToState(AsyncState state) {
-    std::unique_lock<std::mutex> writerLock(mEventWriterMutex);
-    std::unique_lock<std::mutex> threadLock(mThreadMutex);
-    return moveToState(state, writerLock, threadLock);
-}
+uint64_t Thread::requestState(AsyncState state, bool waited) {
+    ALOGD("%s: Setting state to %s", __func__, AsyncStateToChar(state));
 
-bool Thread::waitForState(AsyncState state) {
-    std::unique_lock<std::mutex> writerLock(mEventWriterMutex);
-    std::unique_lock<std::mutex> threadLock(mThreadMutex);
-    return waitForState(state, writerLock, threadLock);
-}
+    // The worker drains the whole ring on every wakeup, a full ring only
+    // means it was not scheduled yet. Dropping the request would lose it:
+    constexpr auto full_timeout = std::chrono::milliseconds(500);
+    constexpr auto full_backoff = std::chrono::microseconds(200);
+    const auto deadline = std::chrono::steady_clock::now() + full_timeout;
 
-bool Thread::moveToState(AsyncState state, std::unique_lock<std::mutex> &writerLock, std::unique_lock<std::mutex> &threadLock) {
-    LOG_ALWAYS_FATAL_IF(writerLock.mutex() != &mEventWriterMutex || !writerLock.owns_lock(),
-                        "Caller didn't lock mEventWriterMutex!");
-    LOG_ALWAYS_FATAL_IF(threadLock.mutex() != &mThreadMutex || !threadLock.owns_lock(),
-                        "Caller didn't lock mThreadMutex!");
+    // Claim a slot in the ring:
+    auto pos = mEnqueuePos.load(std::memory_order_relaxed);
+    Request *request;
+    for (;;) {
+        request = &mQueue[pos % queue_size];
+        const auto slot_seq = request->slot_seq.load(std::memory_order_acquire);
+        const auto diff = static_cast<int64_t>(slot_seq - pos);
+        if (!diff) {
+            if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                ALOGE("%s: Request queue is full, dropping %s", __func__,
+                      AsyncStateToChar(state));
+                return 0;
+            }
+            ALOGV("%s: Request queue is full, waiting for the worker", __func__);
+            std::this_thread::sleep_for(full_backoff);
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
+        } else {
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
 
-    ALOGD("%s: Setting state to %s", __func__, AsyncStateToChar(state));
+    // Count and signal the request before publishing it: once published,
+    // the worker may consume it, subtract it from mPending and clear the
+    // eventfd right away, and a later write would be a stale wakeup.
+    if (mPending.fetch_add(1)) {
+        // The worker is woken up by the eventfd write of an earlier
+        // request, or signals itself for the remainder of the queue.
+        ALOGV("%s: Queued behind pending requests", __func__);
+    } else {
+        int rc = eventfd_write(event_fd, 1);
+        ALOGE_IF(rc, "%s: Failed to write event-available to eventfd: %d", __func__, rc);
+    }
 
-    if (desiredState != AsyncState::Invalid)
-        ALOGW("Previous state %s was not consumed. Overriding to %s!",
-              AsyncStateToChar(desiredState), AsyncStateToChar(state));
+    request->state = state;
+    request->waited = waited;
+    request->slot_seq.store(pos + 1, std::memory_order_release);
+    return pos + 1;
+}
 
-    desiredState = state;
+bool Thread::moveToState(AsyncState state) {
+    return requestState(state);
+}
 
-    int rc = eventfd_write(event_fd, 1);
-    if (rc)
-        ALOGE("%s: Failed to write event-available to eventfd: %d", __func__, rc);
-    return !rc;
+bool Thread::waitForState(AsyncState state) {
+    std::lock_guard<std::mutex> lock(mWaitMutex);
+    return waitForStateLocked(state);
 }
 
-bool Thread::waitForState(AsyncState state, std::unique_lock<std::mutex> &writerLock, std::unique_lock<std::mutex> &threadLock) {
+bool Thread::waitForStateLocked(AsyncState state) {
     constexpr auto wait_timeout = std::chrono::seconds(3);
 
-    // WARNING: moveToState validates the locks. If critical code is
-    // inserted, be sure to apply the same validation here as well!
-
-    if (!moveToState(state, writerLock, threadLock)) {
+    mWaiting = true;
+    const auto seq = requestState(state, true);
+    if (!seq) {
+        mWaiting = false;
         ALOGE("Failed to transition from %s to %s",
-              AsyncStateToChar(currentState), AsyncStateToChar(state));
+              AsyncStateToChar(mCurrentState), AsyncStateToChar(state));
         return false;
     }
 
-    // Wait for the thread to enter the new state:
-    bool success = mThreadStateChanged.wait_for(threadLock, wait_timeout, [state, this]() {
-        return currentState == state;
+    // Wait for the thread to enter the new state, or to coalesce it away:
+    std::unique_lock<std::mutex> lock(mNotifyMutex);
+    bool success = mThreadStateChanged.wait_for(lock, wait_timeout, [seq, this]() {
+        return mWaitOutcome >> 1 == seq;
     });
+    mWaiting = false;
 
     // Always crash, instead of blocking forever:
     LOG_ALWAYS_FATAL_IF(!success,
                         "Timed out waiting for %s for %llds. Are you writing race conditions??",
-                        AsyncStateToChar(state), wait_timeout.count());
+                        AsyncStateToChar(state), static_cast<long long>(wait_timeout.count()));
+
+    if (!(mWaitOutcome & 1)) {
+        ALOGW("%s: %s was cancelled out by a later request", __func__, AsyncStateToChar(state));
+        return false;
+    }
 
     ALOGD("%s: Successfully switched to %s", __func__, AsyncStateToChar(state));
 
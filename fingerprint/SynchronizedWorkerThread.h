@@ -16,7 +16,16 @@
 
 #pragma once
 
+#include "SchedBoost.h"
+
+#include <array>
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
 
@@ -33,6 +42,17 @@ enum class AsyncState {
     Stop,
 };
 
+/**
+ * What posted work does to an ongoing authentication or enrollment, see
+ * Thread::post().
+ */
+enum class WhenBusy {
+    // Wait for the operation to end:
+    Defer,
+    // Cancel the operation, like Pause() does:
+    Cancel,
+};
+
 struct WorkHandler {
     virtual Thread &getWorker() = 0;
 
@@ -46,15 +66,78 @@ struct WorkHandler {
 };
 
 class Thread {
-    AsyncState currentState = AsyncState::Invalid, desiredState = AsyncState::Invalid;
+    /**
+     * State requests are queued in a bounded multi-producer ring, and the
+     * worker drains everything that is queued in one wakeup. Requests in a
+     * burst are coalesced:
+     *  - consecutive requests for the same state merge into one;
+     *  - a Pause directly followed by a resume (Idle) cancels out;
+     *  - any other request that nobody waits for is superseded by the next.
+     * A request that is waited for is always entered, unless it merges or
+     * cancels out, and the requests after it stay queued.
+     *
+     * The eventfd is only used to wake up the worker, and is only written
+     * when no request was pending already. Requests are counted in mPending
+     * before they are published, so the worker never consumes a request it
+     * has not accounted for. When the ring is full, producers wait for the
+     * worker to drain it.
+     */
+    static constexpr size_t queue_size = 16;
+
+    struct Request {
+        // Sequence number of the slot in the ring, see Enqueue/Peek:
+        std::atomic<uint64_t> slot_seq;
+        AsyncState state;
+        bool waited;
+    };
+
+    std::array<Request, queue_size> mQueue;
+    std::atomic<uint64_t> mEnqueuePos{0};
+    // Only accessed by the worker:
+    uint64_t mDequeuePos = 0;
+    std::atomic<unsigned> mPending{0};
+
+    std::atomic<AsyncState> mCurrentState{AsyncState::Invalid};
+    /**
+     * While the worker waits in waitForStateRequest() or is paused, it holds
+     * nothing, and Pause() and Resume() only flip this instead of handing
+     * the worker a request; it finds out when it wakes up, see unpark().
+     */
+    enum class Park {
+        Running,
+        Parked,
+        // Paused while parked:
+        Paused,
+        // Woken up while paused, Resume() has to wake it again:
+        PausedAwake,
+    };
+    std::atomic<Park> mPark{Park::Running};
     int event_fd;
+    /**
+     * Only taken by callers that block until the worker entered their
+     * state. mWaitMutex serializes those, mNotifyMutex guards the condition
+     * variable that the worker signals when a waiter is present.
+     */
+    std::mutex mWaitMutex, mNotifyMutex;
     std::condition_variable mThreadStateChanged;
+    std::atomic<bool> mWaiting{false};
+    // Sequence number of the last waited-for request that was handled,
+    // shifted left by one, with the low bit set when it was entered:
+    std::atomic<uint64_t> mWaitOutcome{0};
     /**
-     * Two mutexes are required to syncronize between multiple invocations of moveToState/waitForState,
-     * and between waitForState and consumeState (called in the worker thread).
+     * Work posted by other threads, run by the worker whenever it is idle.
+     * mPostedCount mirrors the size of mPosted, to check it without the lock.
      */
-    std::mutex mEventWriterMutex,
-        mThreadMutex;
+    struct Posted {
+        std::function<void()> task;
+        WhenBusy when_busy;
+    };
+    std::mutex mPostMutex;
+    std::deque<Posted> mPosted;
+    std::atomic<unsigned> mPostedCount{0};
+    bool mAcceptPosts = false;
+    // Applied while authenticating or enrolling:
+    SchedBoost mBoost;
     std::thread thread;
     WorkHandler *mHandler;
 
@@ -77,10 +160,63 @@ class Thread {
     bool moveToState(AsyncState);
     bool waitForState(AsyncState);
 
+    /**
+     * Run \p task on the worker, without pausing it. The worker runs posted
+     * work inline while it is idle, also in between navigation polls, so an
+     * idle navigation session survives. Posted work is held back until a
+     * pause ends.
+     *
+     * Posted work never runs during an authentication or enrollment, which
+     * may be talking to the TZ app at any point. Depending on \p when_busy,
+     * it waits for the operation to end, or cancels it. Handlers that do not
+     * check runPosted() end the operation either way.
+     *
+     * @return The future result of \p task.
+     */
+    template <typename Task>
+    auto post(Task &&task, WhenBusy when_busy = WhenBusy::Defer)
+        -> std::future<decltype(task())> {
+        using Result = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<Task>(task));
+        auto future = packaged->get_future();
+        if (!postTask([packaged] { (*packaged)(); }, when_busy))
+            // The worker is not running, nothing is racing with the caller:
+            (*packaged)();
+        return future;
+    }
+
+    /**
+     * Run all posted work. Only to be called from the worker thread. During
+     * an authentication or enrollment, nothing runs: posted work is left
+     * for when the operation ended.
+     *
+     * @return Whether a state request or work that cancels the operation
+     *         is pending, and the current operation needs to be aborted.
+     */
+    bool runPosted();
+
+    /**
+     * Like isEventAvailable(), but runs posted work while waiting, and only
+     * returns true for a state request. Only to be called from the worker
+     * thread, while it is idle.
+     */
+    bool waitForStateRequest(int timeout);
+
+    void Dump(int fd);
+
    private:
-    // Unsafe functions, both locks need to lock private mEventWriterMutex
-    bool moveToState(AsyncState, std::unique_lock<std::mutex> &writerLock, std::unique_lock<std::mutex> &threadLock);
-    bool waitForState(AsyncState, std::unique_lock<std::mutex> &writerLock, std::unique_lock<std::mutex> &threadLock);
+    // Like isEventAvailable(), but sits out a pause taken meanwhile:
+    bool park(int timeout);
+    // Returns once the worker is neither parked nor paused, and whether it
+    // was paused:
+    bool unpark();
+    // Returns the sequence number of the request, or 0 on failure:
+    uint64_t requestState(AsyncState, bool waited = false);
+    void resolveWaiter(uint64_t seq, bool entered);
+    // Returns false when the worker is not running:
+    bool postTask(std::function<void()>, WhenBusy);
+    // Requires mWaitMutex to be held:
+    bool waitForStateLocked(AsyncState);
 };
 
 }  // namespace SynchronizedWorker
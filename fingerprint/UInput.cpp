@@ -1,11 +1,10 @@
 #include "UInput.h"
 #include <errno.h>
-#include <string.h>
-#include <unistd.h>
 
 #define LOG_TAG "FPC UInput"
 #include <log/log.h>
 
+// This name must match the keylayout/idc filename in /vendor/usr/{keylayout,idc}:
 #define UINPUT_FPC_DEVICE_NAME "uinput-fpc"
 
 UInput::UInput() {
@@ -19,111 +18,37 @@ UInput::~UInput() {
 }
 
 void UInput::Click(unsigned short keycode) {
+    // Only fails when the emitter queue is full, the click is dropped then:
     int rc = fpc_uinput_click(&uinput, keycode);
-    LOG_ALWAYS_FATAL_IF(rc, "Failed to write uinput event: %d", rc);
+    ALOGW_IF(rc, "Failed to queue uinput event: %d", rc);
+}
+
+void UInput::Dump(int fd) {
+    fpc_uinput_dump(&uinput, fd);
 }
 
 int fpc_uinput_create(fpc_uinput_t *uinput)
 {
-    int rc = 0;
-    struct uinput_setup usetup = {
-        .id.bustype = BUS_VIRTUAL,
+    static const unsigned short keycodes[] = {
+        KEY_LEFT,
+        KEY_DOWN,
+        KEY_UP,
+        KEY_RIGHT,
+        // See WAKE_ON_FINGER_PROPERTY:
+        KEY_WAKEUP,
+        // See fpc_navi_poll: These keys are not used:
+        // 0x133, 0x134, KEY_PROG3, KEY_PROG4,
     };
-    // This name must match the keylayout/idc filename in /vendor/usr/{keylayout,idc}:
-    strcpy(usetup.name, UINPUT_FPC_DEVICE_NAME);
-
-    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-
-    if (fd == -1) {
-        ALOGE("Failed to open /dev/uinput: errno=%d", errno);
-        return errno;
-    }
-
-    rc |= ioctl(fd, UI_SET_EVBIT, EV_KEY);
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_LEFT);
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_DOWN);
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_UP);
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_RIGHT);
-
-    // See fpc_navi_poll: These keys are not used:
-    /*
-    rc |= ioctl(fd, UI_SET_KEYBIT, 0x133);
-    rc |= ioctl(fd, UI_SET_KEYBIT, 0x134);
-
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_PROG3);
-    rc |= ioctl(fd, UI_SET_KEYBIT, KEY_PROG4);
-    */
-
-    if (rc < 0) {
-        ALOGE("Failed to set up event- or key_bit: rc=%d: %s", rc, strerror(errno));
-        close(fd);
-        return rc;
-    }
 
-    rc = ioctl(fd, UI_DEV_SETUP, &usetup);
-    if (rc < 0) {
-        ALOGW("Failed to setup uinput device! rc=%d: %s, falling back to write.", rc, strerror(errno));
-
-        struct uinput_user_dev usetup_legacy = {
-            .id.bustype = BUS_VIRTUAL,
-        };
-
-        strcpy(usetup_legacy.name, UINPUT_FPC_DEVICE_NAME);
-
-        rc = TEMP_FAILURE_RETRY(write(fd, &usetup_legacy, sizeof(usetup_legacy)));
-        if (rc < 0) {
-            ALOGE("Failed to setup uinput device! rc=%d: %s", rc, strerror(errno));
-            close(fd);
-            return rc;
-        } else if (rc != sizeof(usetup_legacy)) {
-            ALOGE("Didn't write full usetup_legacy, only %d/%zu bytes!", rc, sizeof(usetup_legacy));
-            /* The kernel _should_ always accept the full object. */
-            close(fd);
-            return -EBUSY;
-        }
-    }
-
-    rc = ioctl(fd, UI_DEV_CREATE);
-    if (rc < 0) {
-        ALOGE("Failed to create uinput device! rc=%d: %s", rc, strerror(errno));
-        close(fd);
-        return rc;
-    }
-
-    ALOGI("Successfully created uinput device! rc=%d", rc);
-
-    uinput->fd = fd;
-    return 0;
+    uinput->emitter = uinput_emitter_create(UINPUT_FPC_DEVICE_NAME, keycodes,
+                                            sizeof(keycodes) / sizeof(*keycodes));
+    return uinput->emitter ? 0 : -ENODEV;
 }
 
 int fpc_uinput_destroy(fpc_uinput_t *uinput)
 {
-    int rc = ioctl(uinput->fd, UI_DEV_DESTROY);
-    if (rc < 0)
-        ALOGE("Failed to close uinput device! rc=%d: %s", rc, strerror(errno));
-    close(uinput->fd);
-    uinput->fd = -1;
-    return 0;
-}
-
-static int fpc_write_input_event(const fpc_uinput_t *uinput, unsigned short type,
-        unsigned short code, int value)
-{
-    struct input_event ie = {
-        .type = type,
-        .code = code,
-        .value = value,
-    };
-
-    int written = write(uinput->fd, &ie, sizeof(ie));
-    if (written < 0) {
-        ALOGE("Failed to write legacy uinput setup! rc=%d: %s", written, strerror(errno));
-        return -1;
-    } else if (written != sizeof(ie)) {
-        ALOGE("Didn't write full input_event, only %d/%zu bytes!", written, sizeof(ie));
-        return -1;
-    }
-
+    uinput_emitter_destroy(uinput->emitter);
+    uinput->emitter = NULL;
     return 0;
 }
 
@@ -132,9 +57,7 @@ static int fpc_write_input_event(const fpc_uinput_t *uinput, unsigned short type
  */
 int fpc_uinput_send(const fpc_uinput_t *uinput, unsigned short keycode, unsigned short value)
 {
-    int rc = 0;
-    rc |= fpc_write_input_event(uinput, EV_KEY, keycode, value);
-    rc |= fpc_write_input_event(uinput, EV_SYN, SYN_REPORT, 0);
+    int rc = uinput_emitter_send(uinput->emitter, keycode, value);
     ALOGE_IF(rc, "Failed to write uinput event: %d", rc);
     return rc;
 }
@@ -145,10 +68,21 @@ int fpc_uinput_send(const fpc_uinput_t *uinput, unsigned short keycode, unsigned
  */
 int fpc_uinput_click(const fpc_uinput_t *uinput, unsigned short keycode)
 {
-    int rc = 0;
-    rc |= fpc_write_input_event(uinput, EV_KEY, keycode, 1);
-    rc |= fpc_write_input_event(uinput, EV_KEY, keycode, 0);
-    rc |= fpc_write_input_event(uinput, EV_SYN, SYN_REPORT, 0);
-    ALOGE_IF(rc, "Failed to write uinput event: %d", rc);
-    return rc;
+    return fpc_uinput_click_batch(uinput, &keycode, 1);
+}
+
+/**
+ * Simulate a click on every key in \p keycodes, in order. The events are
+ * written by the emitter thread, so that gestures never hold up the
+ * caller; see uinput_emitter_post_click.
+ */
+int fpc_uinput_click_batch(const fpc_uinput_t *uinput, const unsigned short *keycodes, size_t count)
+{
+    return uinput_emitter_post_click(uinput->emitter, keycodes, count);
+}
+
+void fpc_uinput_dump(const fpc_uinput_t *uinput, int fd)
+{
+    if (uinput->emitter)
+        uinput_emitter_dump(uinput->emitter, fd);
 }
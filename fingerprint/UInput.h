@@ -1,17 +1,28 @@
 #pragma once
 
-#include <linux/uinput.h>
+#include <uinput_emitter.h>
+
+/*
+ * When set, authentication clicks KEY_WAKEUP on the first finger-down
+ * interrupt, so that the display powers up while the finger is still
+ * being captured and matched instead of after onAuthenticated.
+ */
+#define WAKE_ON_FINGER_PROPERTY "persist.vendor.fingerprint.wake_on_finger"
 
 __BEGIN_DECLS
 
 typedef struct {
-    int fd;
+    uinput_emitter_t *emitter;
 } fpc_uinput_t;
 
 int fpc_uinput_create(fpc_uinput_t *);
 int fpc_uinput_destroy(fpc_uinput_t *);
 int fpc_uinput_send(const fpc_uinput_t *, unsigned short keycode, unsigned short value);
 int fpc_uinput_click(const fpc_uinput_t *uinput, unsigned short keycode);
+// Maximum number of keys accepted by fpc_uinput_click_batch:
+#define UINPUT_MAX_BATCH UINPUT_EMITTER_MAX_KEYS
+int fpc_uinput_click_batch(const fpc_uinput_t *uinput, const unsigned short *keycodes, size_t count);
+void fpc_uinput_dump(const fpc_uinput_t *uinput, int fd);
 
 __END_DECLS
 
@@ -25,6 +36,7 @@ class UInput {
     ~UInput();
 
     void Click(unsigned short keycode);
+    void Dump(int fd);
 };
 
 #endif
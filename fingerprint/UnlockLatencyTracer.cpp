@@ -0,0 +1,246 @@
+#include "UnlockLatencyTracer.h"
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+#include <utils/Trace.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+int32_t to_us(nsecs_t ns) {
+    return static_cast<int32_t>(std::clamp<nsecs_t>(ns / 1000, 0, std::numeric_limits<int32_t>::max()));
+}
+
+int32_t duration_us(int32_t begin_us, int32_t end_us) {
+    return begin_us < 0 || end_us < begin_us ? -1 : end_us - begin_us;
+}
+
+}  // namespace
+
+UnlockLatencyTracer::Section::Section(UnlockLatencyTracer &tracer, UnlockStage stage)
+    : mTracer(tracer), mStage(stage), mBegin(systemTime(SYSTEM_TIME_MONOTONIC)) {
+    ATRACE_BEGIN(StageName(stage));
+}
+
+UnlockLatencyTracer::Section::~Section() {
+    End();
+}
+
+void UnlockLatencyTracer::Section::End() {
+    if (mEnded)
+        return;
+    mEnded = true;
+    ATRACE_END();
+    mTracer.Record(mStage, mBegin);
+}
+
+const char *UnlockLatencyTracer::StageName(UnlockStage stage) {
+    switch (stage) {
+        case UnlockStage::FingerDown:
+            return "FingerDown";
+        case UnlockStage::Wake:
+            return "Wake";
+        case UnlockStage::WakeKey:
+            return "WakeKey";
+        case UnlockStage::Capture:
+            return "Capture";
+        case UnlockStage::Identify:
+            return "Identify";
+        case UnlockStage::TemplateUpdate:
+            return "TemplateUpdate";
+        case UnlockStage::HatFetch:
+            return "HatFetch";
+        case UnlockStage::Authenticated:
+            return "Authenticated";
+        case UnlockStage::TzCapture:
+            return "TzCapture";
+        case UnlockStage::TzIdentify:
+            return "TzIdentify";
+        case UnlockStage::Total:
+            return "Total";
+        case UnlockStage::DisplayLead:
+            return "DisplayLead";
+        case UnlockStage::Count:
+            break;
+    }
+    return "Unknown";
+}
+
+void UnlockLatencyTracer::FingerDown(nsecs_t when) {
+    if (mInProgress)
+        ATRACE_ASYNC_END("Unlock", static_cast<int32_t>(mHead.load(std::memory_order_relaxed)));
+
+    mCurrent = {};
+    mCurrent.finger_down = when;
+    mCurrent.stages[static_cast<size_t>(UnlockStage::FingerDown)] = {0, 0};
+    mInProgress = true;
+
+    // The cookie is the ring index this attempt is going to be published at:
+    ATRACE_ASYNC_BEGIN("Unlock", static_cast<int32_t>(mHead.load(std::memory_order_relaxed)));
+}
+
+void UnlockLatencyTracer::Record(UnlockStage stage, nsecs_t begin, nsecs_t end) {
+    if (!mInProgress || stage >= UnlockStage::Count)
+        return;
+
+    auto &interval = mCurrent.stages[static_cast<size_t>(stage)];
+    const auto begin_us = to_us(begin - mCurrent.finger_down);
+    const auto end_us = to_us(end - mCurrent.finger_down);
+
+    if (interval.end_us < 0) {
+        interval = {begin_us, end_us};
+    } else {
+        interval.begin_us = std::min(interval.begin_us, begin_us);
+        interval.end_us = std::max(interval.end_us, end_us);
+    }
+}
+
+void UnlockLatencyTracer::RecordTzTimes(int capture_ms, int identify_ms) {
+    if (!mInProgress)
+        return;
+
+    // These have no position on the timeline; only their duration is kept.
+    if (capture_ms >= 0)
+        mCurrent.stages[static_cast<size_t>(UnlockStage::TzCapture)] = {0, capture_ms * 1000};
+    if (identify_ms >= 0)
+        mCurrent.stages[static_cast<size_t>(UnlockStage::TzIdentify)] = {0, identify_ms * 1000};
+}
+
+void UnlockLatencyTracer::Finish(bool matched) {
+    if (!mInProgress)
+        return;
+    mInProgress = false;
+
+    mCurrent.matched = matched;
+
+    const auto &authenticated = mCurrent.stages[static_cast<size_t>(UnlockStage::Authenticated)];
+    if (authenticated.end_us >= 0) {
+        mCurrent.stages[static_cast<size_t>(UnlockStage::Total)] = {0, authenticated.end_us};
+        ATRACE_INT("Unlock total us", authenticated.end_us);
+
+        const auto &wake_key = mCurrent.stages[static_cast<size_t>(UnlockStage::WakeKey)];
+        if (wake_key.end_us >= 0) {
+            mCurrent.stages[static_cast<size_t>(UnlockStage::DisplayLead)] = {wake_key.end_us, authenticated.end_us};
+            ATRACE_INT("Unlock display lead us", authenticated.end_us - wake_key.end_us);
+        }
+    }
+
+    for (size_t i = static_cast<size_t>(UnlockStage::Wake); i < stage_count; ++i) {
+        const auto &interval = mCurrent.stages[i];
+        auto us = duration_us(interval.begin_us, interval.end_us);
+        if (us >= 0)
+            mHistograms[i].Add(us);
+    }
+
+    // Seqlock write; there is only a single writer (the worker thread):
+    const auto head = mHead.load(std::memory_order_relaxed);
+    auto &slot = mRing[head % ring_size];
+    const auto seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.attempt = mCurrent;
+    slot.seq.store(seq + 2, std::memory_order_release);
+    mHead.store(head + 1, std::memory_order_release);
+
+    ATRACE_ASYNC_END("Unlock", static_cast<int32_t>(head));
+}
+
+size_t UnlockLatencyTracer::BucketIndex(int32_t us) {
+    constexpr auto sub_buckets = 1 << sub_buckets_log2;
+    if (us < sub_buckets)
+        return std::max(us, 0);
+
+    const int msb = 31 - __builtin_clz(static_cast<uint32_t>(us));
+    const int shift = msb - sub_buckets_log2;
+    const size_t index = ((shift + 1) << sub_buckets_log2) + ((us >> shift) & (sub_buckets - 1));
+    return std::min<size_t>(index, bucket_count - 1);
+}
+
+int32_t UnlockLatencyTracer::BucketMidpoint(size_t index) {
+    constexpr auto sub_buckets = 1 << sub_buckets_log2;
+    if (index < sub_buckets)
+        return index;
+
+    const int shift = (index >> sub_buckets_log2) - 1;
+    const int32_t lower = (sub_buckets + (index & (sub_buckets - 1))) << shift;
+    return lower + ((1 << shift) >> 1);
+}
+
+void UnlockLatencyTracer::Histogram::Add(int32_t us) {
+    buckets[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+
+    auto prev = max_us.load(std::memory_order_relaxed);
+    while (prev < us && !max_us.compare_exchange_weak(prev, us, std::memory_order_relaxed))
+        ;
+}
+
+int32_t UnlockLatencyTracer::Histogram::Percentile(uint32_t permille) const {
+    std::array<uint32_t, bucket_count> snapshot;
+    uint64_t total = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+        total += snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+    if (!total)
+        return -1;
+
+    const uint64_t target = std::max<uint64_t>(1, (total * permille + 999) / 1000);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += snapshot[i];
+        if (seen >= target)
+            return std::min(BucketMidpoint(i), max_us.load(std::memory_order_relaxed));
+    }
+    return max_us.load(std::memory_order_relaxed);
+}
+
+void UnlockLatencyTracer::Dump(int fd) const {
+    const auto head = mHead.load(std::memory_order_acquire);
+
+    dprintf(fd, "Unlock latency: %" PRIu64 " attempts recorded\n", head);
+    dprintf(fd, "  %-16s %8s %10s %10s %10s %10s\n", "stage (ms)", "count", "p50", "p90", "p99", "max");
+    for (size_t i = static_cast<size_t>(UnlockStage::Wake); i < stage_count; ++i) {
+        const auto &histogram = mHistograms[i];
+        const auto count = histogram.count.load(std::memory_order_relaxed);
+        if (!count)
+            continue;
+        dprintf(fd, "  %-16s %8u %10.1f %10.1f %10.1f %10.1f\n",
+                StageName(static_cast<UnlockStage>(i)),
+                count,
+                histogram.Percentile(500) / 1000.,
+                histogram.Percentile(900) / 1000.,
+                histogram.Percentile(990) / 1000.,
+                histogram.max_us.load(std::memory_order_relaxed) / 1000.);
+    }
+
+    const auto now = systemTime(SYSTEM_TIME_MONOTONIC);
+    dprintf(fd, "Last attempts (ms after finger-down, begin+duration):\n");
+    for (uint64_t i = 0; i < std::min<uint64_t>(head, ring_size); ++i) {
+        const auto &slot = mRing[(head - 1 - i) % ring_size];
+
+        const auto seq = slot.seq.load(std::memory_order_acquire);
+        Attempt attempt = slot.attempt;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq & 1 || seq != slot.seq.load(std::memory_order_relaxed)) {
+            // Overwritten while reading; everything older is as well.
+            break;
+        }
+
+        dprintf(fd, "  %8.1fs ago %-9s", ns2ms(now - attempt.finger_down) / 1000., attempt.matched ? "match" : "no-match");
+        for (size_t s = static_cast<size_t>(UnlockStage::Wake); s < stage_count; ++s) {
+            const auto &interval = attempt.stages[s];
+            const auto us = duration_us(interval.begin_us, interval.end_us);
+            if (us < 0)
+                continue;
+            const auto stage = static_cast<UnlockStage>(s);
+            if (stage >= UnlockStage::TzCapture)
+                dprintf(fd, " %s=%.1f", StageName(stage), us / 1000.);
+            else
+                dprintf(fd, " %s=%.1f+%.1f", StageName(stage), interval.begin_us / 1000., us / 1000.);
+        }
+        dprintf(fd, "\n");
+    }
+}
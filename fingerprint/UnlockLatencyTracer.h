@@ -0,0 +1,141 @@
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Stages of a single authentication attempt, in the order in which they
+ * normally happen. Every stage is recorded as an interval relative to the
+ * finger-down interrupt that started the attempt.
+ */
+enum class UnlockStage {
+    // Finger-down interrupt observed by the HAL. This is the reference point
+    // of an attempt and is only stored as a timestamp.
+    FingerDown,
+    // Interrupt until the sensor is ready to capture.
+    Wake,
+    // Interrupt until the display wake key was queued, with wake-on-finger.
+    WakeKey,
+    Capture,
+    Identify,
+    TemplateUpdate,
+    HatFetch,
+    // Duration of the onAuthenticated callback into the framework.
+    Authenticated,
+    // Times reported by the TZ app itself, if available:
+    TzCapture,
+    TzIdentify,
+    // Finger-down until onAuthenticated returned.
+    Total,
+    // Wake key until onAuthenticated returned: how much earlier the display
+    // starts powering up than it would after the result.
+    DisplayLead,
+    Count,
+};
+
+/**
+ * Collects per-stage latencies of authentication attempts.
+ *
+ * Recording is done from the worker thread only, and never blocks: finished
+ * attempts go into a small seqlock-protected ring and a set of atomic
+ * histograms that can be read at any time through Dump(), which is what the
+ * HIDL debug() entry point calls. Every stage is also emitted as an atrace
+ * section or counter (ATRACE_TAG_HAL).
+ */
+class UnlockLatencyTracer {
+   public:
+    static constexpr auto stage_count = static_cast<size_t>(UnlockStage::Count);
+
+    /**
+     * RAII helper that traces a stage from construction until End() or
+     * destruction, whichever comes first.
+     */
+    class Section {
+        UnlockLatencyTracer &mTracer;
+        UnlockStage mStage;
+        nsecs_t mBegin;
+        bool mEnded = false;
+
+       public:
+        Section(UnlockLatencyTracer &, UnlockStage);
+        ~Section();
+        Section(const Section &) = delete;
+        Section &operator=(const Section &) = delete;
+
+        void End();
+    };
+
+    /**
+     * Start a new attempt. An attempt that was not finished before is
+     * discarded.
+     */
+    void FingerDown(nsecs_t when = systemTime(SYSTEM_TIME_MONOTONIC));
+    /**
+     * Record \p stage as running from \p begin until \p end.
+     * Recording the same stage twice in one attempt extends the interval.
+     * Ignored when no attempt is in progress.
+     */
+    void Record(UnlockStage stage, nsecs_t begin, nsecs_t end = systemTime(SYSTEM_TIME_MONOTONIC));
+    /**
+     * Record the capture and identify times reported by the TZ app, in ms.
+     * Negative values are ignored.
+     */
+    void RecordTzTimes(int capture_ms, int identify_ms);
+    /**
+     * Publish the attempt in progress, if any.
+     */
+    void Finish(bool matched);
+
+    [[nodiscard]] inline Section Trace(UnlockStage stage) {
+        return Section(*this, stage);
+    }
+
+    void Dump(int fd) const;
+
+    static const char *StageName(UnlockStage);
+
+   private:
+    // Stage interval in us relative to finger-down, -1 when not recorded.
+    struct Interval {
+        int32_t begin_us = -1, end_us = -1;
+    };
+
+    struct Attempt {
+        nsecs_t finger_down = 0;
+        std::array<Interval, stage_count> stages;
+        bool matched = false;
+    };
+
+    struct Slot {
+        // Odd while the writer is updating attempt:
+        std::atomic<uint32_t> seq{0};
+        Attempt attempt;
+    };
+
+    // Buckets are spaced by a quarter power of two, covering 1us up to ~16s.
+    static constexpr auto sub_buckets_log2 = 2;
+    static constexpr auto bucket_count = 24 << sub_buckets_log2;
+    static constexpr auto ring_size = 32;
+
+    struct Histogram {
+        std::array<std::atomic<uint32_t>, bucket_count> buckets{};
+        std::atomic<uint32_t> count{0};
+        std::atomic<int32_t> max_us{0};
+
+        void Add(int32_t us);
+        int32_t Percentile(uint32_t permille) const;
+    };
+
+    static size_t BucketIndex(int32_t us);
+    static int32_t BucketMidpoint(size_t index);
+
+    Attempt mCurrent;
+    bool mInProgress = false;
+
+    std::array<Slot, ring_size> mRing;
+    std::atomic<uint64_t> mHead{0};
+    std::array<Histogram, stage_count> mHistograms;
+};
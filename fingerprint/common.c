@@ -2,61 +2,61 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
-#if PLATFORM_SDK_VERSION >= 28
-#include <bits/epoll_event.h>
-#endif
-#include <sys/epoll.h>
+#include <time.h>
 
 #define LOG_TAG "FPC COMMON"
 
 #include <log/log.h>
 
-#define EVENT_COUNT 2
+// Length of a single wakelock extension in a capture session. This covers
+// the capture retry window and a couple of finger-lost rechecks; longer
+// extensions would be clamped by the driver anyway.
+#define SESSION_WAKELOCK_MS FPC_WAKELOCK_MAX_MS
+// Extend the wakelock a little ahead of the requested time, so that the
+// device doesn't suspend while the ioctl is underway:
+#define SESSION_WAKELOCK_MARGIN_MS 5
 
 err_t fpc_event_create(fpc_event_t *event, int event_fd)
 {
-    int fd = 0, rc;
+    int fd = 0;
 
     event->event_fd = event_fd;
+    event->on_eventfd = NULL;
+    event->on_eventfd_ctx = NULL;
 
-    fd = open("/dev/fingerprint", O_RDWR);
+    fd = open(FINGERPRINT_DEVICE_PATH, O_RDWR);
     if (fd < 0) {
         ALOGE("Error opening FPC device");
+        event->dev_fd = -1;
         return -1;
     }
     event->dev_fd = fd;
+    irq_filter_init(&event->irq, fd, FPC_IOCRIRQPOLL);
 
-    fd = epoll_create1(0);
-    if (fd < 0) {
-        ALOGE("Error creating epoll fd");
-        return -1;
+    if (event_mux_init(&event->mux)) {
+        ALOGE("Error creating the event multiplexer");
+        goto err_dev;
     }
-    event->epoll_fd = fd;
 
-    struct epoll_event ev = {
-        .data.fd = event_fd,
-        .events = EPOLLIN,
-    };
-    rc = epoll_ctl(event->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
-    if (rc) {
-        ALOGE("Failed to add event_fd to epoll: %d", rc);
-        return -1;
-    }
-
-    ev = (struct epoll_event){
-        .data.fd = event->dev_fd,
-        .events = EPOLLIN,
-    };
-    rc = epoll_ctl(event->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
-    if (rc) {
-        ALOGE("Failed to add event->dev_fd to epoll: %d", rc);
-        return -1;
+    // The eventfd is registered first, to take priority over the sensor:
+    if (event_mux_add(&event->mux, event_fd, FPC_EVENT_EVENTFD, NULL, NULL) ||
+        event_mux_add(&event->mux, event->dev_fd, FPC_EVENT_FINGER, irq_filter_handle, &event->irq)) {
+        ALOGE("Error adding events to the multiplexer");
+        goto err_mux;
     }
 
     return 0;
+
+err_mux:
+    event_mux_destroy(&event->mux);
+err_dev:
+    close(event->dev_fd);
+    event->dev_fd = -1;
+    return -1;
 }
 
 err_t fpc_event_destroy(fpc_event_t *event)
@@ -64,8 +64,7 @@ err_t fpc_event_destroy(fpc_event_t *event)
     event->event_fd = -1;
     close(event->dev_fd);
     event->dev_fd = -1;
-    close(event->epoll_fd);
-    event->epoll_fd = -1;
+    event_mux_destroy(&event->mux);
     return 0;
 }
 
@@ -99,34 +98,103 @@ err_t fpc_get_power(const fpc_event_t *event)
     return reply;
 }
 
+err_t fpc_reset_sensor(const fpc_event_t *event)
+{
+    int ret = -1;
+
+    ret = ioctl(event->dev_fd, FPC_IOCWRESET, 1);
+    if (ret < 0) {
+        ALOGE("Failed resetting FPC device (%d) %s", ret, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t fpc_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t fpc_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int timeout_until(int64_t deadline_ms)
+{
+    int64_t remaining;
+
+    if (deadline_ms < 0)
+        return -1;
+
+    remaining = deadline_ms - fpc_now_ms();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
 err_t fpc_poll_event(const fpc_event_t *event)
 {
-    int cnt;
+    return fpc_poll_event_until(event, -1);
+}
 
-    struct epoll_event events[EVENT_COUNT];
-    cnt = epoll_wait(event->epoll_fd, events, EVENT_COUNT, -1);
+// Runs posted work on an eventfd wakeup, returns whether the wait has to end:
+static bool eventfd_ends_wait(const fpc_event_t *event)
+{
+    return !event->on_eventfd || event->on_eventfd(event->on_eventfd_ctx);
+}
 
-    if (cnt < 0) {
-        ALOGE("Failed waiting for epoll: %d", cnt);
-        return FPC_EVENT_ERROR;
-    }
+err_t fpc_poll_event_until(const fpc_event_t *event, int64_t deadline_ms)
+{
+    int rc;
 
-    if (!cnt) {
-        ALOGE("Epoll timed out despite infinite blocking!");
-        return FPC_EVENT_TIMEOUT;
-    }
+    do {
+        rc = event_mux_wait_until(&event->mux, deadline_ms < 0 ? -1 : deadline_ms * 1000000);
+    } while (rc == FPC_EVENT_EVENTFD && !eventfd_ends_wait(event));
 
-    for (int i = 0; i < cnt; ++i)
-        if (events[i].data.fd == event->event_fd && events[i].events | EPOLLIN) {
+    switch (rc) {
+        case EVENT_MUX_ERROR:
+            return FPC_EVENT_ERROR;
+        case EVENT_MUX_TIMEOUT:
+            ALOGE_IF(deadline_ms < 0, "Epoll timed out despite infinite blocking!");
+            return FPC_EVENT_TIMEOUT;
+        case FPC_EVENT_EVENTFD:
             ALOGD("Waking up from eventfd");
             return FPC_EVENT_EVENTFD;
-        }
+    }
 
-    // Only other event source is the fingerprint.
     ALOGD("Waking up from finger event");
     return FPC_EVENT_FINGER;
 }
 
+err_t fpc_wait_eventfd_until(const fpc_event_t *event, int64_t deadline_ms)
+{
+    int cnt;
+
+    struct pollfd pfd = {
+        .fd = event->event_fd,
+        .events = POLLIN,
+    };
+
+    for (;;) {
+        do {
+            cnt = poll(&pfd, 1, timeout_until(deadline_ms));
+        } while (cnt < 0 && errno == EINTR);
+
+        if (cnt < 0) {
+            ALOGE("Failed waiting for eventfd: %d", cnt);
+            return FPC_EVENT_ERROR;
+        }
+        if (!cnt)
+            return FPC_EVENT_TIMEOUT;
+        if (eventfd_ends_wait(event))
+            return FPC_EVENT_EVENTFD;
+    }
+}
+
 /**
  * Checks if an event (request to switch to a different state) is available.
  *
@@ -152,6 +220,16 @@ err_t is_event_available(const fpc_event_t *event)
     return cnt > 0;
 }
 
+err_t fpc_event_requested(const fpc_event_t *event)
+{
+    err_t rc = is_event_available(event);
+
+    if (rc <= 0 || !event->on_eventfd)
+        return rc;
+
+    return event->on_eventfd(event->on_eventfd_ctx) != 0;
+}
+
 err_t fpc_keep_awake(const fpc_event_t *event, int awake, unsigned int timeout)
 {
     struct {
@@ -163,3 +241,60 @@ err_t fpc_keep_awake(const fpc_event_t *event, int awake, unsigned int timeout)
         ALOGE("%s failed: %d", __func__, rc);
     return rc;
 }
+
+err_t fpc_session_keep_awake(const fpc_event_t *event, fpc_wakelock_t *wakelock, unsigned int timeout)
+{
+    const int64_t now = fpc_now_ms();
+    unsigned int extension = timeout > SESSION_WAKELOCK_MS ? timeout : SESSION_WAKELOCK_MS;
+
+    // The driver clamps the timeout, only count on what it grants:
+    if (extension > FPC_WAKELOCK_MAX_MS)
+        extension = FPC_WAKELOCK_MAX_MS;
+    if (timeout > extension)
+        timeout = extension;
+
+    if (now + timeout + SESSION_WAKELOCK_MARGIN_MS <= wakelock->deadline_ms) {
+        ++wakelock->session_skipped;
+        ++wakelock->skipped;
+        return 0;
+    }
+
+    int rc = fpc_keep_awake(event, 1, extension);
+    if (rc) {
+        // Make sure the next request tries again:
+        wakelock->deadline_ms = 0;
+        return rc;
+    }
+
+    wakelock->deadline_ms = now + extension;
+    ++wakelock->session_extensions;
+    ++wakelock->extensions;
+    return 0;
+}
+
+err_t fpc_session_rearm(const fpc_event_t *event, fpc_wakelock_t *wakelock, unsigned int timeout)
+{
+    // Don't trust the deadline of an earlier extension, the driver may
+    // have dropped that wakelock in the meantime (e.g. on a sensor reset):
+    wakelock->deadline_ms = 0;
+    return fpc_session_keep_awake(event, wakelock, timeout);
+}
+
+err_t fpc_session_release(const fpc_event_t *event, fpc_wakelock_t *wakelock)
+{
+    int rc = 0;
+
+    if (!wakelock->session_extensions && !wakelock->session_skipped)
+        return 0;
+
+    ALOGD("%s: %u wakelock extensions, %u avoided", __func__,
+          wakelock->session_extensions, wakelock->session_skipped);
+
+    if (wakelock->deadline_ms > fpc_now_ms())
+        rc = fpc_keep_awake(event, 0, 0);
+
+    wakelock->deadline_ms = 0;
+    wakelock->session_extensions = 0;
+    wakelock->session_skipped = 0;
+    return rc;
+}
@@ -3,6 +3,13 @@
 
 #include <stdint.h>
 
+#include "event_mux.h"
+#include "irq_filter.h"
+
+#ifndef FINGERPRINT_DEVICE_PATH
+#define FINGERPRINT_DEVICE_PATH "/dev/fingerprint"
+#endif
+
 #define FPC_IOC_MAGIC	0x1145
 #define FPC_IOCWPREPARE	_IOW(FPC_IOC_MAGIC, 0x01, int)
 #define FPC_IOCWDEVWAKE _IOW(FPC_IOC_MAGIC, 0x02, int)
@@ -26,9 +33,18 @@ enum {
 };
 
 typedef struct {
-    int epoll_fd;
+    event_mux_t mux;
+    // Filters the wakeups of dev_fd, owned by the worker:
+    irq_filter_t irq;
     int dev_fd;
     int event_fd;
+    /**
+     * Optional, called by fpc_event_requested() when the eventfd is
+     * signalled, to run work that was posted to the worker. Returns
+     * non-zero when a state request is pending.
+     */
+    int (*on_eventfd)(void *ctx);
+    void *on_eventfd_ctx;
 } fpc_event_t;
 
 typedef int32_t err_t;
@@ -37,8 +53,35 @@ err_t fpc_event_create(fpc_event_t *, int event_fd);
 err_t fpc_event_destroy(fpc_event_t *);
 err_t fpc_set_power(const fpc_event_t *, int poweron);
 err_t fpc_get_power(const fpc_event_t *);
+/**
+ * Hardware-reset the sensor, without touching the TZ app.
+ */
+err_t fpc_reset_sensor(const fpc_event_t *);
 err_t fpc_poll_event(const fpc_event_t *);
+/**
+ * Wait for a finger or eventfd event until \p deadline_ms.
+ *
+ * @param[in] deadline_ms Absolute CLOCK_MONOTONIC time, in ms, as returned
+ *                        by fpc_now_ms(). A negative value blocks forever.
+ *
+ * Returns FPC_EVENT_TIMEOUT when the deadline passes without an event.
+ * Eventfd wakeups go to the on_eventfd hook first, and only end the wait
+ * when it reports a pending state request.
+ */
+err_t fpc_poll_event_until(const fpc_event_t *, int64_t deadline_ms);
+/**
+ * Like fpc_poll_event_until(), but only wakes up for the eventfd.
+ */
+err_t fpc_wait_eventfd_until(const fpc_event_t *, int64_t deadline_ms);
 err_t is_event_available(const fpc_event_t *event);
+/**
+ * Like is_event_available(), but first gives the on_eventfd hook the chance
+ * to handle the event inline. Returns whether the current operation needs
+ * to be aborted for a state request.
+ */
+err_t fpc_event_requested(const fpc_event_t *event);
+int64_t fpc_now_ms(void);
+int64_t fpc_now_ns(void);
 /**
  * Extend wakelock timeout.
  *
@@ -49,8 +92,47 @@ err_t is_event_available(const fpc_event_t *event);
  * HAL waits for a finger to disappear when the operation is unsuccessful,
  * before returning back to polling.
  *
- * Note that \p timeout is clamped to a maximum defined in the driver.
+ * Note that \p timeout is clamped to a maximum defined in the driver, see
+ * FPC_WAKELOCK_MAX_MS.
  */
 err_t fpc_keep_awake(const fpc_event_t *event, int awake, unsigned int timeout);
 
+// Longest FPC_IOCWAWAKE timeout the driver honours, in ms; longer requests
+// are clamped to it:
+#ifndef FPC_WAKELOCK_MAX_MS
+#define FPC_WAKELOCK_MAX_MS 500
+#endif
+
+/*
+ * Wakelock held for the duration of a capture session: from the first
+ * finger-down until the operation completes or is cancelled.
+ */
+typedef struct {
+    // Absolute fpc_now_ms() time until which the driver keeps the device
+    // awake, 0 when no wakelock is held:
+    int64_t deadline_ms;
+    // Driver calls made, and calls avoided because the held wakelock
+    // already covered the request, in the current session and in total:
+    uint32_t session_extensions, session_skipped;
+    uint32_t extensions, skipped;
+} fpc_wakelock_t;
+
+/**
+ * Keep the device awake for at least \p timeout ms from now.
+ *
+ * Only calls into the driver when the wakelock held by this session would
+ * expire earlier, in which case it is extended for as long as the driver
+ * allows. \p timeout is clamped to FPC_WAKELOCK_MAX_MS as well.
+ */
+err_t fpc_session_keep_awake(const fpc_event_t *, fpc_wakelock_t *, unsigned int timeout);
+/**
+ * Like fpc_session_keep_awake(), but always calls into the driver. Used on
+ * every finger-down, so that a capture never relies on an earlier estimate.
+ */
+err_t fpc_session_rearm(const fpc_event_t *, fpc_wakelock_t *, unsigned int timeout);
+/**
+ * End the capture session, releasing its wakelock when one is held.
+ */
+err_t fpc_session_release(const fpc_event_t *, fpc_wakelock_t *);
+
 #endif //FINGERPRINT_COMMON_H
@@ -17,6 +17,10 @@
 #define FP_HW_TYPE_EGISTEC 0
 #define FP_HW_TYPE_FPC 1
 
+#ifndef FINGERPRINT_DEVICE_PATH
+#define FINGERPRINT_DEVICE_PATH "/dev/fingerprint"
+#endif
+
 namespace egistec {
 
 enum class FpHwId {
@@ -25,7 +29,7 @@ enum class FpHwId {
 };
 
 class EgisFpDevice {
-    static constexpr auto DEV_PATH = "/dev/fingerprint";
+    static constexpr auto DEV_PATH = FINGERPRINT_DEVICE_PATH;
 
     int mFd = -1;
 
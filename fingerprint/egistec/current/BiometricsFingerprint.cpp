@@ -1,6 +1,11 @@
 #include "BiometricsFingerprint.h"
 
 #include "FormatException.hpp"
+#include "tz_trace.h"
+
+#include <stdio.h>
+
+#include <future>
 
 #define LOG_TAG "FPC ET"
 #include <log/log.h>
@@ -9,10 +14,25 @@ namespace egistec::current {
 
 using namespace ::SynchronizedWorker;
 
-BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev) : mDev(std::move(dev)), mWt(this), mMux(mDev.GetFd(), mWt.getEventFd()) {
-    QSEEKeymasterTrustlet keymaster;
+// Upper bound on the wait for the sensor to detect the finger again after
+// ResetSensor(), before re-imaging:
+constexpr auto reimage_timeout_ms = 150;
+
+BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev) : mDev(std::move(dev)), mWt(this), mMux(mDev.GetFd(), mWt.getEventFd(), ET51X_IOCRIRQPOLL) {
+}
+
+BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev, QSEETrustlet &&trustlet) : mTrustlet(std::move(trustlet)), mDev(std::move(dev)), mWt(this), mMux(mDev.GetFd(), mWt.getEventFd(), ET51X_IOCRIRQPOLL) {
+}
+
+void BiometricsFingerprint::Init() {
     int rc = 0;
 
+    // Fetch the master key from keymaster while the sensor is being reset:
+    auto masterKey = std::async(std::launch::async, [] {
+        QSEEKeymasterTrustlet keymaster;
+        return keymaster.GetKey();
+    });
+
 #ifdef HAS_DYNAMIC_POWER_MANAGEMENT
     DeviceEnableGuard<EgisFpDevice> guard{mDev};
 #else
@@ -20,11 +40,11 @@ BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev) : mDev(std::mov
 #endif
     mDev.Reset();
 
-    mMasterKey = keymaster.GetKey();
-
     rc = mTrustlet.SetDataPath("/data/system/users/0/fpdata");
     LOG_ALWAYS_FATAL_IF(rc, "SetDataPath failed with rc = %d", rc);
 
+    mMasterKey = masterKey.get();
+
     rc = mTrustlet.SetMasterKey(mMasterKey);
     LOG_ALWAYS_FATAL_IF(rc, "SetMasterKey failed with rc = %d", rc);
 
@@ -46,6 +66,8 @@ BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev) : mDev(std::mov
 BiometricsFingerprint::~BiometricsFingerprint() {
     int rc = 0;
 
+    mInit.Wait(__func__);
+
     rc = mTrustlet.UninitializeSensor();
     ALOGE_IF(rc, "UninitializeSensor failed with rc = %d", rc);
 
@@ -55,7 +77,7 @@ BiometricsFingerprint::~BiometricsFingerprint() {
     rc = mTrustlet.UninitializeSdk();
     ALOGE_IF(rc, "UninitializeSdk failed with rc = %d", rc);
 
-    // Even though DeviceEnableGuard takes care of this, make extra
+    // Even though the power domain takes care of this, make extra
     // sure the device is powered down.
     mDev.Disable();
 }
@@ -71,12 +93,16 @@ Return<uint64_t> BiometricsFingerprint::setNotify(const sp<IBiometricsFingerprin
 }
 
 Return<uint64_t> BiometricsFingerprint::preEnroll() {
+    auto call = mCalls.Enter();
     mEnrollChallenge = (uint64_t)rand() | (uint64_t)rand() << 0x20;
     ALOGI("%s: Generated enroll challenge %#lx", __func__, mEnrollChallenge);
     return mEnrollChallenge;
 }
 
 Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69> &hat, uint32_t gid, uint32_t timeoutSec) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     int rc = 0;
 
     if (!hat.data()) {
@@ -125,7 +151,7 @@ Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69
 
     ALOGI("New print id = %u", mNewPrintId);
 
-    mEnrollTimeout = timeoutSec;
+    mEnrollTimeoutMs = timeoutSec * 1000;
 
     if (mWt.moveToState(AsyncState::Enroll))
         return RequestStatus::SYS_OK;
@@ -134,9 +160,11 @@ Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69
 }
 
 Return<RequestStatus> BiometricsFingerprint::postEnroll() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: clearing challenge", __func__);
 
-    mEnrollTimeout = -1;
+    mEnrollTimeoutMs = -1;
     mNewPrintId = -1;
     mEnrollChallenge = 0;
 
@@ -144,12 +172,17 @@ Return<RequestStatus> BiometricsFingerprint::postEnroll() {
 }
 
 Return<uint64_t> BiometricsFingerprint::getAuthenticatorId() {
-    auto id = mTrustlet.GetAuthenticatorId();
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
+    auto id = mPrintCache.GetAuthenticatorId([this] { return mTrustlet.GetAuthenticatorId(); });
     ALOGI("%s: id = %lu", __func__, id);
     return id;
 }
 
 Return<RequestStatus> BiometricsFingerprint::cancel() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
+    mIdlePredictor.OnCommand();
     ALOGI("Cancel requested");
 
     if (mWt.moveToState(AsyncState::Idle))
@@ -159,8 +192,11 @@ Return<RequestStatus> BiometricsFingerprint::cancel() {
 }
 
 Return<RequestStatus> BiometricsFingerprint::enumerate() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     std::vector<uint32_t> fids;
-    int rc = mTrustlet.GetPrintIds(mGid, fids);
+    int rc = GetPrintIds(fids);
     if (rc)
         return RequestStatus::SYS_EINVAL;
 
@@ -180,6 +216,9 @@ Return<RequestStatus> BiometricsFingerprint::enumerate() {
 }
 
 Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     ALOGI("%s: gid = %d, fid = %d", __func__, gid, fid);
     if (gid != mGid) {
         ALOGE("Change group and userpath through setActiveGroup first!");
@@ -192,7 +231,7 @@ Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)
         // Delete all fingerprints when fid is zero:
         ALOGI("Deleting all fingerprints");
         std::vector<uint32_t> fids;
-        rc = mTrustlet.GetPrintIds(gid, fids);
+        rc = GetPrintIds(fids);
         if (!rc) {
             auto remaining = fids.size();
             for (auto fid : fids) {
@@ -209,6 +248,8 @@ Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)
             NotifyRemove(fid, 0);
     }
 
+    mPrintCache.Invalidate();
+
     if (rc) {
         NotifyError(FingerprintError::ERROR_UNABLE_TO_REMOVE);
         return RequestStatus::SYS_EFAULT;
@@ -217,28 +258,36 @@ Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)
 }
 
 Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid, const hidl_string &storePath) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     ALOGI("%s: gid = %u, path = %s", __func__, gid, storePath.c_str());
     mGid = gid;
+    mPrintCache.Invalidate();
     int rc = mTrustlet.SetUserDataPath(gid, storePath.c_str());
     return rc ? RequestStatus::SYS_EINVAL : RequestStatus::SYS_OK;
 }
 
 Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operationId, uint32_t gid) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
+    mIdlePredictor.OnCommand();
     ALOGI("%s: gid = %d, secret = %lu", __func__, gid, operationId);
     if (gid != mGid) {
         ALOGE("Cannot authenticate finger for different gid! Caller needs to update storePath first with setActiveGroup()!");
         return RequestStatus::SYS_EINVAL;
     }
 
-    uint32_t cnt = 0;
+    std::vector<uint32_t> fids;
     int rc = 0;
 
-    rc = mTrustlet.GetEnrolledCount(cnt);
+    rc = GetPrintIds(fids);
     if (rc) {
         ALOGE("%s: Failed to get finger count, rc = %d", __func__, rc);
         return RequestStatus::SYS_EFAULT;
     }
-    ALOGI("%s: Have %d enrolled fingers", __func__, cnt);
+    auto cnt = fids.size();
+    ALOGI("%s: Have %zu enrolled fingers", __func__, cnt);
     if (cnt == 0) {
         ALOGE("Error %s called without enrolled fingerprints!", __func__);
         return RequestStatus::SYS_EINVAL;
@@ -252,13 +301,36 @@ Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operationId,
     return RequestStatus::SYS_EFAULT;
 }
 
+Return<void> BiometricsFingerprint::debug(const hidl_handle &handle, const hidl_vec<hidl_string> & /* options */) {
+    if (handle == nullptr || handle->numFds < 1) {
+        ALOGE("%s: Missing file descriptor", __func__);
+        return Void();
+    }
+
+    mTracer.Dump(handle->data[0]);
+    mCalls.Dump(handle->data[0]);
+    mIdlePredictor.Dump(handle->data[0]);
+#ifdef HAS_DYNAMIC_POWER_MANAGEMENT
+    mPower.Dump(handle->data[0]);
+#endif
+    mWt.Dump(handle->data[0]);
+    mMux.Dump(handle->data[0]);
+    uinput.Dump(handle->data[0]);
+    mInit.Dump(handle->data[0]);
+    dprintf(handle->data[0], "Template update failures: %u, save failures: %u\n",
+            mTemplateUpdateFailures.load(), mTemplateSaveFailures.load());
+    tz_trace_dump(handle->data[0]);
+    return Void();
+}
+
 Thread &BiometricsFingerprint::getWorker() {
     return mWt;
 }
 
 void BiometricsFingerprint::AuthenticateAsync() {
 #ifdef HAS_DYNAMIC_POWER_MANAGEMENT
-    DeviceEnableGuard<EgisFpDevice> guard{mDev};
+    auto power = mPower.Acquire();
+    ALOGE_IF(!power, "%s: Failed to power up the sensor", __func__);
 #endif
 
     enum IdentifyState {
@@ -272,12 +344,13 @@ void BiometricsFingerprint::AuthenticateAsync() {
     IdentifyState state = WaitFingerDown;
     bool done = false, canceled = false, timeout = false;
 
-    bool updated;
+    bool updated, templates_dirty = false;
     identify_result_t identify_result;
     ImageResult image_result;
     WakeupReason wakeup_reason;
     int reImaged = 0;
-    bool force_retry = false;
+    bool force_retry = false, finger_irq = false;
+    nsecs_t finger_down = 0;
 
     rc = mTrustlet.InitializeIdentify();
     if (rc) {
@@ -294,6 +367,9 @@ void BiometricsFingerprint::AuthenticateAsync() {
 
         switch (state) {
             case WaitFingerDown:
+                if (!WaitDetectBackoff())
+                    break;
+
                 rc = mTrustlet.SetWorkMode(WorkMode::Detect);
                 ALOGE_IF(rc, "%s: Failed to set detect mode, rc = %d", __func__, rc);
                 if (rc)
@@ -301,18 +377,39 @@ void BiometricsFingerprint::AuthenticateAsync() {
 
                 wakeup_reason = mMux.waitForEvent();
                 if (wakeup_reason == WakeupReason::Finger) {
+                    finger_down = systemTime(SYSTEM_TIME_MONOTONIC);
+                    mTracer.FingerDown(finger_down);
+                    if (mWakeOnFinger) {
+                        // Let the display power up while the image is captured and matched:
+                        uinput.Click(KEY_WAKEUP);
+                        mTracer.Record(UnlockStage::WakeKey, finger_down);
+                    }
+                    finger_irq = true;
                     state = GetImage;
                 } else if (wakeup_reason == WakeupReason::Timeout) {
                     timeout = true;
                 }
                 break;
             case GetImage:
-                rc = mTrustlet.GetImage(image_result);
+                if (finger_down) {
+                    mTracer.Record(UnlockStage::Wake, finger_down);
+                    finger_down = 0;
+                }
+
+                {
+                    auto trace = mTracer.Trace(UnlockStage::Capture);
+                    rc = mTrustlet.GetImage(image_result);
+                }
 
                 ALOGE_IF(rc, "%s: Failed to get image, rc = %d", __func__, rc);
                 if (rc)
                     break;
 
+                if (finger_irq) {
+                    ReportCapture(image_result);
+                    finger_irq = false;
+                }
+
                 state = WaitFingerLost;
                 force_retry = false;
 
@@ -331,7 +428,8 @@ void BiometricsFingerprint::AuthenticateAsync() {
                     case ImageResult::ImagerDirty9:
                         if (reImaged > 6) {
                             NotifyAcquired(FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY);
-                            usleep(100000);
+                            // Cancellable pause before retrying:
+                            mWt.isEventAvailable(100);
                             reImaged = 0;
                         } else {
                             // Disable the sensor: the TZAPP will reset it completely!
@@ -342,11 +440,10 @@ void BiometricsFingerprint::AuthenticateAsync() {
                                 break;
                             }
 
-                            // ...And acquire a new image!
+                            // ...And acquire a new image as soon as the sensor is ready:
                             reImaged++;
-                            force_retry = true;
                             state = GetImage;
-                            usleep(150000);
+                            force_retry = WaitSensorReady(reimage_timeout_ms);
                         }
                         break;
                     case ImageResult::Partial:
@@ -362,11 +459,10 @@ void BiometricsFingerprint::AuthenticateAsync() {
                                 break;
                             }
 
-                            // ...And acquire a new image!
+                            // ...And acquire a new image as soon as the sensor is ready:
                             reImaged++;
-                            force_retry = true;
                             state = GetImage;
-                            usleep(150000);
+                            force_retry = WaitSensorReady(reimage_timeout_ms);
                         }
                         break;
                     case ImageResult::Mediocre:
@@ -383,10 +479,15 @@ void BiometricsFingerprint::AuthenticateAsync() {
                 break;
             case Identify:
                 // VSTATE_VERIFY
-                rc = mTrustlet.Identify(mGid, mOperationId, identify_result);
+                {
+                    auto trace = mTracer.Trace(UnlockStage::Identify);
+                    rc = mTrustlet.Identify(mGid, mOperationId, identify_result);
+                }
                 if (rc)
                     break;
 
+                mTracer.RecordTzTimes(identify_result.capture_time, identify_result.identify_time);
+
                 ALOGI("Identify status = %d, match_id = %d",
                       identify_result.status,
                       identify_result.match_id);
@@ -396,21 +497,23 @@ void BiometricsFingerprint::AuthenticateAsync() {
                         ALOGW("%s: Special edgecase: identify 0 (good?), but imager was seemingly dirty...", __func__);
                         NotifyAcquired(FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY);
                     } else {
+                        auto trace = mTracer.Trace(UnlockStage::Authenticated);
                         NotifyAuthenticated(identify_result.match_id, identify_result.hat);
                     }
                 } else if (identify_result.status < 3) {
+                    // Report the match before doing any template maintenance:
                     done = true;
+                    break;
                 }
 
-                rc = mTrustlet.UpdateTemplate(updated);
+                {
+                    auto trace = mTracer.Trace(UnlockStage::TemplateUpdate);
+                    rc = mTrustlet.UpdateTemplate(updated);
+                }
+                mTracer.Finish(false);
                 if (rc)
                     break;
-
-                if (updated) {
-                    rc = mTrustlet.SaveTemplate();
-                    if (rc)
-                        break;
-                }
+                templates_dirty |= updated;
 
                 state = WaitFingerLost;
                 break;
@@ -445,24 +548,7 @@ void BiometricsFingerprint::AuthenticateAsync() {
         }
     }
 
-    mTrustlet.SetSpiState(0);
-    rc = mTrustlet.FinalizeIdentify();
-
-    ALOGE_IF(rc, "%s: Failed to finish identify, rc = %d", __func__, rc);
-
-    // Clear challenge:
-    mOperationId = 0;
-
-    if (canceled) {
-        ALOGI("%s: Canceled", __func__);
-        NotifyError(FingerprintError::ERROR_CANCELED);
-    } else if (timeout) {
-        ALOGI("%s: Timeout", __func__);
-        NotifyError(FingerprintError::ERROR_TIMEOUT);
-    } else if (rc) {
-        ALOGI("%s: Finalizing with error %d", __func__, rc);
-        NotifyError(FingerprintError::ERROR_UNABLE_TO_PROCESS);
-    } else if (done) {
+    if (done) {
         ALOGI("Authentication successful: fid = %d, score = %d",
               identify_result.match_id,
               identify_result.score);
@@ -486,9 +572,62 @@ void BiometricsFingerprint::AuthenticateAsync() {
                   identify_result.hat.timestamp,
                   identify_result.hat.user_id);
 
-        NotifyAuthenticated(identify_result.match_id, identify_result.hat);
+        {
+            auto trace = mTracer.Trace(UnlockStage::Authenticated);
+            NotifyAuthenticated(identify_result.match_id, identify_result.hat);
+        }
+
+        {
+            auto trace = mTracer.Trace(UnlockStage::TemplateUpdate);
+            int update_rc = mTrustlet.UpdateTemplate(updated);
+            if (update_rc) {
+                // The match has been reported already; the session itself
+                // succeeded, but the failure must not go unnoticed:
+                ALOGE("%s: Failed to update template, rc = %d", __func__, update_rc);
+                ++mTemplateUpdateFailures;
+                updated = false;
+            }
+            templates_dirty |= updated;
+        }
+        mTracer.Finish(true);
+    }
+
+    // Template updates of this identify session are written out in one go,
+    // after the result has been reported. SaveTemplate is issued before
+    // FinalizeIdentify, like the TZ app expects.
+    if (templates_dirty) {
+        int save_rc = mTrustlet.SaveTemplate();
+        if (save_rc) {
+            ALOGE("%s: Failed to save template, rc = %d", __func__, save_rc);
+            ++mTemplateSaveFailures;
+        }
+    }
+
+    mTrustlet.SetSpiState(0);
+    int finalize_rc = mTrustlet.FinalizeIdentify();
+    ALOGE_IF(finalize_rc, "%s: Failed to finish identify, rc = %d", __func__, finalize_rc);
+    // An error of the session itself takes precedence:
+    if (!rc)
+        rc = finalize_rc;
+
+    // Clear challenge:
+    mOperationId = 0;
+
+    if (canceled) {
+        ALOGI("%s: Canceled", __func__);
+        NotifyError(FingerprintError::ERROR_CANCELED);
+    } else if (timeout) {
+        ALOGI("%s: Timeout", __func__);
+        NotifyError(FingerprintError::ERROR_TIMEOUT);
+    } else if (done) {
+        // onAuthenticated() ended this session for the client already, an
+        // error now would be reported against whatever it does next:
+        ALOGW_IF(rc, "%s: Wrapping up after a match failed, rc = %d", __func__, rc);
+    } else if (rc) {
+        ALOGI("%s: Finalizing with error %d", __func__, rc);
+        NotifyError(FingerprintError::ERROR_UNABLE_TO_PROCESS);
     } else {
-        ALOGE("Finished enroll without cancel, timeout, rc or successful auth");
+        ALOGE("Finished authenticate without cancel, timeout, rc or successful auth");
     }
 }
 
@@ -503,13 +642,27 @@ void BiometricsFingerprint::IdleAsync() {
         return WorkHandler::IdleAsync();
     }
 
+    // Do not power up the sensor for navigation when another command is
+    // likely to follow soon:
+    for (int delay; (delay = mIdlePredictor.NavigationDelay());)
+        if (mWt.isEventAvailable(delay)) {
+            ALOGD("%s: Handle event instead of navigation", __func__);
+            mIdlePredictor.NavigationSkipped();
+            return;
+        }
+
+    auto transition_start = systemTime(SYSTEM_TIME_MONOTONIC);
+
 #ifdef HAS_DYNAMIC_POWER_MANAGEMENT
-    DeviceEnableGuard<EgisFpDevice> guard{mDev};
+    auto power = mPower.Acquire();
+    ALOGE_IF(!power, "%s: Failed to power up the sensor", __func__);
 #endif
 
     rc = mTrustlet.SetWorkMode(WorkMode::NavigationDetect);
     LOG_ALWAYS_FATAL_IF(rc, "SetWorkMode(WorkMode::NavigationDetect) failed with rc=%d", rc);
 
+    mIdlePredictor.NavigationEntered(systemTime(SYSTEM_TIME_MONOTONIC) - transition_start);
+
     for (;;) {
         rc = mTrustlet.GetNavEvent(which);
         LOG_ALWAYS_FATAL_IF(rc, "GetNavEvent failed!");
@@ -554,13 +707,16 @@ void BiometricsFingerprint::IdleAsync() {
         }
     }
 
+    transition_start = systemTime(SYSTEM_TIME_MONOTONIC);
     rc = mTrustlet.SetWorkMode(WorkMode::Sleep);
     LOG_ALWAYS_FATAL_IF(rc, "SetWorkMode(WorkMode::Sleep) failed with rc=%d", rc);
+    mIdlePredictor.NavigationExited(systemTime(SYSTEM_TIME_MONOTONIC) - transition_start);
 }
 
 void BiometricsFingerprint::EnrollAsync() {
 #ifdef HAS_DYNAMIC_POWER_MANAGEMENT
-    DeviceEnableGuard<EgisFpDevice> guard{mDev};
+    auto power = mPower.Acquire();
+    ALOGE_IF(!power, "%s: Failed to power up the sensor", __func__);
 #endif
 
     enum EnrollState {
@@ -585,7 +741,7 @@ void BiometricsFingerprint::EnrollAsync() {
     int steps_needed;
     WakeupReason wakeup_reason;
     int reImaged = 0;
-    bool force_retry = false;
+    bool force_retry = false, finger_irq = false;
 
     rc = mTrustlet.InitializeEnroll();
     if (rc) {
@@ -605,14 +761,18 @@ void BiometricsFingerprint::EnrollAsync() {
 
         switch (state) {
             case WaitFingerDown:
+                if (!WaitDetectBackoff())
+                    break;
+
                 rc = mTrustlet.SetWorkMode(WorkMode::Detect);
                 ALOGE_IF(rc, "%s: Failed to set detect mode, rc = %d", __func__, rc);
                 if (rc)
                     break;
 
-                wakeup_reason = mMux.waitForEvent(mEnrollTimeout);
+                wakeup_reason = mMux.waitForEvent(mEnrollTimeoutMs);
                 if (wakeup_reason == WakeupReason::Finger) {
                     finger_state = 1;
+                    finger_irq = true;
                     state = GetImage;
                 } else if (wakeup_reason == WakeupReason::Timeout) {
                     timeout = true;
@@ -624,6 +784,11 @@ void BiometricsFingerprint::EnrollAsync() {
                 if (rc)
                     break;
 
+                if (finger_irq) {
+                    ReportCapture(image_result);
+                    finger_irq = false;
+                }
+
                 state = WaitFingerLost;
 
                 switch (image_result) {
@@ -640,7 +805,7 @@ void BiometricsFingerprint::EnrollAsync() {
                     case ImageResult::Partial:
                         if (reImaged > 6) {
                             NotifyAcquired(FingerprintAcquiredInfo::ACQUIRED_PARTIAL);
-                            usleep(10000);
+                            mWt.isEventAvailable(10);
                             reImaged = 0;
                         } else {
                             // Disable the sensor: the TZAPP will reset it completely!
@@ -651,18 +816,17 @@ void BiometricsFingerprint::EnrollAsync() {
                                 break;
                             }
 
-                            // ...And acquire a new image!
+                            // ...And acquire a new image as soon as the sensor is ready:
                             reImaged++;
-                            force_retry = true;
                             state = GetImage;
-                            usleep(150000);
+                            force_retry = WaitSensorReady(reimage_timeout_ms);
                         }
                         break;
                     case ImageResult::ImagerDirty:
                     case ImageResult::ImagerDirty9:
                         if (reImaged > 6) {
                             NotifyAcquired(FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY);
-                            usleep(10000);
+                            mWt.isEventAvailable(10);
                             reImaged = 0;
                         } else {
                             // Disable the sensor: the TZAPP will reset it completely!
@@ -673,11 +837,10 @@ void BiometricsFingerprint::EnrollAsync() {
                                 break;
                             }
 
-                            // ...And acquire a new image!
+                            // ...And acquire a new image as soon as the sensor is ready:
                             reImaged++;
-                            force_retry = true;
                             state = GetImage;
-                            usleep(150000);
+                            force_retry = WaitSensorReady(reimage_timeout_ms);
                         }
                         break;
                     default:
@@ -775,7 +938,7 @@ void BiometricsFingerprint::EnrollAsync() {
                 } else {
                     // NOTE: Based on authentication loop!
 
-                    wakeup_reason = mMux.waitForEvent(mEnrollTimeout);
+                    wakeup_reason = mMux.waitForEvent(mEnrollTimeoutMs);
                     if (wakeup_reason == WakeupReason::Timeout)
                         timeout = true;
                 }
@@ -805,11 +968,35 @@ void BiometricsFingerprint::EnrollAsync() {
         NotifyError(FingerprintError::ERROR_UNABLE_TO_PROCESS);
     } else if (percentage_done >= 100) {
         rc = mTrustlet.SaveEnrolledPrint(mGid, mNewPrintId);
+        mPrintCache.Invalidate();
         NotifyEnrollResult(mNewPrintId, 0);
         ALOGE_IF(rc, "%s: Failed to save print, rc = %d", __func__, rc);
     }
 }
 
+int BiometricsFingerprint::GetPrintIds(std::vector<uint32_t> &fids) {
+    return mPrintCache.GetPrints(fids, [this](auto &fids) { return mTrustlet.GetPrintIds(mGid, fids); });
+}
+
+bool BiometricsFingerprint::WaitDetectBackoff() {
+    nsecs_t deadline = mMux.backoffDeadline();
+    if (deadline < 0)
+        return true;
+
+    int timeoutMs = static_cast<int>(ns2ms(deadline - systemTime(SYSTEM_TIME_MONOTONIC))) + 1;
+    ALOGD("%s: Backing off finger detection for %d ms", __func__, timeoutMs);
+    return !mWt.isEventAvailable(timeoutMs);
+}
+
+bool BiometricsFingerprint::WaitSensorReady(int timeoutMs) {
+    // A finger IRQ means the sensor, back in detect mode, sees the finger:
+    return mMux.waitForEvent(timeoutMs) != WakeupReason::Event;
+}
+
+void BiometricsFingerprint::ReportCapture(ImageResult result) {
+    mMux.reportCapture(result != ImageResult::Lost && result != ImageResult::Nothing);
+}
+
 int BiometricsFingerprint::ResetSensor() {
     int rc = 0;
 
@@ -4,21 +4,30 @@
 
 #pragma once
 
+#include "DeferredInit.h"
 #include "EGISAPTrustlet.h"
+#include "HalCallSerializer.h"
+#include "IdlePredictor.h"
+#include "PrintCache.h"
 #include "QSEEKeymasterTrustlet.h"
+#include "SensorPowerDomain.h"
 #include "UInput.h"
+#include "UnlockLatencyTracer.h"
 
 #include <EventMultiplexer.h>
 #include <SynchronizedWorkerThread.h>
 #include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
+#include <cutils/properties.h>
 #include <egistec/EgisFpDevice.h>
 
 #include <array>
+#include <atomic>
 
 namespace egistec::current {
 
 using ::android::sp;
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
@@ -32,6 +41,8 @@ using ::android::hardware::biometrics::fingerprint::V2_1::RequestStatus;
 struct BiometricsFingerprint : public IBiometricsFingerprint, public ::SynchronizedWorker::WorkHandler {
    public:
     BiometricsFingerprint(EgisFpDevice &&);
+    // Reuses an already loaded session of the TZ app:
+    BiometricsFingerprint(EgisFpDevice &&, QSEETrustlet &&);
     ~BiometricsFingerprint();
 
     // Methods from ::android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint follow.
@@ -46,23 +57,43 @@ struct BiometricsFingerprint : public IBiometricsFingerprint, public ::Synchroni
     Return<RequestStatus> setActiveGroup(uint32_t gid, const hidl_string &storePath) override;
     Return<RequestStatus> authenticate(uint64_t operationId, uint32_t gid) override;
 
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void> debug(const hidl_handle &handle, const hidl_vec<hidl_string> &options) override;
+
    private:
     EGISAPTrustlet mTrustlet;
     EgisFpDevice mDev;
     MasterKey mMasterKey;
     sp<IBiometricsFingerprintClientCallback> mClientCallback;
     std::mutex mClientCallbackMutex;
+    HalCallSerializer mCalls;
     UInput uinput;
+    // See WAKE_ON_FINGER_PROPERTY:
+    const bool mWakeOnFinger = property_get_bool(WAKE_ON_FINGER_PROPERTY, false);
     uint32_t mGid = -1;
     uint32_t mHwId;
     ::SynchronizedWorker::Thread mWt;
     EventMultiplexer mMux;
 
-    int mEnrollTimeout = -1;
+    int mEnrollTimeoutMs = -1;
     uint32_t mNewPrintId = -1;
     uint64_t mEnrollChallenge = 0;
 
     int64_t mOperationId;
+    // Template maintenance failures after a match, shown by debug():
+    std::atomic<uint32_t> mTemplateUpdateFailures{0};
+    std::atomic<uint32_t> mTemplateSaveFailures{0};
+
+    UnlockLatencyTracer mTracer;
+    PrintCache mPrintCache;
+    IdlePredictor mIdlePredictor;
+#ifdef HAS_DYNAMIC_POWER_MANAGEMENT
+    SensorPowerDomain mPower{"egistec", [this](bool on) { return on ? mDev.Enable() : mDev.Disable(); }};
+#endif
+    DeferredInit mInit{"egistec", [this] { Init(); }};
+
+    // Runs on mInit:
+    void Init();
 
     // WorkHandler implementations:
     ::SynchronizedWorker::Thread &getWorker();
@@ -70,7 +101,17 @@ struct BiometricsFingerprint : public IBiometricsFingerprint, public ::Synchroni
     void EnrollAsync() override;
     void IdleAsync() override;
 
+    // Print ids of the active group, served from mPrintCache when possible:
+    int GetPrintIds(std::vector<uint32_t> &);
     int  ResetSensor();
+    // Waits out a finger detection backoff of mMux, returns false when a
+    // state request interrupts it:
+    bool WaitDetectBackoff();
+    // Waits up to timeoutMs for a finger IRQ after ResetSensor(), returns
+    // false when a state request interrupts it:
+    bool WaitSensorReady(int timeoutMs);
+    // Tells mMux whether the capture after a finger IRQ found a finger:
+    void ReportCapture(ImageResult);
     void NotifyAcquired(FingerprintAcquiredInfo);
     void NotifyAuthenticated(uint32_t fid, const hw_auth_token_t &hat);
     void NotifyEnrollResult(uint32_t fid, uint32_t remaining);
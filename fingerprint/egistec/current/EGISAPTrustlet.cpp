@@ -57,6 +57,9 @@ EGISAPTrustlet::EGISAPTrustlet() : QSEETrustlet(EGIS_QSEE_APP_NAME, 0x2400
                                    ) {
 }
 
+EGISAPTrustlet::EGISAPTrustlet(QSEETrustlet &&trustlet) : QSEETrustlet(std::move(trustlet)) {
+}
+
 #define CAPTURE_ERROR(cmd)                                    \
     ({                                                        \
         int rc = cmd;                                         \
@@ -77,7 +80,8 @@ int EGISAPTrustlet::SendCommand(EGISAPTrustlet::API &api) {
     log_hex(reinterpret_cast<const char *>(&api.GetRequest()), sizeof(trustlet_buffer_t));
 #endif
 
-    int rc = QSEETrustlet::SendCommand(&base, 0x880, &base, 0x840);
+    int rc = QSEETrustlet::SendCommand(&base, 0x880, &base, 0x840,
+                                       0, static_cast<uint32_t>(api.GetRequest().command));
     if (rc) {
         ALOGE("%s failed with rc = %d", __func__, rc);
         return rc;
@@ -122,7 +126,8 @@ int EGISAPTrustlet::SendModifiedCommand(EGISAPTrustlet::API &api, IonBuffer &ion
     log_hex(reinterpret_cast<const char *>(&api.GetRequest()), sizeof(trustlet_buffer_t));
 #endif
 
-    int rc = QSEETrustlet::SendModifiedCommand(&base, 0x880, &base, 0x840, &ifd_data);
+    int rc = QSEETrustlet::SendModifiedCommand(&base, 0x880, &base, 0x840, &ifd_data,
+                                               0, static_cast<uint32_t>(api.GetRequest().command), ionBuffer.requestedSize());
     if (rc) {
         ALOGE("%s failed with rc = %d", __func__, rc);
         return rc;
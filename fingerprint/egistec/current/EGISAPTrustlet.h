@@ -188,6 +188,8 @@ class EGISAPTrustlet : public QSEETrustlet {
 
    public:
     EGISAPTrustlet();
+    // Takes over a session of the app that is already loaded:
+    explicit EGISAPTrustlet(QSEETrustlet &&);
 
     int SendCommand(API &);
     int SendCommand(API &, CommandId, uint32_t gid = 0);
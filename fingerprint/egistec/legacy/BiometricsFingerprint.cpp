@@ -2,19 +2,28 @@
 
 #include <FormatException.hpp>
 
+#include <future>
+
 #define LOG_TAG "FPC ET"
 #include <log/log.h>
 
 namespace egistec::legacy {
 
-BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev) : loops(reinterpret_cast<uint64_t>(this), std::move(dev)) {
-    QSEEKeymasterTrustlet keymaster;
-    mMasterKey = keymaster.GetKey();
+BiometricsFingerprint::BiometricsFingerprint(EgisFpDevice &&dev, EGISAPTrustlet &&trustlet) : loops(reinterpret_cast<uint64_t>(this), std::move(dev), std::move(trustlet)) {
+}
+
+void BiometricsFingerprint::Init() {
+    // Fetch the master key from keymaster while the sensor is being prepared:
+    auto masterKey = std::async(std::launch::async, [] {
+        QSEEKeymasterTrustlet keymaster;
+        return keymaster.GetKey();
+    });
 
     int rc = loops.Prepare();
     if (rc)
         throw FormatException("Prepare failed with rc = %d", rc);
 
+    mMasterKey = masterKey.get();
     rc = loops.SetMasterKey(mMasterKey);
     if (rc)
         throw FormatException("SetMasterKey failed with rc = %d", rc);
@@ -30,6 +39,8 @@ Return<uint64_t> BiometricsFingerprint::setNotify(const sp<IBiometricsFingerprin
 }
 
 Return<uint64_t> BiometricsFingerprint::preEnroll() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     // TODO: Original service aborts+retries on failure.
     auto challenge = loops.GetChallenge();
     ALOGI("%s: Generated enroll challenge %#lx", __func__, challenge);
@@ -37,6 +48,8 @@ Return<uint64_t> BiometricsFingerprint::preEnroll() {
 }
 
 Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69> &hat, uint32_t gid, uint32_t timeoutSec) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     if (gid != mGid) {
         ALOGE("Cannot enroll finger for different gid! Caller needs to update storePath first with setActiveGroup()!");
         return RequestStatus::SYS_EINVAL;
@@ -55,26 +68,36 @@ Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69
 }
 
 Return<RequestStatus> BiometricsFingerprint::postEnroll() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: clearing challenge", __func__);
     // TODO: Original service aborts+retries on failure.
     return loops.ClearChallenge() ? RequestStatus::SYS_UNKNOWN : RequestStatus::SYS_OK;
 }
 
 Return<uint64_t> BiometricsFingerprint::getAuthenticatorId() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
     return loops.GetAuthenticatorId();
 }
 
 Return<RequestStatus> BiometricsFingerprint::cancel() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Bypass();
     ALOGI("Cancel requested");
     bool success = loops.Cancel();
     return success ? RequestStatus::SYS_OK : RequestStatus::SYS_UNKNOWN;
 }
 
 Return<RequestStatus> BiometricsFingerprint::enumerate() {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     return loops.Enumerate() ? RequestStatus::SYS_UNKNOWN : RequestStatus::SYS_OK;
 }
 
 Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: gid = %d, fid = %d", __func__, gid, fid);
     if (gid != mGid) {
         ALOGE("Change group and userpath through setActiveGroup first!");
@@ -84,6 +107,8 @@ Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)
 }
 
 Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid, const hidl_string &storePath) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: gid = %u, path = %s", __func__, gid, storePath.c_str());
     mGid = gid;
     int rc = loops.SetUserDataPath(mGid, storePath.c_str());
@@ -91,6 +116,8 @@ Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid, const
 }
 
 Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operationId, uint32_t gid) {
+    mInit.Wait(__func__);
+    auto call = mCalls.Enter();
     ALOGI("%s: gid = %d, secret = %lu", __func__, gid, operationId);
     if (gid != mGid) {
         ALOGE("Cannot authenticate finger for different gid! Caller needs to update storePath first with setActiveGroup()!");
@@ -100,4 +127,16 @@ Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operationId,
     return loops.Authenticate(operationId) ? RequestStatus::SYS_EINVAL : RequestStatus::SYS_OK;
 }
 
+Return<void> BiometricsFingerprint::debug(const hidl_handle &handle, const hidl_vec<hidl_string> & /* options */) {
+    if (handle == nullptr || handle->numFds < 1) {
+        ALOGE("%s: Missing file descriptor", __func__);
+        return Void();
+    }
+
+    loops.Dump(handle->data[0]);
+    mCalls.Dump(handle->data[0]);
+    mInit.Dump(handle->data[0]);
+    return Void();
+}
+
 }  // namespace egistec::legacy
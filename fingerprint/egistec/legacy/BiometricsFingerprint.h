@@ -6,6 +6,8 @@
 
 #include "EgisOperationLoops.h"
 
+#include <DeferredInit.h>
+#include <HalCallSerializer.h>
 #include <QSEEKeymasterTrustlet.h>
 #include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
 
@@ -15,6 +17,7 @@ namespace egistec::legacy {
 
 using ::android::sp;
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
@@ -25,7 +28,8 @@ using ::android::hardware::biometrics::fingerprint::V2_1::RequestStatus;
 
 struct BiometricsFingerprint : public IBiometricsFingerprint {
    public:
-    BiometricsFingerprint(EgisFpDevice &&);
+    // Takes over the trustlet that was used to probe the firmware:
+    BiometricsFingerprint(EgisFpDevice &&, EGISAPTrustlet &&);
 
     // Methods from ::android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint follow.
     Return<uint64_t> setNotify(const sp<IBiometricsFingerprintClientCallback> &clientCallback) override;
@@ -39,10 +43,18 @@ struct BiometricsFingerprint : public IBiometricsFingerprint {
     Return<RequestStatus> setActiveGroup(uint32_t gid, const hidl_string &storePath) override;
     Return<RequestStatus> authenticate(uint64_t operationId, uint32_t gid) override;
 
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void> debug(const hidl_handle &handle, const hidl_vec<hidl_string> &options) override;
+
    private:
     MasterKey mMasterKey;
     uint32_t mGid;
     EgisOperationLoops loops;
+    HalCallSerializer mCalls;
+    DeferredInit mInit{"egistec legacy", [this] { Init(); }};
+
+    // Runs on mInit:
+    void Init();
 };
 
 }  // namespace egistec::legacy
@@ -93,7 +93,14 @@ int EGISAPTrustlet::SendCommand(EGISAPTrustlet::API &lockedBuffer) {
     log_hex(reinterpret_cast<const char *>(&lockedBuffer.GetRequest()), sizeof(trustlet_buffer_t));
 #endif
 
-    int rc = QSEETrustlet::SendCommand(prefix, 0x880, prefix, 0x840);
+    // Trace extra-commands by their own id, and authentication and
+    // enrollment commands by their step:
+    const auto &request = lockedBuffer.GetRequest();
+    const auto trace_cmd = request.command == Command::ExtraCommand
+                               ? static_cast<uint32_t>(request.extra_buffer.command)
+                               : static_cast<uint32_t>(request.command_buffer.step);
+    int rc = QSEETrustlet::SendCommand(prefix, 0x880, prefix, 0x840,
+                                       static_cast<uint32_t>(request.command), trace_cmd);
     if (rc) {
         ALOGE("SendCommand failed with rc = %d", rc);
         return rc;
@@ -5,6 +5,7 @@
 #endif
 #include "EgisOperationLoops.h"
 #include "FormatException.hpp"
+#include "tz_trace.h"
 
 #include <arpa/inet.h>
 #include <hardware/hw_auth_token.h>
@@ -24,11 +25,16 @@ namespace egistec::legacy {
 using ::android::hardware::hidl_vec;
 using namespace ::SynchronizedWorker;
 
-EgisOperationLoops::EgisOperationLoops(uint64_t deviceId, EgisFpDevice &&dev) : mDeviceId(deviceId), mDev(std::move(dev)), mAuthenticatorId(GetRand64()), mWt(this), mMux(mDev.GetFd(), mWt.getEventFd()) {
+EgisOperationLoops::EgisOperationLoops(uint64_t deviceId, EgisFpDevice &&dev, EGISAPTrustlet &&trustlet) : EGISAPTrustlet(std::move(trustlet)), mDeviceId(deviceId), mDev(std::move(dev)), mAuthenticatorId(GetRand64()), mWt(this), mMux(mDev.GetFd(), mWt.getEventFd(), ET51X_IOCRIRQPOLL) {
     mWt.Start();
 }
 
-void EgisOperationLoops::ProcessOpcode(const command_buffer_t &cmd) {
+EgisOperationLoops::~EgisOperationLoops() {
+    // The worker uses the members below mWt, which are destroyed first:
+    mWt.Stop();
+}
+
+void EgisOperationLoops::ProcessOpcode(const command_buffer_t &cmd, bool cancellable) {
     switch (cmd.step) {
         case Step::WaitFingerprint:
             ALOGE("%s: Expected to wait for finger in non-interactive state!", __func__);
@@ -37,8 +43,13 @@ void EgisOperationLoops::ProcessOpcode(const command_buffer_t &cmd) {
             // is handled explicitly.
             break;
         case Step::NotReady:
-            ALOGV("%s: Device not ready, sleeping for %dms", __func__, cmd.timeout);
-            usleep(1000 * cmd.timeout);
+            ALOGV("%s: Device not ready, waiting for %dms", __func__, cmd.timeout);
+            if (cancellable)
+                // Cut the wait short on a cancel event, which the caller
+                // handles at the next loop iteration:
+                mWt.isEventAvailable(cmd.timeout);
+            else
+                usleep(1000 * cmd.timeout);
             break;
         case Step::Error:
             ALOGV("%s: Device error, resetting...", __func__);
@@ -192,10 +203,10 @@ void EgisOperationLoops::NotifyBadImage(int reason) {
     NotifyAcquired(acquiredInfo);
 }
 
-FingerprintError EgisOperationLoops::HandleMainStep(command_buffer_t &cmd, int timeoutSec) {
+FingerprintError EgisOperationLoops::HandleMainStep(command_buffer_t &cmd, int timeoutMs) {
     switch (cmd.step) {
         case Step::WaitFingerprint: {
-            auto reason = mMux.waitForEvent(timeoutSec);
+            auto reason = mMux.waitForEvent(timeoutMs);
             switch (reason) {
                 case WakeupReason::Timeout:
                     // Return timeout: this notifies the service and stops the current loop.
@@ -233,7 +244,7 @@ FingerprintError EgisOperationLoops::HandleMainStep(command_buffer_t &cmd, int t
             break;
         default:
             // NOTE: Most cases were handled as duplicates here.
-            ProcessOpcode(cmd);
+            ProcessOpcode(cmd, true);
             break;
     }
     return FingerprintError::ERROR_NO_ERROR;
@@ -244,7 +255,8 @@ Thread &EgisOperationLoops::getWorker() {
 }
 
 void EgisOperationLoops::EnrollAsync() {
-    DeviceEnableGuard<EgisFpDevice> guard{mDev};
+    auto power = mPower.Acquire();
+    ALOGE_IF(!power, "%s: Failed to power up the sensor", __func__);
     int rc = 0;
     auto lockedBuffer = GetLockedAPI();
     auto &cmdOut = lockedBuffer.GetResponse().command_buffer;
@@ -272,7 +284,7 @@ void EgisOperationLoops::EnrollAsync() {
             if (ConvertAndCheckError(rc, lockedBuffer))
                 return;
 
-            ProcessOpcode(cmdOut);
+            ProcessOpcode(cmdOut, true);
         } while (cmdOut.step != Step::Done);
 
         do {
@@ -295,7 +307,7 @@ void EgisOperationLoops::EnrollAsync() {
                 ALOGD("Enroll: bad image %#x, next step = %d", cmdOut.bad_image_reason, cmdOut.step);
                 NotifyBadImage(cmdOut.bad_image_reason);
             } else if (!rc) {
-                auto fe = HandleMainStep(cmdOut, mEnrollTimeout);
+                auto fe = HandleMainStep(cmdOut, mEnrollTimeoutMs);
                 if (fe != FingerprintError::ERROR_NO_ERROR) {
                     RunCancel(lockedBuffer);
                     return NotifyError(fe);
@@ -327,7 +339,7 @@ void EgisOperationLoops::EnrollAsync() {
             if (ConvertAndCheckError(rc, lockedBuffer))
                 return;
 
-            ProcessOpcode(cmdOut);
+            ProcessOpcode(cmdOut, true);
         } while (cmdOut.step != Step::Done);
     }
 
@@ -337,10 +349,12 @@ void EgisOperationLoops::EnrollAsync() {
 }
 
 void EgisOperationLoops::AuthenticateAsync() {
-    DeviceEnableGuard<EgisFpDevice> guard{mDev};
+    auto power = mPower.Acquire();
+    ALOGE_IF(!power, "%s: Failed to power up the sensor", __func__);
     int rc = 0;
     auto lockedBuffer = GetLockedAPI();
     auto &cmdOut = lockedBuffer.GetResponse().command_buffer;
+    nsecs_t finger_down = 0;
 
     for (bool authenticated = false; !authenticated;) {
         // Zero step:
@@ -369,14 +383,22 @@ void EgisOperationLoops::AuthenticateAsync() {
                 // TODO: Handle rc == -6 -> calibrate error.
                 return;
 
-            ProcessOpcode(cmdOut);
+            ProcessOpcode(cmdOut, true);
         } while (cmdOut.step != Step::Done);
 
         do {
             if (CheckAndHandleCancel(lockedBuffer))
                 return;
             lockedBuffer.MoveResponseToRequest();
+            const auto begin = systemTime(SYSTEM_TIME_MONOTONIC);
+            if (finger_down) {
+                mTracer.Record(UnlockStage::Wake, finger_down, begin);
+                finger_down = 0;
+            }
             rc = SendAuthenticate(lockedBuffer);
+            // The TZ app captures until it is satisfied with the image, and
+            // returns Done together with the identify result:
+            mTracer.Record(cmdOut.step == Step::Done ? UnlockStage::Identify : UnlockStage::Capture, begin);
             ALOGD("Authenticate: step, rc = %d, next step = %d", rc, cmdOut.step);
             // TODO: if convert(rc) == -9, restart from init_enroll
 
@@ -385,16 +407,25 @@ void EgisOperationLoops::AuthenticateAsync() {
 
             if (rc == 0x20) {
                 ALOGD("Authenticate: Finger not recognized");
-                NotifyAuthenticated(0, mCurrentChallenge);
+                {
+                    auto trace = mTracer.Trace(UnlockStage::Authenticated);
+                    NotifyAuthenticated(0, mCurrentChallenge);
+                }
+                mTracer.Finish(false);
             } else if (rc == 0x27) {
                 ALOGD("Authenticate: bad image %#x, next step = %d", cmdOut.bad_image_reason, cmdOut.step);
                 NotifyBadImage(cmdOut.bad_image_reason);
             } else if (!rc) {
+                const auto step = cmdOut.step;
                 auto fe = HandleMainStep(cmdOut);
                 if (fe != FingerprintError::ERROR_NO_ERROR) {
                     RunCancel(lockedBuffer);
                     return NotifyError(fe);
                 }
+                if (step == Step::WaitFingerprint) {
+                    finger_down = systemTime(SYSTEM_TIME_MONOTONIC);
+                    mTracer.FingerDown(finger_down);
+                }
             }
 
         } while (cmdOut.step != Step::Done);
@@ -419,7 +450,7 @@ void EgisOperationLoops::AuthenticateAsync() {
             if (ConvertAndCheckError(rc, lockedBuffer))
                 return;
 
-            ProcessOpcode(cmdOut);
+            ProcessOpcode(cmdOut, true);
         } while (cmdOut.step != Step::Done);
 
         // NOTE: This special cancel operation is only in the codepath that
@@ -457,11 +488,24 @@ void EgisOperationLoops::AuthenticateAsync() {
     mCurrentChallenge.user_id = result.secure_user_id;
     memcpy(mCurrentChallenge.hmac, result.hmac, sizeof(result.hmac));
 
-    NotifyAuthenticated(cmdOut.finger_id, mCurrentChallenge);
+    mTracer.RecordTzTimes(result.capture_time, result.identify_time);
+    {
+        auto trace = mTracer.Trace(UnlockStage::Authenticated);
+        NotifyAuthenticated(cmdOut.finger_id, mCurrentChallenge);
+    }
+    mTracer.Finish(true);
     // Clear "sensitive" authentication tokens:
     memset(&mCurrentChallenge, 0, sizeof(mCurrentChallenge));
 }
 
+void EgisOperationLoops::Dump(int fd) {
+    mTracer.Dump(fd);
+    mPower.Dump(fd);
+    mWt.Dump(fd);
+    mMux.Dump(fd);
+    tz_trace_dump(fd);
+}
+
 uint64_t EgisOperationLoops::GetAuthenticatorId() {
     return mAuthenticatorId;
 }
@@ -585,7 +629,7 @@ int EgisOperationLoops::Enroll(const hw_auth_token_t &hat, uint32_t timeoutSec)
     }
 
     mSecureUserId = hat.user_id;
-    mEnrollTimeout = timeoutSec;
+    mEnrollTimeoutMs = timeoutSec * 1000;
 
     api.MoveResponseToRequest();
     rc = CheckAuthToken(api);
@@ -3,11 +3,14 @@
 #include "EGISAPTrustlet.h"
 
 #include <EventMultiplexer.h>
+#include <SensorPowerDomain.h>
 #include <SynchronizedWorkerThread.h>
+#include <UnlockLatencyTracer.h>
 #include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprintClientCallback.h>
 #include <egistec/EgisFpDevice.h>
 #include <sys/eventfd.h>
 
+#include <atomic>
 #include <mutex>
 
 namespace egistec::legacy {
@@ -27,15 +30,20 @@ class EgisOperationLoops : public EGISAPTrustlet, public ::SynchronizedWorker::W
     sp<IBiometricsFingerprintClientCallback> mClientCallback;
     std::mutex mClientCallbackMutex;
     uint32_t mGid;
-    uint64_t mAuthenticatorId;
+    // Read by getAuthenticatorId(), which bypasses HalCallSerializer:
+    std::atomic<uint64_t> mAuthenticatorId;
     ::SynchronizedWorker::Thread mWt;
     EventMultiplexer mMux;
+    UnlockLatencyTracer mTracer;
+    SensorPowerDomain mPower{"egistec", [this](bool on) { return on ? mDev.Enable() : mDev.Disable(); }};
 
    public:
-    EgisOperationLoops(uint64_t deviceId, EgisFpDevice &&);
+    EgisOperationLoops(uint64_t deviceId, EgisFpDevice &&, EGISAPTrustlet &&);
+    ~EgisOperationLoops();
 
    private:
-    void ProcessOpcode(const command_buffer_t &);
+    // When cancellable, a cancel event cuts NotReady waits short:
+    void ProcessOpcode(const command_buffer_t &, bool cancellable = false);
     int ConvertReturnCode(int);
     /**
      * Convert error code from the device.
@@ -60,7 +68,7 @@ class EgisOperationLoops : public EGISAPTrustlet, public ::SynchronizedWorker::W
     // Temporaries for asynchronous operation:
     uint64_t mSecureUserId;
     hw_auth_token_t mCurrentChallenge;
-    int mEnrollTimeout;
+    int mEnrollTimeoutMs;
 
     // Notify functions:
     void NotifyError(FingerprintError);
@@ -73,7 +81,7 @@ class EgisOperationLoops : public EGISAPTrustlet, public ::SynchronizedWorker::W
     /**
      * Process the next step of the main section of enroll() or authenticate().
      */
-    FingerprintError HandleMainStep(command_buffer_t &, int timeoutSec = -1);
+    FingerprintError HandleMainStep(command_buffer_t &, int timeoutMs = -1);
 
     // WorkHandler implementations:
     // These should run asynchronously from HAL calls:
@@ -83,6 +91,7 @@ class EgisOperationLoops : public EGISAPTrustlet, public ::SynchronizedWorker::W
 
    public:
     uint64_t GetAuthenticatorId();
+    void Dump(int fd);
 
     void SetNotify(const sp<IBiometricsFingerprintClientCallback>);
     int SetUserDataPath(uint32_t gid, const char *path);
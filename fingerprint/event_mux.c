@@ -0,0 +1,199 @@
+#include "event_mux.h"
+
+#include <errno.h>
+#include <string.h>
+#if PLATFORM_SDK_VERSION >= 28
+#include <bits/epoll_event.h>
+#endif
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "FPC Mux"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+// epoll data of the deadline timer, past the index of any source:
+#define TIMER_INDEX EVENT_MUX_MAX_SOURCES
+
+int event_mux_init(event_mux_t *mux)
+{
+    memset(mux, 0, sizeof(*mux));
+    mux->timer_fd = -1;
+
+    mux->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (mux->epoll_fd < 0) {
+        ALOGE("Failed to create epoll: %s", strerror(errno));
+        return -1;
+    }
+
+    mux->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mux->timer_fd < 0) {
+        ALOGE("Failed to create timerfd: %s", strerror(errno));
+        event_mux_destroy(mux);
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .data.u32 = TIMER_INDEX,
+        .events = EPOLLIN,
+    };
+    if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, mux->timer_fd, &ev)) {
+        ALOGE("Failed to add timerfd to epoll: %s", strerror(errno));
+        event_mux_destroy(mux);
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_mux_destroy(event_mux_t *mux)
+{
+    if (mux->timer_fd >= 0)
+        close(mux->timer_fd);
+    if (mux->epoll_fd >= 0)
+        close(mux->epoll_fd);
+    mux->timer_fd = mux->epoll_fd = -1;
+    mux->num_sources = 0;
+}
+
+int event_mux_add(event_mux_t *mux, int fd, int id, event_mux_handler_t handler, void *ctx)
+{
+    if (mux->num_sources >= EVENT_MUX_MAX_SOURCES || id < 0) {
+        ALOGE("%s: Cannot add fd %d with id %d", __func__, fd, id);
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .data.u32 = mux->num_sources,
+        .events = EPOLLIN,
+    };
+    if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        ALOGE("Failed to add fd %d to epoll: %s", fd, strerror(errno));
+        return -1;
+    }
+
+    mux->sources[mux->num_sources++] = (event_mux_source_t){
+        .fd = fd,
+        .id = id,
+        .handler = handler,
+        .ctx = ctx,
+    };
+    return 0;
+}
+
+int64_t event_mux_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t event_mux_deadline_ms(int timeout_ms)
+{
+    if (timeout_ms < 0)
+        return -1;
+    return event_mux_now_ns() + (int64_t)timeout_ms * 1000000;
+}
+
+static int arm_timer(const event_mux_t *mux, int64_t deadline_ns)
+{
+    // A zero it_value disarms the timer:
+    struct itimerspec its = {};
+    if (deadline_ns >= 0) {
+        its.it_value.tv_sec = deadline_ns / 1000000000;
+        its.it_value.tv_nsec = deadline_ns % 1000000000;
+    }
+
+    if (timerfd_settime(mux->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        ALOGE("Failed to arm timerfd: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int set_trigger(const event_mux_t *mux, unsigned int index, uint32_t trigger)
+{
+    struct epoll_event ev = {
+        .data.u32 = index,
+        .events = EPOLLIN | trigger,
+    };
+    if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_MOD, mux->sources[index].fd, &ev)) {
+        ALOGE("Failed to modify fd %d in epoll: %s", mux->sources[index].fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void restore_level_triggered(const event_mux_t *mux, unsigned int edge)
+{
+    for (unsigned int i = 0; edge; ++i, edge >>= 1)
+        if (edge & 1)
+            set_trigger(mux, i, 0);
+}
+
+int event_mux_wait_until(const event_mux_t *mux, int64_t deadline_ns)
+{
+    struct epoll_event events[EVENT_MUX_MAX_SOURCES + 1];
+    // Sources switched to edge-triggered during this wait:
+    unsigned int edge = 0;
+    int cnt;
+
+    // Only arm the timer for deadlines in the future; a passed deadline
+    // checks the sources without blocking:
+    int expired = deadline_ns >= 0 && deadline_ns <= event_mux_now_ns();
+    if (arm_timer(mux, expired ? -1 : deadline_ns))
+        return EVENT_MUX_ERROR;
+
+    for (;;) {
+        do {
+            cnt = epoll_wait(mux->epoll_fd, events, EVENT_MUX_MAX_SOURCES + 1, expired ? 0 : -1);
+        } while (cnt < 0 && errno == EINTR);
+
+        if (cnt < 0) {
+            ALOGE("Failed waiting for epoll: %s", strerror(errno));
+            restore_level_triggered(mux, edge);
+            return EVENT_MUX_ERROR;
+        }
+
+        // Collect the ready sources of the whole batch, and handle them in
+        // order of priority:
+        unsigned int ready = 0;
+        int timer = 0;
+        for (int i = 0; i < cnt; ++i) {
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                continue;
+            if (events[i].data.u32 == TIMER_INDEX)
+                timer = 1;
+            else if (events[i].data.u32 < mux->num_sources)
+                ready |= 1u << events[i].data.u32;
+        }
+
+        for (unsigned int i = 0; i < mux->num_sources; ++i) {
+            if (!(ready & (1u << i)))
+                continue;
+            const event_mux_source_t *source = &mux->sources[i];
+            if (!source->handler || source->handler(source->ctx, source->fd)) {
+                ALOGV("%s: Woken up by source %d", __func__, source->id);
+                restore_level_triggered(mux, edge);
+                return source->id;
+            }
+            // The handler consumed the event, but the fd may well stay
+            // readable: only wake up for new events on it from now on.
+            if (!(edge & (1u << i)) && !set_trigger(mux, i, EPOLLET))
+                edge |= 1u << i;
+        }
+
+        if (timer || expired) {
+            uint64_t expirations;
+            if (timer && read(mux->timer_fd, &expirations, sizeof(expirations)) < 0)
+                ALOGV("%s: Timer already drained: %s", __func__, strerror(errno));
+            ALOGV("%s: Timed out", __func__);
+            restore_level_triggered(mux, edge);
+            return EVENT_MUX_TIMEOUT;
+        }
+
+        // Everything was handled inline, continue waiting.
+    }
+}
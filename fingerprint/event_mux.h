@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * epoll-based multiplexer of the fds a HAL operation waits on, shared by
+ * the FPC and Egistec stacks.
+ *
+ * Sources are registered with an id that is returned when they wake up a
+ * wait, and take priority over sources registered after them when several
+ * are ready at once: register control events (the worker eventfd) first.
+ * A source can have a handler to process its events inline, without
+ * returning from the wait. Once its handler consumed an event, a source
+ * only wakes up the rest of that wait on new events (edge-triggered), so
+ * an fd that stays readable doesn't spin it.
+ *
+ * Deadlines are absolute CLOCK_MONOTONIC times in ns, backed by a timerfd,
+ * so waits are not limited to the ms granularity of epoll_wait and don't
+ * drift when a wait is restarted after an inline event.
+ */
+
+#define EVENT_MUX_MAX_SOURCES 4
+
+enum {
+    EVENT_MUX_TIMEOUT = -1,
+    EVENT_MUX_ERROR = -2,
+};
+
+/**
+ * @return Non-zero to return the id of the source from the wait, 0 when
+ *         the event was handled and the wait should continue.
+ */
+typedef int (*event_mux_handler_t)(void *ctx, int fd);
+
+typedef struct {
+    int fd;
+    int id;
+    event_mux_handler_t handler;
+    void *ctx;
+} event_mux_source_t;
+
+typedef struct {
+    int epoll_fd;
+    int timer_fd;
+    unsigned int num_sources;
+    event_mux_source_t sources[EVENT_MUX_MAX_SOURCES];
+} event_mux_t;
+
+int event_mux_init(event_mux_t *mux);
+void event_mux_destroy(event_mux_t *mux);
+/**
+ * @param[in] id      Non-negative id to return when \p fd wakes up a wait.
+ * @param[in] handler Optional, see event_mux_handler_t.
+ */
+int event_mux_add(event_mux_t *mux, int fd, int id, event_mux_handler_t handler, void *ctx);
+
+int64_t event_mux_now_ns(void);
+/**
+ * @return The deadline that is \p timeout_ms from now, or -1 (no deadline)
+ *         when \p timeout_ms is negative.
+ */
+int64_t event_mux_deadline_ms(int timeout_ms);
+/**
+ * Wait until a source is ready, or \p deadline_ns passes.
+ *
+ * @param[in] deadline_ns Absolute CLOCK_MONOTONIC time. A negative value
+ *                        blocks forever, a passed deadline only checks the
+ *                        sources without blocking.
+ *
+ * @return The id of the source that woke up the wait, EVENT_MUX_TIMEOUT or
+ *         EVENT_MUX_ERROR.
+ */
+int event_mux_wait_until(const event_mux_t *mux, int64_t deadline_ns);
+
+__END_DECLS
@@ -29,9 +29,27 @@ typedef struct
     uint32_t prints[MAX_FINGERPRINTS];
 } fpc_fingerprint_index_t;
 
+/*
+ * Timestamps of the image captured by the last fpc_capture_image() call,
+ * in CLOCK_MONOTONIC ns as returned by fpc_now_ns(). finger_down_ns is
+ * zero when that call did not see a finger.
+ */
+typedef struct {
+    int64_t finger_down_ns;
+    // When the wake key was queued, zero if it was not:
+    int64_t wake_key_ns;
+    int64_t capture_begin_ns;
+    int64_t capture_end_ns;
+} fpc_capture_timing_t;
+
 typedef struct fpc_imp_data_t {
     fpc_event_t event;
     fpc_uinput_t uinput;
+    // Click KEY_WAKEUP as soon as fpc_capture_image() sees a finger, see
+    // WAKE_ON_FINGER_PROPERTY:
+    bool wake_on_finger;
+    fpc_capture_timing_t capture_timing;
+    fpc_wakelock_t wakelock;
 } fpc_imp_data_t;
 
 int64_t fpc_load_db_id(fpc_imp_data_t *data); //load db ID, used as authenticator ID in android
@@ -60,6 +78,8 @@ err_t fpc_set_gid(fpc_imp_data_t *data, uint32_t gid);
 err_t fpc_load_user_db(fpc_imp_data_t *data, char* path); //load user DB into TZ app from storage
 err_t fpc_load_empty_db(fpc_imp_data_t *data);
 err_t fpc_store_user_db(fpc_imp_data_t *data, char* path); //store running TZ db
+void fpc_dump_buffers(fpc_imp_data_t *data, int fd); //print TZ command buffer statistics
+err_t fpc_reinit_sensor(fpc_imp_data_t *data); //reset the sensor, and have the TZ app set it up again
 err_t fpc_close(fpc_imp_data_t **data); //close this implementation
 err_t fpc_init(fpc_imp_data_t **data, int event_fd); //init sensor
 
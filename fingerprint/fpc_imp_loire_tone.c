@@ -21,23 +21,31 @@
 #include "tz_api_loire_tone.h"
 
 #include "common.h"
+#include "tz_trace.h"
 
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 
 #define LOG_TAG "FPC IMP"
 //#define LOG_NDEBUG 0
+#define ATRACE_TAG ATRACE_TAG_HAL
 
+#include <cutils/trace.h>
 #include <log/log.h>
 #include <limits.h>
 
+// Interval at which a finger that is still on the sensor is checked again:
+#define FINGER_LOST_RECHECK_MS 20
+
 typedef struct {
     struct fpc_imp_data_t data;
     struct QSEECom_handle *fpc_handle;
     struct qsee_handle_t* qsee_handle;
     struct qcom_km_ion_info_t ihandle;
+    struct qcom_km_ion_pool_t ion_pool;
     uint64_t auth_id;
 } fpc_data_t;
 
@@ -73,7 +81,10 @@ static const char *fpc_error_str(int err)
 }
 
 
-err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t ihandle)
+// cmd_len is the length of the command in ihandle, which the TZ app
+// answers in place:
+err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t ihandle,
+                                  uint32_t cmd_len)
 {
     struct QSEECom_handle *handle = ldata->fpc_handle;
 
@@ -89,7 +100,13 @@ err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t i
     send_cmd->v_addr = (intptr_t) ihandle.ion_sbuffer;
     uint32_t length = (ihandle.sbuf_len + 4095) & (~4095);
     send_cmd->length = length;
+    // Every command starts with its group and command id:
+    const uint32_t *ids = (const uint32_t *)ihandle.ion_sbuffer;
+    const uint32_t group_id = ids[0], cmd_id = ids[1];
+    int64_t trace_begin = tz_trace_begin();
     int result = ldata->qsee_handle->send_modified_cmd(handle,send_cmd,64,rec_cmd,64,&ion_fd_info);
+    tz_trace_end(trace_begin, "fpc", group_id, cmd_id, 64 + 64 + cmd_len,
+                 result ? result : *(int32_t*)rec_cmd);
 
     if(result)
     {
@@ -115,7 +132,7 @@ err_t send_normal_command(fpc_data_t *ldata, int command)
     send_cmd->cmd_id = command;
     send_cmd->ret_val = 0x0;
 
-    int ret = send_modified_command_to_tz(ldata, ldata->ihandle);
+    int ret = send_modified_command_to_tz(ldata, ldata->ihandle, sizeof(*send_cmd));
 
     if(!ret) {
         ret = send_cmd->ret_val;
@@ -126,73 +143,76 @@ err_t send_normal_command(fpc_data_t *ldata, int command)
 
 err_t send_buffer_command(fpc_data_t *ldata, uint32_t group_id, uint32_t cmd_id, const uint8_t *buffer, uint32_t length)
 {
-    struct qcom_km_ion_info_t ihandle;
-    if (ldata->qsee_handle->ion_alloc(&ihandle, length + sizeof(fpc_send_buffer_t)) <0) {
+    struct qcom_km_ion_info_t *ihandle;
+    if (qcom_km_ion_pool_lease(&ldata->ion_pool, &ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("ION allocation  failed");
         return -1;
     }
-    fpc_send_buffer_t *cmd_data = (fpc_send_buffer_t*)ihandle.ion_sbuffer;
-    memset(ihandle.ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
+    fpc_send_buffer_t *cmd_data = (fpc_send_buffer_t*)ihandle->ion_sbuffer;
+    memset(ihandle->ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
     cmd_data->group_id = group_id;
     cmd_data->cmd_id = cmd_id;
     cmd_data->length = length;
     memcpy(&cmd_data->data, buffer, length);
 
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
+    if(send_modified_command_to_tz(ldata, *ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("Error sending data to tz\n");
+        qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
         return -1;
     }
 
     int result = cmd_data->status;
-    ldata->qsee_handle->ion_free(&ihandle);
+    qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
     return result;
 }
 
 
 err_t send_command_result_buffer(fpc_data_t *ldata, uint32_t group_id, uint32_t cmd_id, uint8_t *buffer, uint32_t length)
 {
-    struct qcom_km_ion_info_t ihandle;
-    if (ldata->qsee_handle->ion_alloc(&ihandle, length + sizeof(fpc_send_buffer_t)) <0) {
+    struct qcom_km_ion_info_t *ihandle;
+    if (qcom_km_ion_pool_lease(&ldata->ion_pool, &ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("ION allocation  failed");
         return -1;
     }
-    fpc_send_buffer_t *keydata_cmd = (fpc_send_buffer_t*)ihandle.ion_sbuffer;
-    memset(ihandle.ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
+    fpc_send_buffer_t *keydata_cmd = (fpc_send_buffer_t*)ihandle->ion_sbuffer;
+    memset(ihandle->ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
     keydata_cmd->group_id = group_id;
     keydata_cmd->cmd_id = cmd_id;
     keydata_cmd->length = length;
 
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
+    if(send_modified_command_to_tz(ldata, *ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("Error sending data to tz\n");
+        qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
         return -1;
     }
     memcpy(buffer, &keydata_cmd->data[0], length);
 
     int result = keydata_cmd->status;
-    ldata->qsee_handle->ion_free(&ihandle);
+    qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
     return result;
 }
 
 err_t send_custom_cmd(fpc_data_t *ldata, void *buffer, uint32_t len)
 {
     ALOGV(__func__);
-    struct qcom_km_ion_info_t ihandle;
+    struct qcom_km_ion_info_t *ihandle;
 
-    if (ldata->qsee_handle->ion_alloc(&ihandle, len) <0) {
+    if (qcom_km_ion_pool_lease(&ldata->ion_pool, &ihandle, len) < 0) {
         ALOGE("ION allocation  failed");
         return -1;
     }
 
-    memcpy(ihandle.ion_sbuffer, buffer, len);
+    memcpy(ihandle->ion_sbuffer, buffer, len);
 
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
+    if(send_modified_command_to_tz(ldata, *ihandle, len) < 0) {
         ALOGE("Error sending data to tz\n");
+        qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
         return -1;
     }
 
     // Copy back result
-    memcpy(buffer, ihandle.ion_sbuffer, len);
-    ldata->qsee_handle->ion_free(&ihandle);
+    memcpy(buffer, ihandle->ion_sbuffer, len);
+    qcom_km_ion_pool_return(&ldata->ion_pool, ihandle);
 
     return 0;
 };
@@ -368,6 +388,9 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
     ALOGV(__func__);
 
     fpc_data_t *ldata = (fpc_data_t*)data;
+    fpc_capture_timing_t *timing = &data->capture_timing;
+
+    memset(timing, 0, sizeof(*timing));
 
     int ret = fpc_wait_finger_lost(data);
     ALOGV("fpc_wait_finger_lost = 0x%08X", ret);
@@ -382,8 +405,20 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
             return ret;
         if(ret)
         {
+            timing->finger_down_ns = fpc_now_ns();
+            if (data->wake_on_finger) {
+                // Let the display power up while the image is captured and matched:
+                fpc_uinput_click(&data->uinput, KEY_WAKEUP);
+                timing->wake_key_ns = fpc_now_ns();
+            }
+            // Don't suspend until the capture session ends:
+            fpc_session_rearm(&data->event, &data->wakelock, 0);
             ALOGD("Finger down, capturing image");
+            timing->capture_begin_ns = fpc_now_ns();
+            ATRACE_BEGIN("Capture");
             ret = send_normal_command(ldata, FPC_CAPTURE_IMAGE);
+            ATRACE_END();
+            timing->capture_end_ns = fpc_now_ns();
             ALOGD("Image capture result: %d", ret);
         } else
             ret = 1001;
@@ -393,9 +428,10 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
         // Extend the wakelock to prevent going to sleep before entering
         // a polling state again, which causes the sensor/hal to not
         // respond to any finger touches during deep sleep.
-        fpc_keep_awake(&data->event, 1, 40);
-        // Wait 20ms before checking if the finger is lost again.
-        usleep(20000);
+        fpc_session_keep_awake(&data->event, &data->wakelock, 40);
+        // Wait before checking if the finger is lost again, unless
+        // the current operation is interrupted:
+        fpc_wait_eventfd_until(&data->event, fpc_now_ms() + FINGER_LOST_RECHECK_MS);
     }
 
     return ret;
@@ -616,6 +652,25 @@ err_t fpc_store_user_db(fpc_imp_data_t *data, char* path)
     return ret;
 }
 
+void fpc_dump_buffers(fpc_imp_data_t *data, int fd)
+{
+    qcom_km_ion_pool_dump(&((fpc_data_t *)data)->ion_pool, fd);
+}
+
+err_t fpc_reinit_sensor(fpc_imp_data_t *data)
+{
+    fpc_data_t *ldata = (fpc_data_t*)data;
+    err_t result = fpc_reset_sensor(&data->event);
+    if (result)
+        return result;
+
+    // Like fpc_init(), have the TZ app initialize the sensor. This also
+    // tells whether the TZ app still talks to it:
+    result = send_normal_command(ldata, FPC_INIT);
+    ALOGE_IF(result, "%s: TZ app failed to set up the sensor: %d", __func__, result);
+    return result;
+}
+
 err_t fpc_close(fpc_imp_data_t **data)
 {
     ALOGV(__func__);
@@ -630,6 +685,8 @@ err_t fpc_close(fpc_imp_data_t **data)
     fpc_event_destroy(&ldata->data.event);
     fpc_uinput_destroy(&ldata->data.uinput);
 
+    qcom_km_ion_pool_destroy(&ldata->ion_pool);
+    ldata->qsee_handle->ion_free(&ldata->ihandle);
     qsee_free_handle(&ldata->qsee_handle);
     free(ldata);
     *data = NULL;
@@ -643,6 +700,7 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
     struct QSEECom_handle * mFPC_handle = NULL;
     struct QSEECom_handle * mKeymasterHandle = NULL;
     struct qsee_handle_t* qsee_handle = NULL;
+    fpc_data_t *fpc_data = NULL;
 
     ALOGI("INIT FPC TZ APP\n");
     if(qsee_open_handle(&qsee_handle) != 0) {
@@ -650,25 +708,31 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
         goto err;
     }
 
-    fpc_data_t *fpc_data = (fpc_data_t*)malloc(sizeof(fpc_data_t));
-    fpc_data->auth_id = 0;
+    fpc_data = (fpc_data_t*)calloc(1, sizeof(fpc_data_t));
+    if (fpc_data == NULL)
+        goto err_qsee;
+    fpc_data->qsee_handle = qsee_handle;
+    fpc_data->ihandle.ion_fd = -1;
+    qcom_km_ion_pool_init(&fpc_data->ion_pool, qsee_handle->ion_alloc, qsee_handle->ion_free);
 
-    fpc_event_create(&fpc_data->data.event, event_fd);
+    if (fpc_event_create(&fpc_data->data.event, event_fd) < 0) {
+        ALOGE("Error opening device events\n");
+        goto err_data;
+    }
     fpc_uinput_create(&fpc_data->data.uinput);
 
     if (fpc_set_power(&fpc_data->data.event, FPC_PWRON) < 0) {
         ALOGE("Error starting device\n");
-        goto err_qsee;
+        goto err_event;
     }
 
     ALOGI("Starting app %s\n", KM_TZAPP_NAME);
     if (qsee_handle->load_trustlet(qsee_handle, &mKeymasterHandle, KM_TZAPP_PATH, KM_TZAPP_NAME, 1024) < 0) {
         if (qsee_handle->load_trustlet(qsee_handle, &mKeymasterHandle, KM_TZAPP_PATH, KM_TZAPP_ALT_NAME, 1024) < 0) {
             ALOGE("Could not load app %s or %s\n", KM_TZAPP_NAME, KM_TZAPP_ALT_NAME);
-            goto err_alloc;
+            goto err_power;
         }
     }
-    fpc_data->qsee_handle = qsee_handle;
 
 
     ALOGI("Starting app %s\n", FP_TZAPP_NAME);
@@ -679,15 +743,14 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
 
     fpc_data->fpc_handle = mFPC_handle;
 
-    fpc_data->ihandle.ion_fd = 0;
     if (fpc_data->qsee_handle->ion_alloc(&fpc_data->ihandle, 0x40) < 0) {
         ALOGE("ION allocation failed");
-        goto err_keymaster;
+        goto err_fpc_app;
     }
 
     if ((ret = send_normal_command(fpc_data, FPC_INIT)) != 0) {
         ALOGE("Error sending FPC_INIT to tz: %d\n", ret);
-        return -1;
+        goto err_ion;
     }
 
     // Start creating one off command to get cert from keymaster
@@ -700,7 +763,7 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
 
     //Send command to keymaster
     if (qsee_handle->send_cmd(mKeymasterHandle, send_buf, 64, rec_buf, 1024-64) < 0) {
-        goto err_keymaster;
+        goto err_ion;
     }
 
     keymaster_return_t* ret_data = (keymaster_return_t*) rec_buf;
@@ -720,27 +783,37 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
 
     int result = send_buffer_command(fpc_data, FPC_GROUP_FPCDATA, FPC_SET_KEY_DATA, keydata, keylength);
 
+    free(keydata);
+
     ALOGD("FPC_SET_KEY_DATA Result: %d\n", result);
     if(result != 0)
-        return result;
+        goto err_ion;
 
     if (fpc_set_power(&fpc_data->data.event, FPC_PWROFF) < 0) {
         ALOGE("Error stopping device\n");
-        goto err_alloc;
+        goto err_ion;
     }
 
     *data = (fpc_imp_data_t*)fpc_data;
 
     return 1;
 
+    // Unwind in the reverse order of the setup above:
+err_ion:
+    qsee_handle->ion_free(&fpc_data->ihandle);
+err_fpc_app:
+    qsee_handle->shutdown_app(&fpc_data->fpc_handle);
 err_keymaster:
     if(mKeymasterHandle != NULL)
         qsee_handle->shutdown_app(&mKeymasterHandle);
-err_alloc:
-    if(fpc_data != NULL) {
-        fpc_data->qsee_handle->ion_free(&fpc_data->ihandle);
-        free(fpc_data);
-    }
+err_power:
+    fpc_set_power(&fpc_data->data.event, FPC_PWROFF);
+err_event:
+    fpc_uinput_destroy(&fpc_data->data.uinput);
+    fpc_event_destroy(&fpc_data->data.event);
+err_data:
+    qcom_km_ion_pool_destroy(&fpc_data->ion_pool);
+    free(fpc_data);
 err_qsee:
     qsee_free_handle(&qsee_handle);
 err:
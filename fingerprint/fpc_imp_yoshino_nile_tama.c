@@ -27,25 +27,51 @@
 #endif
 
 #include "common.h"
+#include "tz_trace.h"
 
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <hardware/fingerprint.h>
 
 #define LOG_TAG "FPC IMP"
 //#define LOG_NDEBUG 0
+#define ATRACE_TAG ATRACE_TAG_HAL
 
+#include <cutils/trace.h>
 #include <log/log.h>
+#include <inttypes.h>
 #include <limits.h>
 
+// Time window after finger-down in which FPC_CAPTURE_IMAGE is retried
+// while the sensor asks for more data:
+#define CAPTURE_RETRY_WINDOW_MS 200
+#define CAPTURE_MAX_TRIES 10
+// Minimum time between the end of a capture and the next try, to bound
+// the load on the TZ app while a finger rests on the sensor:
+#define CAPTURE_RETRY_INTERVAL_MS 20
+// Interval at which a finger that is still on the sensor is checked again:
+#define FINGER_LOST_RECHECK_MS 20
+// Interval at which the TZ is polled while it is tracking a finger. It
+// starts at the minimum on every touch and after every gesture, and doubles
+// with every poll that reports none: a finger resting on the sensor is
+// polled at a fraction of the rate of a swiping one.
+#define NAVI_POLL_INTERVAL_MS 4
+#define NAVI_POLL_INTERVAL_MAX_MS 16
+
 typedef struct {
     struct fpc_imp_data_t data;
     struct QSEECom_handle *fpc_handle;
     struct qsee_handle_t* qsee_handle;
     struct qcom_km_ion_info_t ihandle;
+    // Length of the command last prepared in ihandle:
+    uint32_t cmd_len;
+    // Buffer commands that did not fit in ihandle:
+    uint32_t oversized_buffers;
     uint64_t auth_id;
 } fpc_data_t;
 
@@ -85,7 +111,10 @@ static const char *fpc_error_str(int err)
     return error_strings[realerror];
 }
 
-err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t ihandle)
+// cmd_len is the length of the command in ihandle, which the TZ app
+// answers in place:
+err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t ihandle,
+                                  uint32_t cmd_len)
 {
     struct QSEECom_handle *handle = ldata->fpc_handle;
 
@@ -102,7 +131,13 @@ err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t i
     send_cmd->v_addr = (intptr_t) ihandle.ion_sbuffer;
     uint32_t length = (ihandle.sbuf_len + 4095) & (~4095);
     send_cmd->length = length;
+    // Every command starts with its group and command id:
+    const uint32_t *ids = (const uint32_t *)ihandle.ion_sbuffer;
+    const uint32_t group_id = ids[0], cmd_id = ids[1];
+    int64_t trace_begin = tz_trace_begin();
     int result = ldata->qsee_handle->send_modified_cmd(handle,send_cmd,64,rec_cmd,64,&ion_fd_info);
+    tz_trace_end(trace_begin, "fpc", group_id, cmd_id, 64 + 64 + cmd_len,
+                 result ? result : *(int32_t*)rec_cmd);
 
     if(result)
     {
@@ -119,16 +154,77 @@ err_t send_modified_command_to_tz(fpc_data_t *ldata, struct qcom_km_ion_info_t i
     return result;
 }
 
-err_t send_normal_command(fpc_data_t *ldata, int group, int command)
+/*
+ * Commands are constructed, and their responses read, in place in the
+ * persistent ION buffer that is already shared with the TZ app, rather than
+ * in a stack copy that is copied in and out of a separate buffer. Every
+ * command starts with its group and command id.
+ *
+ * The returned command is valid until the next command is prepared.
+ */
+typedef struct {
+    uint32_t group_id;
+    uint32_t cmd_id;
+} fpc_cmd_header_t;
+
+static void *fpc_cmd_prepare(fpc_data_t *ldata, uint32_t group_id, uint32_t cmd_id, uint32_t len)
 {
-    fpc_send_std_cmd_t* send_cmd =
-        (fpc_send_std_cmd_t*) ldata->ihandle.ion_sbuffer;
+    fpc_cmd_header_t *header = (fpc_cmd_header_t *)ldata->ihandle.ion_sbuffer;
+
+    LOG_ALWAYS_FATAL_IF(len > ldata->ihandle.sbuf_len, "Command %u:%u of %u bytes does not fit",
+                        group_id, cmd_id, len);
+    memset(header, 0, len);
+    header->group_id = group_id;
+    header->cmd_id = cmd_id;
+    ldata->cmd_len = len;
+    return header;
+}
 
-    send_cmd->group_id = group;
-    send_cmd->cmd_id = command;
-    send_cmd->ret_val = 0x0;
+#define FPC_CMD_PREPARE(ldata, type, group_id, cmd_id) \
+    ((type *)fpc_cmd_prepare((ldata), (group_id), (cmd_id), sizeof(type)))
 
-    int ret = send_modified_command_to_tz(ldata, ldata->ihandle);
+static err_t fpc_cmd_send(fpc_data_t *ldata)
+{
+    return send_modified_command_to_tz(ldata, ldata->ihandle, ldata->cmd_len);
+}
+
+/*
+ * Buffer commands carry a variable amount of data. Only database transfers
+ * don't fit in the persistent buffer; these are rare enough to get an ION
+ * buffer of their own.
+ */
+static struct qcom_km_ion_info_t *fpc_cmd_buffer_get(fpc_data_t *ldata, uint32_t length)
+{
+    struct qcom_km_ion_info_t *ihandle = &ldata->ihandle;
+    const uint32_t len = length + sizeof(fpc_send_buffer_t);
+
+    if (len > ldata->ihandle.sbuf_len) {
+        ihandle = malloc(sizeof(*ihandle));
+        if (!ihandle || ldata->qsee_handle->ion_alloc(ihandle, len) < 0) {
+            ALOGE("ION allocation  failed");
+            free(ihandle);
+            return NULL;
+        }
+        ++ldata->oversized_buffers;
+    }
+
+    memset(ihandle->ion_sbuffer, 0, len);
+    return ihandle;
+}
+
+static void fpc_cmd_buffer_put(fpc_data_t *ldata, struct qcom_km_ion_info_t *ihandle)
+{
+    if (ihandle != &ldata->ihandle) {
+        ldata->qsee_handle->ion_free(ihandle);
+        free(ihandle);
+    }
+}
+
+err_t send_normal_command(fpc_data_t *ldata, int group, int command)
+{
+    fpc_send_std_cmd_t *send_cmd = FPC_CMD_PREPARE(ldata, fpc_send_std_cmd_t, group, command);
+
+    int ret = fpc_cmd_send(ldata);
 
     if(!ret) {
         ret = send_cmd->ret_val;
@@ -139,127 +235,94 @@ err_t send_normal_command(fpc_data_t *ldata, int group, int command)
 
 err_t send_buffer_command(fpc_data_t *ldata, uint32_t group_id, uint32_t cmd_id, const uint8_t *buffer, uint32_t length)
 {
-    struct qcom_km_ion_info_t ihandle;
+    struct qcom_km_ion_info_t *ihandle;
 
     if (!ldata || !ldata->qsee_handle) {
         ALOGE("%s: ldata(=%p) or qsee_handle NULL", __func__, ldata);
         return -EINVAL;
     }
 
-    if (ldata->qsee_handle->ion_alloc(&ihandle, length + sizeof(fpc_send_buffer_t)) <0) {
-        ALOGE("ION allocation  failed");
+    if (!(ihandle = fpc_cmd_buffer_get(ldata, length)))
         return -1;
-    }
 
-    fpc_send_buffer_t *cmd_data = (fpc_send_buffer_t*)ihandle.ion_sbuffer;
-    memset(ihandle.ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
+    fpc_send_buffer_t *cmd_data = (fpc_send_buffer_t*)ihandle->ion_sbuffer;
     cmd_data->group_id = group_id;
     cmd_data->cmd_id = cmd_id;
     cmd_data->length = length;
     memcpy(&cmd_data->data, buffer, length);
 
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
+    if(send_modified_command_to_tz(ldata, *ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("Error sending data to tz\n");
-        ldata->qsee_handle->ion_free(&ihandle);
+        fpc_cmd_buffer_put(ldata, ihandle);
         return -1;
     }
 
     int result = cmd_data->status;
-    ldata->qsee_handle->ion_free(&ihandle);
+    fpc_cmd_buffer_put(ldata, ihandle);
     return result;
 }
 
 
 err_t send_command_result_buffer(fpc_data_t *ldata, uint32_t group_id, uint32_t cmd_id, uint8_t *buffer, uint32_t length)
 {
-    struct qcom_km_ion_info_t ihandle;
-    if (ldata->qsee_handle->ion_alloc(&ihandle, length + sizeof(fpc_send_buffer_t)) <0) {
-        ALOGE("ION allocation  failed");
+    struct qcom_km_ion_info_t *ihandle;
+
+    if (!(ihandle = fpc_cmd_buffer_get(ldata, length)))
         return -1;
-    }
-    fpc_send_buffer_t *keydata_cmd = (fpc_send_buffer_t*)ihandle.ion_sbuffer;
-    memset(ihandle.ion_sbuffer, 0, length + sizeof(fpc_send_buffer_t));
+
+    fpc_send_buffer_t *keydata_cmd = (fpc_send_buffer_t*)ihandle->ion_sbuffer;
     keydata_cmd->group_id = group_id;
     keydata_cmd->cmd_id = cmd_id;
     keydata_cmd->length = length;
 
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
+    if(send_modified_command_to_tz(ldata, *ihandle, length + sizeof(fpc_send_buffer_t)) < 0) {
         ALOGE("Error sending data to tz\n");
-        ldata->qsee_handle->ion_free(&ihandle);
+        fpc_cmd_buffer_put(ldata, ihandle);
         return -1;
     }
     memcpy(buffer, &keydata_cmd->data[0], length);
 
     int result = keydata_cmd->status;
-    ldata->qsee_handle->ion_free(&ihandle);
+    fpc_cmd_buffer_put(ldata, ihandle);
     return result;
 }
 
-err_t send_custom_cmd(fpc_data_t *ldata, void *buffer, uint32_t len)
-{
-    ALOGV(__func__);
-    struct qcom_km_ion_info_t ihandle;
-
-    if (ldata->qsee_handle->ion_alloc(&ihandle, len) <0) {
-        ALOGE("ION allocation  failed");
-        return -1;
-    }
-
-    memcpy(ihandle.ion_sbuffer, buffer, len);
-
-    if(send_modified_command_to_tz(ldata, ihandle) < 0) {
-        ALOGE("Error sending data to tz\n");
-        ldata->qsee_handle->ion_free(&ihandle);
-        return -1;
-    }
-
-    // Copy back result
-    memcpy(buffer, ihandle.ion_sbuffer, len);
-    ldata->qsee_handle->ion_free(&ihandle);
-
-    return 0;
-};
-
 
 err_t fpc_set_auth_challenge(fpc_imp_data_t *data, int64_t challenge)
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
 
-    fpc_send_auth_cmd_t auth_cmd = {
-        .group_id = FPC_GROUP_FPCDATA,
-        .cmd_id = FPC_SET_AUTH_CHALLENGE,
-        .challenge = challenge,
-    };
+    fpc_send_auth_cmd_t *auth_cmd =
+        FPC_CMD_PREPARE(ldata, fpc_send_auth_cmd_t, FPC_GROUP_FPCDATA, FPC_SET_AUTH_CHALLENGE);
+    auth_cmd->challenge = challenge;
 
-    if(send_custom_cmd(ldata, &auth_cmd, sizeof(auth_cmd)) < 0) {
+    if(fpc_cmd_send(ldata) < 0) {
         ALOGE("Error sending data to tz\n");
         return -1;
     }
 
-    ALOGD("Status :%d\n", auth_cmd.status);
-    return auth_cmd.status;
+    ALOGD("Status :%d\n", auth_cmd->status);
+    return auth_cmd->status;
 }
 
 int64_t fpc_load_auth_challenge(fpc_imp_data_t *data)
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_load_auth_challenge_t cmd = {
-        .group_id = FPC_GROUP_FPCDATA,
-        .cmd_id = FPC_GET_AUTH_CHALLENGE,
-    };
+    fpc_load_auth_challenge_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_load_auth_challenge_t, FPC_GROUP_FPCDATA, FPC_GET_AUTH_CHALLENGE);
 
-    if(send_custom_cmd(ldata, &cmd, sizeof(cmd)) < 0) {
+    if(fpc_cmd_send(ldata) < 0) {
         ALOGE("Error sending data to tz\n");
         return -1;
     }
 
-    if(cmd.status != 0) {
-        ALOGE("Bad status getting auth challenge: %d\n", cmd.status);
+    if(cmd->status != 0) {
+        ALOGE("Bad status getting auth challenge: %d\n", cmd->status);
         return -2;
     }
-    return cmd.challenge;
+    return cmd->challenge;
 }
 
 int64_t fpc_load_db_id(fpc_imp_data_t *data)
@@ -271,31 +334,27 @@ int64_t fpc_load_db_id(fpc_imp_data_t *data)
     if(ldata->auth_id > 0) {
         return ldata->auth_id;
     }
-    fpc_get_db_id_cmd_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_GET_TEMPLATE_ID,
-    };
+    fpc_get_db_id_cmd_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_get_db_id_cmd_t, FPC_GROUP_TEMPLATE, FPC_GET_TEMPLATE_ID);
 
-    if(send_custom_cmd(ldata, &cmd, sizeof(cmd)) < 0) {
+    if(fpc_cmd_send(ldata) < 0) {
         ALOGE("Error sending data to TZ\n");
         return -1;
     }
     // cache the auth_id value received from TZ
-    ldata->auth_id = cmd.auth_id;
-    return cmd.auth_id;
+    ldata->auth_id = cmd->auth_id;
+    return cmd->auth_id;
 }
 
 err_t fpc_get_hw_auth_obj(fpc_imp_data_t *data, void * buffer, uint32_t length)
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_get_auth_result_t cmd = {
-        .group_id = FPC_GROUP_FPCDATA,
-        .cmd_id = FPC_GET_AUTH_RESULT,
-        .length = AUTH_RESULT_LENGTH,
-    };
+    fpc_get_auth_result_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_get_auth_result_t, FPC_GROUP_FPCDATA, FPC_GET_AUTH_RESULT);
+    cmd->length = AUTH_RESULT_LENGTH;
 
-    if(send_custom_cmd(ldata, &cmd, sizeof(cmd)) < 0) {
+    if(fpc_cmd_send(ldata) < 0) {
         ALOGE("Error sending data to tz\n");
         return -1;
     }
@@ -303,13 +362,13 @@ err_t fpc_get_hw_auth_obj(fpc_imp_data_t *data, void * buffer, uint32_t length)
     {
         ALOGE("Weird inconsistency between auth length!???\n");
     }
-    if(cmd.result != 0)
+    if(cmd->result != 0)
     {
-        ALOGE("Get hw_auth_obj failed: %d\n", cmd.result);
-        return cmd.result;
+        ALOGE("Get hw_auth_obj failed: %d\n", cmd->result);
+        return cmd->result;
     }
 
-    memcpy(buffer, cmd.auth_result, length);
+    memcpy(buffer, cmd->auth_result, length);
 
   return 0;
 }
@@ -329,13 +388,11 @@ err_t fpc_del_print_id(fpc_imp_data_t *data, uint32_t id)
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
 
-    fpc_fingerprint_delete_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_DELETE_FINGERPRINT,
-        .fingerprint_id = id,
-    };
+    fpc_fingerprint_delete_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_fingerprint_delete_t, FPC_GROUP_TEMPLATE, FPC_DELETE_FINGERPRINT);
+    cmd->fingerprint_id = id;
 
-    int ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    int ret = fpc_cmd_send(ldata);
     if(ret < 0)
     {
         ALOGE("Error sending command: %d\n", ret);
@@ -343,7 +400,7 @@ err_t fpc_del_print_id(fpc_imp_data_t *data, uint32_t id)
     }
     // remove the cached auth_id value upon deleting a fingerprint
     ldata->auth_id = 0;
-    return cmd.status;
+    return cmd->status;
 }
 
 /**
@@ -379,32 +436,56 @@ err_t fpc_wait_finger_lost(fpc_imp_data_t *data)
 /**
  * Returns a positive value on success (finger is down)
  * Returns 0 when an event occurs (and the operation has to be stopped)
+ * Returns -ETIMEDOUT when no finger was detected before \p deadline_ms
  * Returns a negative value on error
  */
-err_t fpc_wait_finger_down(fpc_imp_data_t *data)
+static err_t fpc_wait_finger_down_until(fpc_imp_data_t *data, int64_t deadline_ms)
 {
     ALOGV(__func__);
     int result = -1;
     fpc_data_t *ldata = (fpc_data_t*)data;
 
+    // Don't arm detection for a new session while backing off from
+    // spurious captures. Retries within a session are not delayed:
+    int64_t backoff_ns = irq_filter_backoff_deadline_ns(&data->event.irq);
+    if (deadline_ms < 0 && backoff_ns >= 0) {
+        ALOGD("Backing off finger detection for %" PRId64 " ms",
+              (backoff_ns - fpc_now_ns()) / 1000000);
+        result = fpc_wait_eventfd_until(&data->event, (backoff_ns + 999999) / 1000000);
+        if(result == FPC_EVENT_ERROR)
+            return -1;
+        if(result == FPC_EVENT_EVENTFD)
+            return 0;
+    }
+
     result = send_normal_command(ldata, FPC_GROUP_SENSOR, FPC_WAIT_FINGER_DOWN);
     ALOGE_IF(result, "Wait finger down result: %d", result);
     if(result)
         return result;
 
-    result = fpc_poll_event(&data->event);
+    result = fpc_poll_event_until(&data->event, deadline_ms);
 
     if(result == FPC_EVENT_ERROR)
         return -1;
+    if(result == FPC_EVENT_TIMEOUT)
+        return -ETIMEDOUT;
     return result == FPC_EVENT_FINGER;
 }
 
+err_t fpc_wait_finger_down(fpc_imp_data_t *data)
+{
+    return fpc_wait_finger_down_until(data, -1);
+}
+
 // Attempt to capture image
 err_t fpc_capture_image(fpc_imp_data_t *data)
 {
     ALOGV(__func__);
 
     fpc_data_t *ldata = (fpc_data_t*)data;
+    fpc_capture_timing_t *timing = &data->capture_timing;
+
+    memset(timing, 0, sizeof(*timing));
 
     int ret = fpc_wait_finger_lost(data);
     ALOGV("fpc_wait_finger_lost = 0x%08X", ret);
@@ -414,12 +495,20 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
     {
         ALOGV("Finger lost as expected");
         int tries = 0;
+        int64_t finger_down_ms = -1, retry_deadline_ms = -1;
         ret = fpc_sensor_wake(data);
         if (ret)
             return ret;
         for (;;) {
-            ret = fpc_wait_finger_down(data);
+            // The first finger-down has no deadline. Retries wait for the
+            // sensor to signal new data, but not beyond the retry window.
+            ret = fpc_wait_finger_down_until(data, retry_deadline_ms);
             ALOGV("fpc_wait_finger_down = 0x%08X", ret);
+            if(ret == -ETIMEDOUT) {
+                ALOGD("No new sensor data within %d ms", CAPTURE_RETRY_WINDOW_MS);
+                ret = FINGERPRINT_ACQUIRED_INSUFFICIENT;
+                break;
+            }
             if(ret < 0)
                 return ret;
             if(!ret)
@@ -428,25 +517,56 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
                 break;
             }
 
+            if (finger_down_ms < 0) {
+                timing->finger_down_ns = fpc_now_ns();
+                finger_down_ms = timing->finger_down_ns / 1000000;
+                retry_deadline_ms = finger_down_ms + CAPTURE_RETRY_WINDOW_MS;
+                if (data->wake_on_finger) {
+                    // Let the display power up while the image is captured and matched:
+                    fpc_uinput_click(&data->uinput, KEY_WAKEUP);
+                    timing->wake_key_ns = fpc_now_ns();
+                }
+                // Don't suspend until the capture session ends:
+                fpc_session_rearm(&data->event, &data->wakelock, CAPTURE_RETRY_WINDOW_MS);
+            }
+
 #ifdef USE_FPC_TAMA
             // TEMPORARY: Capture image sometimes seems to block way too long.
-            fpc_keep_awake(&data->event, 1, 400);
+            fpc_session_keep_awake(&data->event, &data->wakelock, 400);
 #endif
             ALOGD("Finger down, capturing image");
+            if (!timing->capture_begin_ns)
+                timing->capture_begin_ns = fpc_now_ns();
+            ATRACE_BEGIN("Capture");
             ret = send_normal_command(ldata, FPC_GROUP_SENSOR,
                 FPC_CAPTURE_IMAGE);
-            ALOGD("Image capture result: %d", ret);
+            ATRACE_END();
+            timing->capture_end_ns = fpc_now_ns();
+            ALOGD("Image capture result: %d after %" PRId64 " ms, %d retries",
+                  ret, fpc_now_ms() - finger_down_ms, tries);
 
             if(ret != 3)
                 break;
 
-            // Impose some artificial wait time before checking again:
-            fpc_keep_awake(&data->event, 1, 40);
-            usleep(20000);
+            // Keep the device awake until the sensor signals again:
+            fpc_session_keep_awake(&data->event, &data->wakelock, 40);
+
+            if(++tries < CAPTURE_MAX_TRIES && fpc_now_ms() < retry_deadline_ms) {
+                // Give the sensor time to collect more data, unless the
+                // current operation is interrupted:
+                int rc = fpc_wait_eventfd_until(&data->event,
+                                                fpc_now_ms() + CAPTURE_RETRY_INTERVAL_MS);
+                if(rc == FPC_EVENT_ERROR)
+                    return -1;
+                if(rc == FPC_EVENT_EVENTFD) {
+                    ret = 1001;
+                    break;
+                }
+            }
 
-            if(++tries > 9) {
-                // If the result stays at 3 after 10 tries, not enough
-                // data has been collected.
+            if(tries >= CAPTURE_MAX_TRIES || fpc_now_ms() >= retry_deadline_ms) {
+                // If the result stays at 3 for the entire retry window, not
+                // enough data has been collected.
                 // This prevents looping indefinitely (say when accidentally
                 // touching the sensor), and instead waits for the object to
                 // disappear again before continuing.
@@ -456,6 +576,11 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
                 break;
             }
         };
+
+        // Let the IRQ filter know whether the finger IRQ was real:
+        if (finger_down_ms >= 0 && ret >= FINGERPRINT_ACQUIRED_GOOD &&
+            ret <= FINGERPRINT_ACQUIRED_TOO_FAST)
+            irq_filter_report(&data->event.irq, ret != FINGERPRINT_ACQUIRED_INSUFFICIENT);
 #ifdef USE_FPC_TAMA
         int rc = fpc_deep_sleep(data);
         ALOGE_IF(rc, "Sensor deep sleep failed: %d", rc);
@@ -467,9 +592,10 @@ err_t fpc_capture_image(fpc_imp_data_t *data)
         // Extend the wakelock to prevent going to sleep before entering
         // a polling state again, which causes the sensor/hal to not
         // respond to any finger touches during deep sleep.
-        fpc_keep_awake(&data->event, 1, 40);
-        // Wait 20ms before checking if the finger is lost again.
-        usleep(20000);
+        fpc_session_keep_awake(&data->event, &data->wakelock, 40);
+        // Wait before checking if the finger is lost again, unless
+        // the current operation is interrupted:
+        fpc_wait_eventfd_until(&data->event, fpc_now_ms() + FINGER_LOST_RECHECK_MS);
     }
 
     return ret;
@@ -491,16 +617,14 @@ err_t fpc_navi_enter(fpc_imp_data_t *data)
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t *)data;
 
-    fpc_navi_cmd_t cmd = {
-        .group_id = FPC_GROUP_NAVIGATION,
-        .cmd_id = FPC_NAVIGATION_ENTER,
-    };
+    fpc_navi_cmd_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_navi_cmd_t, FPC_GROUP_NAVIGATION, FPC_NAVIGATION_ENTER);
 
-    int ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    int ret = fpc_cmd_send(ldata);
 
-    ALOGE_IF(ret || cmd.ret_val, "Failed to send NAVIGATION_ENTER rc=%d s=%d", ret, cmd.ret_val);
+    ALOGE_IF(ret || cmd->ret_val, "Failed to send NAVIGATION_ENTER rc=%d s=%d", ret, cmd->ret_val);
 
-    return ret || cmd.ret_val;
+    return ret || cmd->ret_val;
 }
 
 err_t fpc_navi_exit(fpc_imp_data_t *data)
@@ -508,16 +632,54 @@ err_t fpc_navi_exit(fpc_imp_data_t *data)
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t *)data;
 
-    fpc_navi_cmd_t cmd = {
-        .group_id = FPC_GROUP_NAVIGATION,
-        .cmd_id = FPC_NAVIGATION_EXIT,
-    };
+    fpc_navi_cmd_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_navi_cmd_t, FPC_GROUP_NAVIGATION, FPC_NAVIGATION_EXIT);
 
-    int ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    int ret = fpc_cmd_send(ldata);
 
-    ALOGE_IF(ret || cmd.ret_val, "Failed to send NAVIGATION_EXIT rc=%d s=%d", ret, cmd.ret_val);
+    ALOGE_IF(ret || cmd->ret_val, "Failed to send NAVIGATION_EXIT rc=%d s=%d", ret, cmd->ret_val);
 
-    return ret || cmd.ret_val;
+    return ret || cmd->ret_val;
+}
+
+static unsigned short navi_gesture_key(uint32_t gesture)
+{
+    switch (gesture) {
+        case FPC_GESTURE_UP:
+            ALOGI("Gesture: Up");
+            return KEY_UP;
+        case FPC_GESTURE_DOWN:
+            ALOGI("Gesture: Down");
+            return KEY_DOWN;
+        case FPC_GESTURE_LEFT:
+            ALOGI("Gesture: Left");
+            return KEY_LEFT;
+        case FPC_GESTURE_RIGHT:
+            ALOGI("Gesture: Right");
+            return KEY_RIGHT;
+
+            // Not handled:
+        case FPC_GESTURE_GONE:
+            // Single tap but could also be an unknown-gesture error,
+            // as it happens when sliding too fast and not holding it
+            // near the end.
+            ALOGI("Gesture: Finger gone");
+            break;
+        case FPC_GESTURE_HOLD:
+            ALOGI("Gesture: Hold");
+            break;
+        case FPC_GESTURE_DOUBLE_TAP:
+            ALOGI("Gesture: Double tap");
+            break;
+    }
+    return 0;
+}
+
+static int64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 err_t fpc_navi_poll(fpc_imp_data_t *data)
@@ -526,74 +688,89 @@ err_t fpc_navi_poll(fpc_imp_data_t *data)
     fpc_data_t *ldata = (fpc_data_t *)data;
     int ret = 0;
 
-    fpc_navi_cmd_t cmd = {
-        .group_id = FPC_GROUP_NAVIGATION,
-        .cmd_id = FPC_NAVIGATION_POLL,
-    };
-
-    // Bail out early when an event is available, instead of
-    // waiting for FPC_EVENT_EVENTFD from fpc_poll_event:
-    while (!is_event_available(&data->event)) {
-        ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    unsigned short keys[UINPUT_MAX_BATCH];
+    size_t num_keys = 0;
+
+    // Statistics of this navigation session, to judge the cost of polling:
+    const int64_t cpu_start = thread_cpu_ns();
+    int64_t contact_ms = 0;
+    unsigned polls = 0, wakeups = 0, gestures = 0;
+
+    int64_t last_poll = 0;
+    int interval_ms = NAVI_POLL_INTERVAL_MS;
+
+    // Bail out early when a state request is available, instead of
+    // waiting for FPC_EVENT_EVENTFD from fpc_poll_event. Other events
+    // (work posted to the worker) are handled inline, without leaving
+    // navigation:
+    while (!fpc_event_requested(&data->event)) {
+        fpc_navi_cmd_t *cmd =
+            FPC_CMD_PREPARE(ldata, fpc_navi_cmd_t, FPC_GROUP_NAVIGATION, FPC_NAVIGATION_POLL);
+        ret = fpc_cmd_send(ldata);
+        ++polls;
+
+        ALOGE_IF(ret || cmd->ret_val, "Failed to send NAVIGATION_POLL rc=%d s=%d", ret, cmd->ret_val);
+        if (ret || cmd->ret_val) {
+            ret = ret || cmd->ret_val;
+            break;
+        }
 
-        ALOGE_IF(ret || cmd.ret_val, "Failed to send NAVIGATION_POLL rc=%d s=%d", ret, cmd.ret_val);
-        if (ret || cmd.ret_val)
-            return ret || cmd.ret_val;
+        ALOGV("Gesture: %d, down: %d, poll: %d, mask: %x", cmd->gesture, cmd->finger_on, cmd->should_poll, cmd->mask);
 
-        ALOGV("Gesture: %d, down: %d, poll: %d, mask: %x", cmd.gesture, cmd.finger_on, cmd.should_poll, cmd.mask);
+        const int64_t now = fpc_now_ms();
+        if (cmd->finger_on && last_poll)
+            contact_ms += now - last_poll;
+        last_poll = now;
 
-        if (cmd.gesture) {
-            switch (cmd.gesture) {
-                case FPC_GESTURE_UP:
-                    ALOGI("Gesture: Up");
-                    fpc_uinput_click(&data->uinput, KEY_UP);
-                    break;
-                case FPC_GESTURE_DOWN:
-                    ALOGI("Gesture: Down");
-                    fpc_uinput_click(&data->uinput, KEY_DOWN);
-                    break;
-                case FPC_GESTURE_LEFT:
-                    ALOGI("Gesture: Left");
-                    fpc_uinput_click(&data->uinput, KEY_LEFT);
-                    break;
-                case FPC_GESTURE_RIGHT:
-                    ALOGI("Gesture: Right");
-                    fpc_uinput_click(&data->uinput, KEY_RIGHT);
-                    break;
+        if (cmd->gesture) {
+            ++gestures;
+            interval_ms = NAVI_POLL_INTERVAL_MS;
+            unsigned short key = navi_gesture_key(cmd->gesture);
+            if (key && num_keys < UINPUT_MAX_BATCH)
+                keys[num_keys++] = key;
+        }
 
-                    // Not handled:
-                case FPC_GESTURE_GONE:
-                    // Single tap but could also be an unknown-gesture error,
-                    // as it happens when sliding too fast and not holding it
-                    // near the end.
-                    ALOGI("Gesture: Finger gone");
-                    break;
-                case FPC_GESTURE_HOLD:
-                    ALOGI("Gesture: Hold");
-                    break;
-                case FPC_GESTURE_DOUBLE_TAP:
-                    ALOGI("Gesture: Double tap");
-                    break;
-            }
+        // Deliver the gestures collected so far before blocking:
+        if (num_keys) {
+            fpc_uinput_click_batch(&data->uinput, keys, num_keys);
+            num_keys = 0;
         }
 
-        if (!cmd.should_poll) {
-            // Decrease spam on TZ. Sleeping for such a short time
-            // (contrary to multiple milliseconds) makes the gestures
-            // much more responsive and accurate.
-            usleep(10);
+        if (!cmd->should_poll) {
+            // The TZ is tracking a finger and wants to be polled again.
+            // Only wake up early to handle an incoming event:
+            ++wakeups;
+            if (fpc_wait_eventfd_until(&data->event, now + interval_ms) == FPC_EVENT_ERROR) {
+                ret = 0;
+                break;
+            }
+            if (!cmd->gesture && interval_ms < NAVI_POLL_INTERVAL_MAX_MS)
+                interval_ms *= 2;
         } else {
-            ALOGW_IF(cmd.should_poll == 2, "%s: Need to do something special on should_poll == 2!", __func__);
+            ALOGW_IF(cmd->should_poll == 2, "%s: Need to do something special on should_poll == 2!", __func__);
             ret = fpc_poll_event(&data->event);
+            ++wakeups;
+            // The time without a finger is not part of the contact time:
+            last_poll = 0;
+            interval_ms = NAVI_POLL_INTERVAL_MS;
 
-            if (ret == FPC_EVENT_ERROR)
-                return -1;
-            if (ret != FPC_EVENT_FINGER)
-                // No error, but an event needs to be handled:
-                return 0;
+            if (ret == FPC_EVENT_ERROR) {
+                ret = -1;
+                break;
+            }
+            // No error, an eventfd event is handled at the top of the loop:
+            ret = 0;
         }
     }
 
+    if (contact_ms) {
+        const int64_t cpu_ns = thread_cpu_ns() - cpu_start;
+        // ns per ms of contact equals us per second of contact:
+        ALOGD("%s: %" PRId64 "ms finger contact: %u TZ calls, %u wakeups, %u gestures, "
+              "%" PRId64 "us CPU (%" PRId64 "us per second of contact)",
+              __func__, contact_ms, polls, wakeups, gestures, cpu_ns / 1000, cpu_ns / contact_ms);
+    }
+
     return ret;
 }
 
@@ -601,24 +778,22 @@ err_t fpc_enroll_step(fpc_imp_data_t *data, uint32_t *remaining_touches)
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_enrol_step_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_ENROL_STEP,
-    };
+    fpc_enrol_step_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_enrol_step_t, FPC_GROUP_TEMPLATE, FPC_ENROL_STEP);
 
-    int ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    int ret = fpc_cmd_send(ldata);
     if(ret <0)
     {
         ALOGE("Error sending command: %d\n", ret);
         return -1;
     }
-    if(cmd.status < 0)
+    if(cmd->status < 0)
     {
-        ALOGE("Error processing enroll step: %d\n", cmd.status);
+        ALOGE("Error processing enroll step: %d\n", cmd->status);
         return -1;
     }
-    *remaining_touches = cmd.remaining_touches;
-    return cmd.status;
+    *remaining_touches = cmd->remaining_touches;
+    return cmd->status;
 }
 
 err_t fpc_enroll_start(fpc_imp_data_t * data, int __unused print_index)
@@ -637,21 +812,19 @@ err_t fpc_enroll_end(fpc_imp_data_t *data, uint32_t *print_id)
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_end_enrol_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_END_ENROL,
-    };
+    fpc_end_enrol_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_end_enrol_t, FPC_GROUP_TEMPLATE, FPC_END_ENROL);
 
-    if(send_custom_cmd(ldata, &cmd, sizeof(cmd)) < 0) {
+    if(fpc_cmd_send(ldata) < 0) {
         ALOGE("Error sending enrol command\n");
         return -1;
     }
-    if(cmd.status != 0) {
-        ALOGE("Error processing end enrol: %d\n", cmd.status);
+    if(cmd->status != 0) {
+        ALOGE("Error processing end enrol: %d\n", cmd->status);
         return -2;
     }
 
-    *print_id = cmd.print_id;
+    *print_id = cmd->print_id;
     // remove the cached auth_id value upon enrolling a fingerprint
     ldata->auth_id = 0;
     return 0;
@@ -666,24 +839,22 @@ err_t fpc_auth_start(fpc_imp_data_t __unused  *data)
 err_t fpc_auth_step(fpc_imp_data_t *data, uint32_t *print_id)
 {
     fpc_data_t *ldata = (fpc_data_t *)data;
-    fpc_send_identify_t identify_cmd = {
-        .commandgroup = FPC_GROUP_TEMPLATE,
-        .command = FPC_IDENTIFY,
-    };
+    fpc_send_identify_t *identify_cmd =
+        FPC_CMD_PREPARE(ldata, fpc_send_identify_t, FPC_GROUP_TEMPLATE, FPC_IDENTIFY);
 
-    int result = send_custom_cmd(ldata, &identify_cmd, sizeof(identify_cmd));
+    int result = fpc_cmd_send(ldata);
     if (result) {
         ALOGE("Failed identifying, result=%d", result);
         return result;
-    } else if (identify_cmd.status < 0) {
-        ALOGE("Failed identifying, status=%d", identify_cmd.status);
-        return identify_cmd.status;
+    } else if (identify_cmd->status < 0) {
+        ALOGE("Failed identifying, status=%d", identify_cmd->status);
+        return identify_cmd->status;
     }
 
-    ALOGD("Print identified as %u\n", identify_cmd.id);
+    ALOGD("Print identified as %u\n", identify_cmd->id);
 
-    *print_id = identify_cmd.id;
-    return identify_cmd.status;
+    *print_id = identify_cmd->id;
+    return identify_cmd->status;
 }
 
 err_t fpc_auth_end(fpc_imp_data_t __unused *data)
@@ -697,26 +868,24 @@ err_t fpc_get_print_index(fpc_imp_data_t *data, fpc_fingerprint_index_t *idx_dat
 {
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_fingerprint_list_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_GET_FINGERPRINTS,
-        .length = MAX_FINGERPRINTS,
-    };
+    fpc_fingerprint_list_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_fingerprint_list_t, FPC_GROUP_TEMPLATE, FPC_GET_FINGERPRINTS);
+    cmd->length = MAX_FINGERPRINTS;
     unsigned int i;
 
-    int ret = send_custom_cmd(ldata, &cmd, sizeof(cmd));
-    if(ret < 0 || cmd.status != 0) {
-        ALOGE("Failed to retrieve fingerprints: rc = %d, status = %d", ret, cmd.status);
+    int ret = fpc_cmd_send(ldata);
+    if(ret < 0 || cmd->status != 0) {
+        ALOGE("Failed to retrieve fingerprints: rc = %d, status = %d", ret, cmd->status);
         return -EINVAL;
-    } else if (cmd.length > MAX_FINGERPRINTS) {
+    } else if (cmd->length > MAX_FINGERPRINTS) {
         ALOGE("FPC_GET_FINGERPRINTS Returned more than MAX_FINGERPRINTS: %u", idx_data->print_count);
         return -EINVAL;
     }
 
-    ALOGI("Found %d fingerprints", cmd.length);
-    idx_data->print_count = cmd.length;
-    for(i = 0; i < cmd.length; i++)
-        idx_data->prints[i] = cmd.fingerprints[i];
+    ALOGI("Found %d fingerprints", cmd->length);
+    idx_data->print_count = cmd->length;
+    for(i = 0; i < cmd->length; i++)
+        idx_data->prints[i] = cmd->fingerprints[i];
 
     return 0;
 }
@@ -749,16 +918,13 @@ err_t fpc_set_gid(fpc_imp_data_t *data, uint32_t gid)
 {
     int result;
     fpc_data_t *ldata = (fpc_data_t*)data;
-    fpc_set_gid_t cmd = {
-        .group_id = FPC_GROUP_TEMPLATE,
-        .cmd_id = FPC_SET_GID,
-        .gid = gid,
-    };
+    fpc_set_gid_t *cmd = FPC_CMD_PREPARE(ldata, fpc_set_gid_t, FPC_GROUP_TEMPLATE, FPC_SET_GID);
+    cmd->gid = gid;
 
     ALOGD("Setting GID to %d\n", gid);
-    result = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    result = fpc_cmd_send(ldata);
     if(!result)
-        result = cmd.status;
+        result = cmd->status;
 
     return result;
 }
@@ -788,24 +954,22 @@ err_t fpc_update_template(fpc_imp_data_t *data)
     ALOGV(__func__);
     fpc_data_t *ldata = (fpc_data_t *)data;
 
-    fpc_update_template_t cmd = {
-        .cmd_id = FPC_UPDATE_TEMPLATE,
-        .group_id = FPC_GROUP_TEMPLATE,
-    };
+    fpc_update_template_t *cmd =
+        FPC_CMD_PREPARE(ldata, fpc_update_template_t, FPC_GROUP_TEMPLATE, FPC_UPDATE_TEMPLATE);
 
-    int result = send_custom_cmd(ldata, &cmd, sizeof(cmd));
+    int result = fpc_cmd_send(ldata);
 
     if (result)
         return result;
 
-    if (cmd.status) {
-        ALOGE("%s failed, status=%d", __func__, cmd.status);
-        return cmd.status;
+    if (cmd->status) {
+        ALOGE("%s failed, status=%d", __func__, cmd->status);
+        return cmd->status;
     }
 
-    ALOGD("%s: Template changed: %d\n", __func__, cmd.has_changed);
+    ALOGD("%s: Template changed: %d\n", __func__, cmd->has_changed);
 
-    return cmd.has_changed;
+    return cmd->has_changed;
 }
 
 err_t fpc_deep_sleep(fpc_imp_data_t *data)
@@ -838,6 +1002,27 @@ err_t fpc_sensor_wake(fpc_imp_data_t *data)
     return 0;
 }
 
+void fpc_dump_buffers(fpc_imp_data_t *data, int fd)
+{
+    const fpc_data_t *ldata = (const fpc_data_t *)data;
+
+    dprintf(fd, "TZ command buffer: %u bytes, %u larger commands allocated their own\n",
+            ldata->ihandle.sbuf_len, ldata->oversized_buffers);
+}
+
+err_t fpc_reinit_sensor(fpc_imp_data_t *data)
+{
+    err_t result = fpc_reset_sensor(&data->event);
+    if (result)
+        return result;
+
+    // Like fpc_init(), leave the sensor to the TZ app in deep sleep. This
+    // also tells whether the TZ app still talks to it:
+    result = fpc_deep_sleep(data);
+    ALOGE_IF(result, "%s: TZ app failed to set up the sensor: %d", __func__, result);
+    return result;
+}
+
 err_t fpc_close(fpc_imp_data_t **data)
 {
     ALOGV(__func__);
@@ -854,6 +1039,7 @@ err_t fpc_close(fpc_imp_data_t **data)
     fpc_event_destroy(&ldata->data.event);
     fpc_uinput_destroy(&ldata->data.uinput);
 
+    ldata->qsee_handle->ion_free(&ldata->ihandle);
     qsee_free_handle(&ldata->qsee_handle);
     free(ldata);
     *data = NULL;
@@ -865,6 +1051,7 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
     struct QSEECom_handle * mFPC_handle = NULL;
     struct QSEECom_handle * mKeymasterHandle = NULL;
     struct qsee_handle_t* qsee_handle = NULL;
+    fpc_data_t *fpc_data = NULL;
     int result = -1;
 
     ALOGI("INIT FPC TZ APP\n");
@@ -873,25 +1060,30 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
         goto err;
     }
 
-    fpc_data_t *fpc_data = (fpc_data_t*)malloc(sizeof(fpc_data_t));
-    fpc_data->auth_id = 0;
+    fpc_data = (fpc_data_t*)calloc(1, sizeof(fpc_data_t));
+    if (fpc_data == NULL)
+        goto err_qsee;
+    fpc_data->qsee_handle = qsee_handle;
+    fpc_data->ihandle.ion_fd = -1;
 
-    fpc_event_create(&fpc_data->data.event, event_fd);
+    if (fpc_event_create(&fpc_data->data.event, event_fd) < 0) {
+        ALOGE("Error opening device events\n");
+        goto err_data;
+    }
     fpc_uinput_create(&fpc_data->data.uinput);
 
     if (fpc_set_power(&fpc_data->data.event, FPC_PWRON) < 0) {
         ALOGE("Error starting device\n");
-        goto err_qsee;
+        goto err_event;
     }
 
     ALOGI("Starting app %s\n", KM_TZAPP_NAME);
     if (qsee_handle->load_trustlet(qsee_handle, &mKeymasterHandle, KM_TZAPP_PATH, KM_TZAPP_NAME, 1024) < 0) {
         if (qsee_handle->load_trustlet(qsee_handle, &mKeymasterHandle, KM_TZAPP_PATH, KM_TZAPP_ALT_NAME, 1024) < 0) {
             ALOGE("Could not load app " KM_TZAPP_NAME " or " KM_TZAPP_ALT_NAME " from " KM_TZAPP_PATH "\n");
-            goto err_alloc;
+            goto err_power;
         }
     }
-    fpc_data->qsee_handle = qsee_handle;
 
 
     ALOGI("Starting app %s\n", FP_TZAPP_NAME);
@@ -917,7 +1109,7 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
 
     //Send command to keymaster
     if (qsee_handle->send_cmd(mKeymasterHandle, send_buf, 64, rec_buf, 1024-64) < 0) {
-        goto err_keymaster;
+        goto err_fpc_app;
     }
 
     keymaster_return_t* ret_data = (keymaster_return_t*) rec_buf;
@@ -935,10 +1127,10 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
     qsee_handle->shutdown_app(&mKeymasterHandle);
     mKeymasterHandle = NULL;
 
-    fpc_data->ihandle.ion_fd = 0;
     if (fpc_data->qsee_handle->ion_alloc(&fpc_data->ihandle, 0x40) < 0) {
         ALOGE("ION allocation failed");
-        goto err_alloc;
+        free(keydata);
+        goto err_fpc_app;
     }
 
     result = send_buffer_command(fpc_data, FPC_GROUP_FPCDATA, FPC_SET_KEY_DATA, keydata, keylength);
@@ -947,27 +1139,35 @@ err_t fpc_init(fpc_imp_data_t **data, int event_fd)
 
     ALOGD("FPC_SET_KEY_DATA Result: %d\n", result);
     if(result != 0)
-        goto err_alloc;
+        goto err_ion;
 
     fpc_deep_sleep((fpc_imp_data_t*)fpc_data);
 
     if (fpc_set_power(&fpc_data->data.event, FPC_PWROFF) < 0) {
         ALOGE("Error stopping device\n");
-        goto err_alloc;
+        result = -1;
+        goto err_ion;
     }
 
     *data = (fpc_imp_data_t*)fpc_data;
 
     return 1;
 
+    // Unwind in the reverse order of the setup above:
+err_ion:
+    qsee_handle->ion_free(&fpc_data->ihandle);
+err_fpc_app:
+    qsee_handle->shutdown_app(&fpc_data->fpc_handle);
 err_keymaster:
     if(mKeymasterHandle != NULL)
         qsee_handle->shutdown_app(&mKeymasterHandle);
-err_alloc:
-    if(fpc_data != NULL) {
-        fpc_data->qsee_handle->ion_free(&fpc_data->ihandle);
-        free(fpc_data);
-    }
+err_power:
+    fpc_set_power(&fpc_data->data.event, FPC_PWROFF);
+err_event:
+    fpc_uinput_destroy(&fpc_data->data.uinput);
+    fpc_event_destroy(&fpc_data->data.event);
+err_data:
+    free(fpc_data);
 err_qsee:
     qsee_free_handle(&qsee_handle);
 err:
@@ -7,38 +7,133 @@
 
 #define LOG_TAG "FPC"
 #include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #define ION_ALIGN 0x1000
 #define ION_ALIGN_MASK (ION_ALIGN - 1)
 
-static int open_ion_device() {
-    int ion_dev_fd = ion_open();
+#if __has_include(<linux/dma-heap.h>)
+#include <linux/dma-heap.h>
+#else
+#include <linux/types.h>
+// Kernels before 5.6 do not ship this UAPI header:
+struct dma_heap_allocation_data {
+    __u64 len;
+    __u32 fd;
+    __u32 fd_flags;
+    __u64 heap_flags;
+};
+#define DMA_HEAP_IOC_MAGIC 'H'
+#define DMA_HEAP_IOCTL_ALLOC _IOWR(DMA_HEAP_IOC_MAGIC, 0x0, struct dma_heap_allocation_data)
+#endif
 
-    LOG_ALWAYS_FATAL_IF(ion_dev_fd < 0, "Failed to open /dev/ion: %s", strerror(errno));
+// DMA-BUF heaps exposing the QSEECom carveout, in order of preference:
+static const char *const dma_heap_paths[] = {
+    "/dev/dma_heap/qcom,qseecom",
+    "/dev/dma_heap/qcom,qseecom-ta",
+};
 
-    return ion_dev_fd;
+/**
+ * The allocator devices are opened once and shared by every buffer in
+ * this process. On kernels that replaced ION with DMA-BUF heaps the
+ * QSEECom heap is used directly. libion is the fallback when no such heap
+ * exists, or an allocation from it fails.
+ */
+static pthread_once_t dma_heap_once = PTHREAD_ONCE_INIT;
+static int dma_heap_fd = -1;
+static pthread_once_t ion_device_once = PTHREAD_ONCE_INIT;
+static int ion_device_fd = -1;
+
+static void open_dma_heap() {
+    size_t i;
+
+    for (i = 0; i < sizeof(dma_heap_paths) / sizeof(dma_heap_paths[0]); ++i) {
+        dma_heap_fd = open(dma_heap_paths[i], O_RDONLY | O_CLOEXEC);
+        if (dma_heap_fd >= 0) {
+            ALOGI("Allocating TZ buffers from %s", dma_heap_paths[i]);
+            return;
+        }
+    }
+}
+
+static void open_ion_device() {
+    ion_device_fd = ion_open();
+    ALOGE_IF(ion_device_fd < 0, "Failed to open /dev/ion: %s", strerror(errno));
+}
+
+static int get_dma_heap() {
+    pthread_once(&dma_heap_once, open_dma_heap);
+    return dma_heap_fd;
+}
+
+static int get_ion_device() {
+    pthread_once(&ion_device_once, open_ion_device);
+    return ion_device_fd;
+}
+
+static int dma_heap_alloc(int heap_fd, size_t aligned_size, int *data_fd) {
+    struct dma_heap_allocation_data data = {
+        .len = aligned_size,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    int rc = ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &data);
+    if (rc < 0)
+        return -errno;
+    *data_fd = data.fd;
+    return 0;
+}
+
+/**
+ * Allocate and map a buffer from \p device_fd, a DMA-BUF heap or /dev/ion.
+ */
+static int alloc_buffer(int device_fd, bool dma_heap, size_t aligned_size, int *data_fd,
+                        unsigned char **mapped) {
+    int rc;
+
+    if (dma_heap)
+        rc = dma_heap_alloc(device_fd, aligned_size, data_fd);
+    else
+        rc = ion_alloc_fd(device_fd, aligned_size, ION_ALIGN,
+                          ION_HEAP(ION_QSECOM_HEAP_ID),
+                          /* flags: */ 0, data_fd);
+    if (rc)
+        return rc;
+
+    *mapped = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, *data_fd, 0);
+    if (*mapped == MAP_FAILED) {
+        rc = -errno;
+        close(*data_fd);
+        return rc;
+    }
+    return 0;
 }
 
 int32_t qcom_km_ion_memalloc(struct qcom_km_ion_info_t *handle, size_t size) {
     size_t aligned_size = (size + ION_ALIGN_MASK) & ~ION_ALIGN_MASK;
-    int rc = 0;
+    int rc = -ENODEV;
     int ion_data_fd = -1;
     unsigned char *mapped = NULL;
-    int ion_fd = open_ion_device();
+    int device_fd = get_dma_heap();
 
-    /* Allocate buffer */
-    rc = ion_alloc_fd(ion_fd, aligned_size, ION_ALIGN,
-                      ION_HEAP(ION_QSECOM_HEAP_ID),
-                      /* flags: */ 0, &ion_data_fd);
-    LOG_ALWAYS_FATAL_IF(rc, "Failed to allocate ION buffer");
+    if (device_fd >= 0) {
+        rc = alloc_buffer(device_fd, true, aligned_size, &ion_data_fd, &mapped);
+        ALOGW_IF(rc, "Failed to allocate %zu bytes from the DMA-BUF heap, trying ION: %s",
+                 aligned_size, strerror(-rc));
+    }
 
-    /* Map buffer to memory */
-    mapped = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE,
-                  MAP_SHARED, ion_data_fd, 0);
-    LOG_ALWAYS_FATAL_IF(mapped == MAP_FAILED, "Failed to map ION buffer");
+    if (rc) {
+        device_fd = get_ion_device();
+        if (device_fd >= 0)
+            rc = alloc_buffer(device_fd, false, aligned_size, &ion_data_fd, &mapped);
+    }
+
+    LOG_ALWAYS_FATAL_IF(rc, "Failed to allocate and map a TZ buffer of %zu bytes: %s",
+                        aligned_size, strerror(-rc));
 
     *handle = (struct qcom_km_ion_info_t){
-        .ion_fd = ion_fd,
+        .ion_fd = device_fd,
         .ifd_data_fd = ion_data_fd,
         .ion_sbuffer = mapped,
         .sbuf_len = aligned_size,
@@ -63,11 +158,133 @@ int32_t qcom_km_ion_dealloc(struct qcom_km_ion_info_t *handle) {
         handle->ifd_data_fd = -1;
     }
 
-    if (handle->ion_fd >= 0) {
-        rc = ion_close(handle->ion_fd);
-        LOG_ALWAYS_FATAL_IF(rc, "Failed to close ION device");
-        handle->ion_fd = -1;
-    }
+    // The allocator device is shared and stays open for the lifetime
+    // of the process.
+    handle->ion_fd = -1;
 
     return rc;
 }
+
+static const size_t pool_class_sizes[QCOM_KM_ION_POOL_CLASSES] = {
+    ION_ALIGN,
+    ION_ALIGN * 2,
+    ION_ALIGN * 4,
+};
+
+void qcom_km_ion_pool_init(struct qcom_km_ion_pool_t *pool, ion_alloc_def alloc, ion_free_def dealloc) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->alloc = alloc;
+    pool->dealloc = dealloc;
+}
+
+void qcom_km_ion_pool_destroy(struct qcom_km_ion_pool_t *pool) {
+    int c, s;
+
+    pthread_mutex_lock(&pool->lock);
+    for (c = 0; c < QCOM_KM_ION_POOL_CLASSES; ++c)
+        for (s = 0; s < QCOM_KM_ION_POOL_SLOTS; ++s) {
+            struct qcom_km_ion_pool_slot_t *slot = &pool->slots[c][s];
+            ALOGE_IF(slot->leased, "ION pool destroyed with buffer %d/%d still leased", c, s);
+            if (slot->allocated)
+                pool->dealloc(&slot->info);
+            slot->allocated = false;
+            slot->leased = false;
+        }
+    ALOGI("ION pool: %u hits, %u misses", pool->hits, pool->misses);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+int32_t qcom_km_ion_pool_lease(struct qcom_km_ion_pool_t *pool, struct qcom_km_ion_info_t **handle, size_t size) {
+    struct qcom_km_ion_info_t *info;
+    int c, s;
+    int rc;
+
+    pthread_mutex_lock(&pool->lock);
+    for (c = 0; c < QCOM_KM_ION_POOL_CLASSES; ++c) {
+        if (size > pool_class_sizes[c])
+            continue;
+
+        for (s = 0; s < QCOM_KM_ION_POOL_SLOTS; ++s) {
+            struct qcom_km_ion_pool_slot_t *slot = &pool->slots[c][s];
+            if (slot->leased)
+                continue;
+
+            if (slot->allocated) {
+                pool->hits++;
+            } else {
+                pool->misses++;
+                rc = pool->alloc(&slot->info, pool_class_sizes[c]);
+                if (rc < 0) {
+                    pthread_mutex_unlock(&pool->lock);
+                    return rc;
+                }
+                slot->allocated = true;
+            }
+
+            slot->leased = true;
+            slot->info.req_len = size;
+            *handle = &slot->info;
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        // All slots of the smallest fitting class are in use.
+        break;
+    }
+    pool->misses++;
+    pthread_mutex_unlock(&pool->lock);
+
+    ALOGV("ION pool miss for %zu bytes, allocating one-off buffer", size);
+
+    info = malloc(sizeof(*info));
+    if (!info)
+        return -ENOMEM;
+
+    rc = pool->alloc(info, size);
+    if (rc < 0) {
+        free(info);
+        return rc;
+    }
+
+    *handle = info;
+    return 0;
+}
+
+void qcom_km_ion_pool_return(struct qcom_km_ion_pool_t *pool, struct qcom_km_ion_info_t *handle) {
+    int c, s;
+
+    pthread_mutex_lock(&pool->lock);
+    for (c = 0; c < QCOM_KM_ION_POOL_CLASSES; ++c)
+        for (s = 0; s < QCOM_KM_ION_POOL_SLOTS; ++s) {
+            struct qcom_km_ion_pool_slot_t *slot = &pool->slots[c][s];
+            if (handle != &slot->info)
+                continue;
+
+            // Hand out the buffer like a fresh allocation next time:
+            memset(slot->info.ion_sbuffer, 0, slot->info.req_len);
+            slot->leased = false;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->dealloc(handle);
+    free(handle);
+}
+
+void qcom_km_ion_pool_dump(struct qcom_km_ion_pool_t *pool, int fd) {
+    unsigned int allocated = 0, leased = 0;
+    int c, s;
+
+    pthread_mutex_lock(&pool->lock);
+    for (c = 0; c < QCOM_KM_ION_POOL_CLASSES; ++c)
+        for (s = 0; s < QCOM_KM_ION_POOL_SLOTS; ++s) {
+            allocated += pool->slots[c][s].allocated;
+            leased += pool->slots[c][s].leased;
+        }
+    dprintf(fd, "ION pool: %u hits, %u misses; %u buffers mapped, %u leased\n",
+            pool->hits, pool->misses, allocated, leased);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ion/ion.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/cdefs.h>
 #include <sys/ioctl.h>
@@ -30,6 +32,38 @@ typedef int32_t (*ion_alloc_def)(struct qcom_km_ion_info_t *handle, size_t size)
 int32_t qcom_km_ion_memalloc(struct qcom_km_ion_info_t *handle, size_t size);
 int32_t qcom_km_ion_dealloc(struct qcom_km_ion_info_t *handle);
 
+/**
+ * Size-classed pool of mapped ION buffers.
+ *
+ * Buffers are allocated lazily the first time a size class is leased and
+ * are kept mapped until the pool is destroyed, so that a steady stream of
+ * TZ commands does not go through ION allocation and mmap every time.
+ * Requests that do not fit any class, or arrive while all slots of their
+ * class are leased, fall back to a one-off allocation.
+ */
+#define QCOM_KM_ION_POOL_CLASSES 3
+#define QCOM_KM_ION_POOL_SLOTS 2
+
+struct qcom_km_ion_pool_slot_t {
+    struct qcom_km_ion_info_t info;
+    bool allocated;
+    bool leased;
+};
+
+struct qcom_km_ion_pool_t {
+    pthread_mutex_t lock;
+    ion_alloc_def alloc;
+    ion_free_def dealloc;
+    struct qcom_km_ion_pool_slot_t slots[QCOM_KM_ION_POOL_CLASSES][QCOM_KM_ION_POOL_SLOTS];
+    uint32_t hits, misses;
+};
+
+void qcom_km_ion_pool_init(struct qcom_km_ion_pool_t *pool, ion_alloc_def alloc, ion_free_def dealloc);
+void qcom_km_ion_pool_destroy(struct qcom_km_ion_pool_t *pool);
+int32_t qcom_km_ion_pool_lease(struct qcom_km_ion_pool_t *pool, struct qcom_km_ion_info_t **handle, size_t size);
+void qcom_km_ion_pool_return(struct qcom_km_ion_pool_t *pool, struct qcom_km_ion_info_t *handle);
+void qcom_km_ion_pool_dump(struct qcom_km_ion_pool_t *pool, int fd);
+
 __END_DECLS
 
 #endif
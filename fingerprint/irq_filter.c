@@ -0,0 +1,133 @@
+#include "irq_filter.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "event_mux.h"
+
+#define LOG_TAG "FPC IRQ"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+// Stop checking the level after this many low reads in a row without a
+// capture in between, in case the driver reports it wrong, and check it
+// again once the IRQ has been quiet for a while:
+#define IRQ_LOW_STREAK_MAX 16
+#define IRQ_LEVEL_RETRY_QUIET_MS 5000
+// Back off once this many captures in a window found no finger:
+#define SPURIOUS_WINDOW_MS 10000
+#define SPURIOUS_THRESHOLD 5
+// The backoff doubles while spurious captures continue, within these bounds:
+#define BACKOFF_MIN_MS 250
+#define BACKOFF_MAX_MS 4000
+
+void irq_filter_init(irq_filter_t *filter, int dev_fd, unsigned long level_ioctl)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->dev_fd = dev_fd;
+    filter->level_ioctl = level_ioctl;
+    filter->level_supported = 1;
+    filter->check_level = 1;
+}
+
+int irq_filter_handle(void *ctx, int fd)
+{
+    irq_filter_t *filter = ctx;
+    int64_t now = event_mux_now_ns();
+    int level = 1;
+
+    ++filter->irqs;
+    if (!filter->check_level && filter->level_supported &&
+        now - filter->last_irq_ns >= (int64_t)IRQ_LEVEL_RETRY_QUIET_MS * 1000000) {
+        ALOGI("IRQ quiet for %d ms, filtering again", IRQ_LEVEL_RETRY_QUIET_MS);
+        filter->check_level = 1;
+        filter->low_streak = 0;
+    }
+    filter->last_irq_ns = now;
+    if (!filter->check_level)
+        return 1;
+
+    if (ioctl(fd, filter->level_ioctl, &level) < 0) {
+        ALOGW("Failed to read the IRQ level, not filtering: %s", strerror(errno));
+        filter->level_supported = 0;
+        filter->check_level = 0;
+        return 1;
+    }
+
+    if (level) {
+        filter->low_streak = 0;
+        return 1;
+    }
+
+    if (++filter->low_streak >= IRQ_LOW_STREAK_MAX) {
+        ALOGW("Device keeps waking up with a low IRQ line, not filtering until it is quiet");
+        filter->check_level = 0;
+        ++filter->level_suspends;
+        return 1;
+    }
+
+    // A glitch, or the tail of a burst that was already serviced:
+    ++filter->glitches;
+    ALOGV("%s: Ignoring IRQ with a low line", __func__);
+    return 0;
+}
+
+void irq_filter_report(irq_filter_t *filter, int finger)
+{
+    int64_t now = event_mux_now_ns();
+
+    ++filter->captures;
+    filter->low_streak = 0;
+
+    if (finger) {
+        filter->window_spurious = 0;
+        filter->backoff_ms = 0;
+        filter->backoff_until_ns = 0;
+        return;
+    }
+
+    ++filter->spurious;
+    if (now - filter->window_start_ns > (int64_t)SPURIOUS_WINDOW_MS * 1000000) {
+        filter->window_start_ns = now;
+        filter->window_spurious = 0;
+    }
+    if (++filter->window_spurious < SPURIOUS_THRESHOLD)
+        return;
+
+    filter->backoff_ms = filter->backoff_ms ? filter->backoff_ms * 2 : BACKOFF_MIN_MS;
+    if (filter->backoff_ms > BACKOFF_MAX_MS)
+        filter->backoff_ms = BACKOFF_MAX_MS;
+    filter->backoff_until_ns = now + filter->backoff_ms * 1000000;
+    filter->window_start_ns = now;
+    filter->window_spurious = 0;
+
+    ++filter->backoffs;
+    filter->backoff_total_ms += filter->backoff_ms;
+    ALOGI("%d captures without a finger in %d ms, backing off detection for %" PRId64 " ms",
+          SPURIOUS_THRESHOLD, SPURIOUS_WINDOW_MS, filter->backoff_ms);
+}
+
+int64_t irq_filter_backoff_deadline_ns(const irq_filter_t *filter)
+{
+    if (!filter->backoff_until_ns || filter->backoff_until_ns <= event_mux_now_ns())
+        return -1;
+    return filter->backoff_until_ns;
+}
+
+void irq_filter_dump(const irq_filter_t *filter, int fd)
+{
+    const char *state = !filter->level_supported ? " (level unavailable)"
+                        : !filter->check_level       ? " (suspended)"
+                                                     : "";
+
+    dprintf(fd, "Finger IRQ filter%s: %u IRQs, %u glitches ignored (capture cycles avoided)\n",
+            state, filter->irqs, filter->glitches);
+    if (filter->level_suspends)
+        dprintf(fd, "  Level check suspended %u times after %d low reads in a row\n",
+                filter->level_suspends, IRQ_LOW_STREAK_MAX);
+    dprintf(fd, "  %u captures, %u without a finger; backed off %u times for %" PRId64 " ms\n",
+            filter->captures, filter->spurious, filter->backoffs, filter->backoff_total_ms);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * Filter for the finger IRQ of the sensor, shared by the FPC and Egistec
+ * stacks.
+ *
+ * Not every wakeup of the device fd is a finger: the IRQ line bounces while
+ * the sensor settles, and the tail of a burst is often still queued when
+ * the TZ app has already serviced the sensor. Such wakeups are swallowed
+ * when the IRQ line reads low, instead of starting a capture cycle in the
+ * TZ app that finds nothing.
+ *
+ * Captures that still find no finger are reported by the HAL. When they
+ * happen at a high rate (say a damp or dirty sensor, or a phone in a
+ * pocket), finger detection backs off for an increasing amount of time.
+ *
+ * All state is owned by the worker thread; the counters are only read
+ * racily for dumps.
+ */
+
+typedef struct {
+    int dev_fd;
+    unsigned long level_ioctl;
+    // Cleared when the driver does not report the IRQ level:
+    int level_supported;
+    // Cleared as well while the level looks unreliable, until the IRQ has
+    // been quiet for a while:
+    int check_level;
+    // Consecutive wakeups with a low IRQ line:
+    unsigned int low_streak;
+    int64_t last_irq_ns;
+
+    // Spurious captures within the current rate window:
+    int64_t window_start_ns;
+    unsigned int window_spurious;
+
+    // Current backoff duration, and when it expires (0 when inactive):
+    int64_t backoff_ms;
+    int64_t backoff_until_ns;
+
+    // Statistics:
+    uint32_t irqs, glitches, captures, spurious, backoffs, level_suspends;
+    int64_t backoff_total_ms;
+} irq_filter_t;
+
+/**
+ * @param[in] level_ioctl Driver ioctl that reads the level of the IRQ line.
+ */
+void irq_filter_init(irq_filter_t *filter, int dev_fd, unsigned long level_ioctl);
+/**
+ * event_mux_handler_t for the device fd, with an irq_filter_t as context.
+ */
+int irq_filter_handle(void *filter, int fd);
+/**
+ * Report the outcome of a capture cycle that was started by a finger IRQ.
+ *
+ * @param[in] finger Non-zero when the TZ app found a finger on the sensor.
+ */
+void irq_filter_report(irq_filter_t *filter, int finger);
+/**
+ * @return The absolute CLOCK_MONOTONIC time in ns until which finger
+ *         detection should not be armed, or -1 when not backing off.
+ */
+int64_t irq_filter_backoff_deadline_ns(const irq_filter_t *filter);
+void irq_filter_dump(const irq_filter_t *filter, int fd);
+
+__END_DECLS
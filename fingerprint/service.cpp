@@ -16,8 +16,14 @@
 
 #define LOG_TAG "android.hardware.biometrics.fingerprint@2.1-service"
 
+#include <inttypes.h>
+
+#include <algorithm>
+
 #include <hidl/HidlSupport.h>
 #include <hidl/HidlTransportSupport.h>
+#include <cutils/properties.h>
+#include <utils/Timers.h>
 #include "BiometricsFingerprint.h"
 #include "egistec/current/BiometricsFingerprint.h"
 #include "egistec/legacy/BiometricsFingerprint.h"
@@ -34,7 +40,16 @@ using FPCHAL = ::fpc::BiometricsFingerprint;
 using LegacyEgistecHAL = ::egistec::legacy::BiometricsFingerprint;
 using CurrentEgistecHAL = ::egistec::current::BiometricsFingerprint;
 
+// Number of binder threads serving the HAL, including the main thread. With
+// more than one, cancel() gets through while another call is busy in the TZ;
+// see HalCallSerializer. Serialized calls only queue up on the extra threads,
+// so one more than the main thread is enough for that.
+#define BINDER_THREADS_PROPERTY "persist.vendor.fingerprint.binder_threads"
+constexpr auto default_binder_threads = 2;
+constexpr auto max_binder_threads = 16;
+
 int main() {
+    const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
     android::sp<IBiometricsFingerprint> bio;
 
 #if defined(FINGERPRINT_TYPE_EGISTEC)
@@ -50,18 +65,18 @@ int main() {
             ALOGI("Egistec sensor installed");
 
             {
+                // Both HALs talk to the same app, so the session used to
+                // probe its interface is handed over instead of loading
+                // the app a second time:
                 ::egistec::legacy::EGISAPTrustlet trustlet;
                 is_old_hal = trustlet.MatchFirmware();
-                // Scope closes trustlet. While this could be reused,
-                // opt for starting fresh in case the command introduces
-                // unexpected state changes.
-            }
-            if (is_old_hal) {
-                ALOGI("Using legacy Egistec (Nile) HAL");
-                bio = new LegacyEgistecHAL(std::move(dev));
-            } else {
-                ALOGI("Using new Egistec (Ganges+) HAL on Nile");
-                bio = new CurrentEgistecHAL(std::move(dev));
+                if (is_old_hal) {
+                    ALOGI("Using legacy Egistec (Nile) HAL");
+                    bio = new LegacyEgistecHAL(std::move(dev), std::move(trustlet));
+                } else {
+                    ALOGI("Using new Egistec (Ganges+) HAL on Nile");
+                    bio = new CurrentEgistecHAL(std::move(dev), std::move(trustlet));
+                }
             }
             break;
         case egistec::FpHwId::Fpc:
@@ -78,7 +93,10 @@ int main() {
     bio = new FPCHAL();
 #endif
 
-    configureRpcThreadpool(1, true /*callerWillJoin*/);
+    const int threads = std::clamp(property_get_int32(BINDER_THREADS_PROPERTY, default_binder_threads),
+                                   1, max_binder_threads);
+    ALOGI("Serving the HAL on %d binder threads", threads);
+    configureRpcThreadpool(threads, true /*callerWillJoin*/);
 
     if (bio != nullptr) {
         status_t status = bio->registerAsService();
@@ -86,6 +104,9 @@ int main() {
             ALOGE("Cannot start fingerprint service: %d", status);
             return 1;
         }
+        // Sensor initialization continues in the background, see DeferredInit:
+        ALOGI("Registered fingerprint service after %" PRId64 "ms",
+              ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - start));
     } else {
         ALOGE("Can't create instance of BiometricsFingerprint, nullptr");
         return 1;
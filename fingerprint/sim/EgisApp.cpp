@@ -0,0 +1,199 @@
+/*
+ * Emulation of the EGISAP TZ app, see egistec/current/EGISAPTrustlet.h.
+ *
+ * The request and response share the send buffer. Output of modified
+ * commands goes to their ION buffer, with its size in extra_buffer_size.
+ */
+
+#include "SimInternal.h"
+
+#include "egistec/current/EGISAPTrustlet.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#define LOG_TAG "QSEEComSim EGIS"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+using namespace egistec::current;
+
+namespace sim {
+
+#define LATENCY(command, us) {0, static_cast<int32_t>(CommandId::command), us}
+
+// Ballpark latencies like those of the FPC app, see FpcApp.cpp:
+const DefaultLatency kEgisLatencies[] = {
+    LATENCY(SetWorkMode, 500),
+    LATENCY(OpenSpi, 200),
+    LATENCY(CloseSpi, 200),
+    LATENCY(GetImage, 30000),
+    LATENCY(IsFingerLost, 2000),
+    LATENCY(Enroll, 60000),
+    LATENCY(SaveEnrolledPrint, 25000),
+    LATENCY(Identify, 45000),
+    LATENCY(UpdateTemplate, 15000),
+    LATENCY(SaveTemplate, 25000),
+};
+const size_t kEgisLatencyCount = sizeof(kEgisLatencies) / sizeof(kEgisLatencies[0]);
+
+#undef LATENCY
+
+namespace {
+
+constexpr size_t kRequestOffset = 0x5c;
+constexpr size_t kMaxPrints = 5;
+constexpr uint32_t kHwId = 0x0576;
+constexpr uint32_t kError = 0x1;
+
+struct State {
+    std::vector<uint32_t> prints;
+    bool image = false;
+    uint32_t enroll_touches = 0;
+};
+
+std::mutex gLock;
+State gState;
+
+uint64_t AuthenticatorId() {
+    uint64_t id = 0;
+    for (auto print : gState.prints)
+        id = id * 31 + print;
+    return id;
+}
+
+template <typename T>
+bool Output(Request &request, base_transaction_t &base, const T &value) {
+    if (!request.ion || request.ion_len < sizeof(value))
+        return false;
+    memcpy(request.ion, &value, sizeof(value));
+    base.extra_buffer_size = sizeof(value);
+    return true;
+}
+
+uint32_t Handle(Request &request, base_transaction_t &base, const trustlet_buffer_t &req) {
+    const auto config = Config();
+
+    switch (req.command) {
+        case CommandId::SetWorkMode:
+            switch (static_cast<WorkMode>(req.gid)) {
+                case WorkMode::Detect:
+                case WorkMode::NavigationDetect:
+                    SensorArm(FP_SIM_DETECT_DOWN);
+                    break;
+                case WorkMode::Sleep:
+                    SensorService();
+                    break;
+            }
+            return 0;
+        case CommandId::GetImage: {
+            const bool finger = SensorFinger();
+            SensorService();
+            gState.image = finger;
+            return Output(request, base, finger ? ImageResult::Good : ImageResult::Nothing)
+                       ? 0
+                       : kError;
+        }
+        case CommandId::IsFingerLost: {
+            const bool finger = SensorFinger();
+            // The finger-lost IRQ follows when the finger is still on:
+            if (finger)
+                SensorArm(FP_SIM_DETECT_LOST);
+            return Output(request, base, finger ? ImageResult::Detected1 : ImageResult::Lost)
+                       ? 0
+                       : kError;
+        }
+        case CommandId::InitializeEnroll:
+            gState.enroll_touches = 0;
+            return 0;
+        case CommandId::Enroll: {
+            enroll_result_t result = {};
+            if (!gState.image) {
+                result.status = ImageResult::Nothing;
+            } else {
+                gState.image = false;
+                ++gState.enroll_touches;
+                result.status = ImageResult::Good;
+                result.percentage = std::min<uint32_t>(
+                    100, gState.enroll_touches * 100 / std::max(config.enroll_touches, 1u));
+            }
+            return Output(request, base, result) ? 0 : kError;
+        }
+        case CommandId::SaveEnrolledPrint:
+            if (gState.prints.size() >= kMaxPrints)
+                return kError;
+            gState.prints.push_back(req.fid);
+            return 0;
+        case CommandId::Identify: {
+            identify_result_t result = {};
+            if (!gState.image)
+                return kError;
+            gState.image = false;
+            if (config.match && !gState.prints.empty()) {
+                result.status = 1;
+                result.match_id = gState.prints.front();
+                result.hat.authenticator_id = AuthenticatorId();
+            }
+            return Output(request, base, result) ? 0 : kError;
+        }
+        case CommandId::UpdateTemplate:
+            return Output(request, base, config.template_update) ? 0 : kError;
+        case CommandId::GetPrintIds: {
+            struct {
+                uint32_t ids[kMaxPrints];
+                uint32_t num_prints;
+            } prints = {};
+            std::copy(gState.prints.begin(), gState.prints.end(), prints.ids);
+            prints.num_prints = gState.prints.size();
+            return Output(request, base, prints) ? 0 : kError;
+        }
+        case CommandId::GetEnrolledCount:
+            return Output(request, base, static_cast<uint32_t>(gState.prints.size())) ? 0
+                                                                                       : kError;
+        case CommandId::RemovePrint: {
+            auto it = std::find(gState.prints.begin(), gState.prints.end(), req.fid);
+            if (it == gState.prints.end())
+                return kError;
+            gState.prints.erase(it);
+            return 0;
+        }
+        case CommandId::GetAuthenticatorId:
+            // Nothing is returned without prints:
+            if (!gState.prints.empty() && !Output(request, base, AuthenticatorId()))
+                return kError;
+            return 0;
+        case CommandId::GetHwId:
+            return Output(request, base, kHwId) ? 0 : kError;
+        case CommandId::GetNavEvent:
+            SensorService();
+            return Output(request, base, 0) ? 0 : kError;
+        default:
+            return 0;
+    }
+}
+
+}  // namespace
+
+int HandleEgis(Request &request) {
+    if (request.send_len < kRequestOffset + sizeof(trustlet_buffer_t)) {
+        ALOGE("%s: Command of %u bytes is too short", __func__, request.send_len);
+        return -EINVAL;
+    }
+
+    // Both live in the send buffer, read the request before responding:
+    trustlet_buffer_t req;
+    memcpy(&req, request.send + kRequestOffset, sizeof(req));
+    auto &base = *reinterpret_cast<base_transaction_t *>(request.send);
+    request.cmd = static_cast<uint32_t>(req.command);
+
+    std::lock_guard<std::mutex> lock(gLock);
+    base.extra_buffer_size = 0;
+    base.ret_val = Handle(request, base, req);
+    return 0;
+}
+
+}  // namespace sim
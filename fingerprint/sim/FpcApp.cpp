@@ -0,0 +1,396 @@
+/*
+ * Emulation of the FPC TZ app of tama, see tz_api_tama.h.
+ *
+ * Commands arrive in the ION buffer of a modified command, and the TZ
+ * response goes to the receive buffer. Prints are kept in memory, and
+ * FPC_STORE_DB and FPC_LOAD_DB write and read them as a list of ids.
+ */
+
+#include "SimInternal.h"
+
+#include "tz_api_tama.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <hardware/fingerprint.h>
+#include <hardware/hw_auth_token.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "QSEEComSim FPC"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace sim {
+
+// Ballpark latencies that put the slow commands in the tens of ms. Override
+// them with the figures tz_trace_dump() reports on a device:
+const DefaultLatency kFpcLatencies[] = {
+    {FPC_GROUP_SENSOR, FPC_SENSOR_WAKE, 500},
+    {FPC_GROUP_SENSOR, FPC_WAIT_FINGER_LOST, 300},
+    {FPC_GROUP_SENSOR, FPC_WAIT_FINGER_DOWN, 300},
+    {FPC_GROUP_SENSOR, FPC_CAPTURE_IMAGE, 30000},
+    {FPC_GROUP_SENSOR, FPC_DEEP_SLEEP, 300},
+    {FPC_GROUP_TEMPLATE, FPC_ENROL_STEP, 60000},
+    {FPC_GROUP_TEMPLATE, FPC_END_ENROL, 20000},
+    {FPC_GROUP_TEMPLATE, FPC_IDENTIFY, 45000},
+    {FPC_GROUP_TEMPLATE, FPC_UPDATE_TEMPLATE, 15000},
+    {FPC_GROUP_DB, FPC_LOAD_DB, 20000},
+    {FPC_GROUP_DB, FPC_STORE_DB, 25000},
+    {FPC_GROUP_FPCDATA, FPC_GET_AUTH_RESULT, 1000},
+    {FPC_GROUP_NAVIGATION, FPC_NAVIGATION_POLL, 1500},
+};
+const size_t kFpcLatencyCount = sizeof(kFpcLatencies) / sizeof(kFpcLatencies[0]);
+
+namespace {
+
+// FPC_CAPTURE_IMAGE result that asks for more sensor data:
+constexpr uint32_t kCaptureNeedMoreData = 3;
+// FPC_SET_KEY_DATA takes the key of the keymaster app:
+constexpr uint32_t kKeyDataSize = 0x98;
+constexpr int32_t kError = -1;
+
+struct State {
+    std::vector<uint32_t> prints;
+    uint32_t next_print_id = 0x1000;
+    uint64_t auth_challenge = 0;
+
+    bool enrolling = false;
+    uint32_t remaining_touches = 0;
+    // Whether the last capture produced an image for enroll or identify:
+    bool image = false;
+    // The touch the capture retries are counted for:
+    uint32_t capture_touch = 0;
+    uint32_t capture_retries = 0;
+
+    bool navigating = false;
+    // When the finger touched during navigation, the epoch without contact:
+    std::chrono::steady_clock::time_point contact_begin;
+    bool gesture_reported = false;
+};
+
+std::mutex gLock;
+State gState;
+
+uint64_t AuthenticatorId() {
+    uint64_t id = 0;
+    for (auto print : gState.prints)
+        id = id * 31 + print;
+    return id;
+}
+
+template <typename T>
+T *Command(Request &request) {
+    return request.ion_len >= sizeof(T) ? reinterpret_cast<T *>(request.ion) : nullptr;
+}
+
+/**
+ * The path passed in a buffer command, or an empty string.
+ */
+std::string BufferPath(Request &request) {
+    auto *cmd = Command<fpc_send_buffer_t>(request);
+    const size_t max = request.ion_len - offsetof(fpc_send_buffer_t, data);
+    if (!cmd || cmd->length > max)
+        return {};
+    const char *data = reinterpret_cast<const char *>(&cmd->data);
+    return std::string(data, strnlen(data, cmd->length));
+}
+
+int32_t HandleSensor(Request &request) {
+    auto *cmd = Command<fpc_send_std_cmd_t>(request);
+
+    switch (request.cmd) {
+        case FPC_SENSOR_WAKE:
+            cmd->ret_val = !SensorFinger();
+            return 0;
+        case FPC_WAIT_FINGER_LOST:
+            SensorArm(FP_SIM_DETECT_LOST);
+            return 0;
+        case FPC_WAIT_FINGER_DOWN:
+            SensorArm(FP_SIM_DETECT_DOWN);
+            return 0;
+        case FPC_CAPTURE_IMAGE: {
+            const bool finger = SensorFinger();
+            SensorService();
+            if (!finger) {
+                cmd->ret_val = FINGERPRINT_ACQUIRED_INSUFFICIENT;
+                return 0;
+            }
+
+            const uint32_t touch = SensorTouches();
+            if (touch != gState.capture_touch) {
+                gState.capture_touch = touch;
+                gState.capture_retries = Config().capture_retries;
+            }
+            if (gState.capture_retries) {
+                --gState.capture_retries;
+                cmd->ret_val = kCaptureNeedMoreData;
+                return 0;
+            }
+
+            gState.image = true;
+            cmd->ret_val = FINGERPRINT_ACQUIRED_GOOD;
+            return 0;
+        }
+        case FPC_DEEP_SLEEP:
+            SensorService();
+            return 0;
+    }
+    return 0;
+}
+
+int32_t HandleTemplate(Request &request) {
+    const auto config = Config();
+
+    switch (request.cmd) {
+        case FPC_BEGIN_ENROL:
+            gState.enrolling = true;
+            gState.remaining_touches = config.enroll_touches;
+            return 0;
+        case FPC_ENROL_STEP: {
+            auto *cmd = Command<fpc_enrol_step_t>(request);
+            if (!gState.enrolling || !gState.image) {
+                cmd->status = kError;
+                return 0;
+            }
+            gState.image = false;
+            if (gState.remaining_touches)
+                --gState.remaining_touches;
+            cmd->remaining_touches = gState.remaining_touches;
+            cmd->status = gState.remaining_touches ? 1 : 0;
+            return 0;
+        }
+        case FPC_END_ENROL: {
+            auto *cmd = Command<fpc_end_enrol_t>(request);
+            if (!gState.enrolling || gState.remaining_touches ||
+                gState.prints.size() >= FINGERPRINT_MAX_COUNT) {
+                cmd->status = kError;
+                return 0;
+            }
+            gState.enrolling = false;
+            gState.prints.push_back(gState.next_print_id++);
+            cmd->print_id = gState.prints.back();
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_IDENTIFY: {
+            auto *cmd = Command<fpc_send_identify_t>(request);
+            if (!gState.image) {
+                cmd->status = kError;
+                return 0;
+            }
+            gState.image = false;
+            cmd->id = config.match && !gState.prints.empty() ? gState.prints.front() : 0;
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_UPDATE_TEMPLATE: {
+            auto *cmd = Command<fpc_update_template_t>(request);
+            cmd->has_changed = config.template_update;
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_LOAD_EMPTY_DB:
+            gState.prints.clear();
+            return 0;
+        case FPC_GET_FINGERPRINTS: {
+            auto *cmd = Command<fpc_fingerprint_list_t>(request);
+            cmd->length = gState.prints.size();
+            std::copy(gState.prints.begin(), gState.prints.end(), cmd->fingerprints);
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_DELETE_FINGERPRINT: {
+            auto *cmd = Command<fpc_fingerprint_delete_t>(request);
+            auto it = std::find(gState.prints.begin(), gState.prints.end(), cmd->fingerprint_id);
+            if (it == gState.prints.end()) {
+                cmd->status = kError;
+                return 0;
+            }
+            gState.prints.erase(it);
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_SET_GID:
+            Command<fpc_set_gid_t>(request)->status = 0;
+            return 0;
+        case FPC_GET_TEMPLATE_ID: {
+            auto *cmd = Command<fpc_get_db_id_cmd_t>(request);
+            cmd->auth_id = AuthenticatorId();
+            cmd->result = 0;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int32_t HandleDb(Request &request) {
+    auto *cmd = Command<fpc_send_buffer_t>(request);
+    const std::string path = BufferPath(request);
+    FILE *file;
+
+    cmd->status = kError;
+    if (path.empty())
+        return 0;
+
+    switch (request.cmd) {
+        case FPC_LOAD_DB: {
+            if (!(file = fopen(path.c_str(), "r")))
+                return 0;
+            std::vector<uint32_t> prints;
+            unsigned int id;
+            while (prints.size() < FINGERPRINT_MAX_COUNT && fscanf(file, "%x", &id) == 1)
+                prints.push_back(id);
+            fclose(file);
+            gState.prints = prints;
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_STORE_DB:
+            if (!(file = fopen(path.c_str(), "w")))
+                return 0;
+            for (auto id : gState.prints)
+                fprintf(file, "%x\n", id);
+            cmd->status = fclose(file) ? kError : 0;
+            return 0;
+    }
+    return 0;
+}
+
+int32_t HandleFpcData(Request &request) {
+    switch (request.cmd) {
+        case FPC_SET_AUTH_CHALLENGE: {
+            auto *cmd = Command<fpc_send_auth_cmd_t>(request);
+            gState.auth_challenge = cmd->challenge;
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_GET_AUTH_CHALLENGE: {
+            auto *cmd = Command<fpc_load_auth_challenge_t>(request);
+            cmd->challenge = gState.auth_challenge = (uint64_t)rand() << 32 | rand();
+            cmd->status = 0;
+            return 0;
+        }
+        case FPC_AUTHORIZE_ENROL:
+            Command<fpc_send_buffer_t>(request)->status = 0;
+            return 0;
+        case FPC_GET_AUTH_RESULT: {
+            auto *cmd = Command<fpc_get_auth_result_t>(request);
+            hw_auth_token_t hat = {};
+            hat.challenge = gState.auth_challenge;
+            hat.authenticator_id = AuthenticatorId();
+            hat.authenticator_type = htonl(HW_AUTH_FINGERPRINT);
+            static_assert(sizeof(hat) == AUTH_RESULT_LENGTH, "Unexpected hw_auth_token_t size");
+            memcpy(cmd->auth_result, &hat, sizeof(hat));
+            cmd->length = sizeof(hat);
+            cmd->result = 0;
+            return 0;
+        }
+        case FPC_SET_KEY_DATA: {
+            auto *cmd = Command<fpc_send_buffer_t>(request);
+            cmd->status = cmd->length == kKeyDataSize ? 0 : kError;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int32_t HandleNavigation(Request &request) {
+    auto *cmd = Command<fpc_navi_cmd_t>(request);
+    const auto config = Config();
+
+    switch (request.cmd) {
+        case FPC_NAVIGATION_ENTER:
+            gState.navigating = true;
+            gState.contact_begin = {};
+            gState.gesture_reported = false;
+            return 0;
+        case FPC_NAVIGATION_EXIT:
+            gState.navigating = false;
+            SensorService();
+            return 0;
+        case FPC_NAVIGATION_POLL: {
+            if (!gState.navigating) {
+                cmd->ret_val = kError;
+                return 0;
+            }
+
+            const bool finger = SensorFinger();
+            SensorService();
+            cmd->finger_on = finger;
+
+            if (finger) {
+                // Track the finger, and keep being polled:
+                const auto now = std::chrono::steady_clock::now();
+                if (gState.contact_begin == std::chrono::steady_clock::time_point())
+                    gState.contact_begin = now;
+                if (!gState.gesture_reported &&
+                    now - gState.contact_begin >=
+                        std::chrono::milliseconds(config.navi_gesture_ms)) {
+                    cmd->gesture = config.navi_gesture;
+                    gState.gesture_reported = true;
+                }
+                cmd->should_poll = 0;
+                return 0;
+            }
+
+            // A touch without a gesture is a tap:
+            if (gState.contact_begin != std::chrono::steady_clock::time_point() &&
+                !gState.gesture_reported)
+                cmd->gesture = FPC_GESTURE_GONE;
+            gState.contact_begin = {};
+            gState.gesture_reported = false;
+            cmd->should_poll = 1;
+            SensorArm(FP_SIM_DETECT_DOWN);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+}  // namespace
+
+int HandleFpc(Request &request) {
+    auto *cmd = Command<fpc_send_std_cmd_t>(request);
+    if (!cmd || request.rcv_len < sizeof(int32_t)) {
+        ALOGE("%s: Command without an ION buffer or response", __func__);
+        return -EINVAL;
+    }
+    request.group = cmd->group_id;
+    request.cmd = cmd->cmd_id;
+
+    std::lock_guard<std::mutex> lock(gLock);
+    int32_t response = 0;
+    switch (request.group) {
+        case FPC_GROUP_SENSOR:
+            response = HandleSensor(request);
+            break;
+        case FPC_GROUP_TEMPLATE:
+            response = HandleTemplate(request);
+            break;
+        case FPC_GROUP_DB:
+            response = HandleDb(request);
+            break;
+        case FPC_GROUP_FPCDATA:
+            response = HandleFpcData(request);
+            break;
+        case FPC_GROUP_NAVIGATION:
+            response = HandleNavigation(request);
+            break;
+        default:
+            ALOGW("%s: Unknown command %#x:%#x", __func__, request.group, request.cmd);
+            break;
+    }
+
+    *reinterpret_cast<int32_t *>(request.rcv) = response;
+    return 0;
+}
+
+}  // namespace sim
@@ -0,0 +1,55 @@
+/*
+ * Emulation of the one keymaster command the HALs send: retrieval of the
+ * master key that is handed to the fingerprint TZ app.
+ */
+
+#include "SimInternal.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LOG_TAG "QSEEComSim Keymaster"
+#include <log/log.h>
+
+namespace sim {
+namespace {
+
+constexpr uint32_t kGetKeyCmd = 0x205;
+constexpr uint32_t kKeySize = 0x98;
+
+// The key follows the response:
+struct Response {
+    int32_t status;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t reserved;
+    uint8_t key[kKeySize];
+};
+
+}  // namespace
+
+int HandleKeymaster(Request &request) {
+    uint32_t cmd;
+
+    if (request.send_len < sizeof(cmd) || request.rcv_len < sizeof(Response)) {
+        ALOGE("%s: Buffers of %u and %u bytes are too short", __func__, request.send_len,
+              request.rcv_len);
+        return -EINVAL;
+    }
+
+    // The HALs may pass the same buffer for the command and response:
+    memcpy(&cmd, request.send, sizeof(cmd));
+    request.cmd = cmd;
+
+    Response response = {
+        .status = cmd == kGetKeyCmd ? 0 : -1,
+        .offset = offsetof(Response, key),
+        .length = kKeySize,
+    };
+    memset(response.key, 0x5a, sizeof(response.key));
+    memcpy(request.rcv, &response, sizeof(response));
+    return 0;
+}
+
+}  // namespace sim
@@ -0,0 +1,346 @@
+/*
+ * The QSEECom entry points of libQSEEComSim, see qseecom_sim.h.
+ *
+ * Apps are recognized by name. Commands are handed to the emulation of
+ * their app, after which the caller is blocked until the latency of the
+ * command has passed, counted from the start of the call.
+ */
+
+#include "SimInternal.h"
+
+#include "QSEEComAPI.h"
+#include "tz_api_common.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#define LOG_TAG "QSEEComSim"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace sim {
+namespace {
+
+// Latency of commands without one of their own:
+constexpr uint32_t kDefaultLatencyUs = 100;
+
+struct SimHandle {
+    // Must be first, the HALs only see this:
+    QSEECom_handle handle;
+    qseecom_sim_app_t app;
+    uint32_t size;
+};
+
+struct AppName {
+    const char *name;
+    qseecom_sim_app_t app;
+};
+
+const AppName kAppNames[] = {
+    {"fpctzfingerprint", QSEECOM_SIM_APP_FPC},
+    {"tzfingerprint", QSEECOM_SIM_APP_FPC},
+    {"fpctzapp", QSEECOM_SIM_APP_FPC},
+    {"egisap32", QSEECOM_SIM_APP_EGIS},
+    {"egisap64", QSEECOM_SIM_APP_EGIS},
+    {"keymaster64", QSEECOM_SIM_APP_KEYMASTER},
+    {"keymaster", QSEECOM_SIM_APP_KEYMASTER},
+};
+
+const char *const kAppPrefixes[QSEECOM_SIM_APP_COUNT] = {"fpc", "egis", "keymaster"};
+
+using LatencyKey = std::tuple<qseecom_sim_app_t, uint32_t, int32_t>;
+
+std::mutex gLatencyLock;
+std::once_flag gLatencyOnce;
+std::map<LatencyKey, uint32_t> gLatencies;
+
+std::mutex gConfigLock;
+qseecom_sim_config_t gConfig = {
+    .capture_retries = 1,
+    .enroll_touches = 12,
+    .match = true,
+    .template_update = true,
+    .navi_gesture_ms = 100,
+    .navi_gesture = FPC_GESTURE_LEFT,
+};
+
+std::atomic<uint64_t> gCalls[QSEECOM_SIM_APP_COUNT];
+std::atomic<uint64_t> gBusyUs[QSEECOM_SIM_APP_COUNT];
+
+int64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void SleepUntilNs(int64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = static_cast<time_t>(deadline_ns / 1000000000),
+        .tv_nsec = static_cast<long>(deadline_ns % 1000000000),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        ;
+}
+
+// Parses QSEECOM_SIM_LATENCY, see qseecom_sim_set_latency():
+void ParseLatencyEnv(const char *env) {
+    char *list = strdup(env);
+    char *save = nullptr;
+
+    for (char *entry = strtok_r(list, ",", &save); entry; entry = strtok_r(nullptr, ",", &save)) {
+        char *value = strchr(entry, '=');
+        char *group = strchr(entry, ':');
+        if (!value || !group || group > value) {
+            ALOGE("Ignoring latency \"%s\"", entry);
+            continue;
+        }
+        *value++ = *group++ = '\0';
+
+        int app = 0;
+        while (app < QSEECOM_SIM_APP_COUNT && strcmp(entry, kAppPrefixes[app]))
+            ++app;
+        if (app == QSEECOM_SIM_APP_COUNT) {
+            ALOGE("Ignoring latency of unknown app \"%s\"", entry);
+            continue;
+        }
+
+        const auto sim_app = static_cast<qseecom_sim_app_t>(app);
+        const uint32_t us = strtoul(value, nullptr, 0);
+        char *cmd = strchr(group, ':');
+        if (!strcmp(group, "*")) {
+            gLatencies[{sim_app, 0, -1}] = us;
+        } else if (cmd) {
+            *cmd++ = '\0';
+            gLatencies[{sim_app, static_cast<uint32_t>(strtoul(group, nullptr, 0)),
+                        static_cast<int32_t>(strtol(cmd, nullptr, 0))}] = us;
+        } else {
+            ALOGE("Ignoring latency without a command for %s", entry);
+        }
+    }
+
+    free(list);
+}
+
+void InitLatenciesLocked() {
+    for (size_t i = 0; i < kFpcLatencyCount; ++i)
+        gLatencies[{QSEECOM_SIM_APP_FPC, kFpcLatencies[i].group, kFpcLatencies[i].cmd}] =
+            kFpcLatencies[i].us;
+    for (size_t i = 0; i < kEgisLatencyCount; ++i)
+        gLatencies[{QSEECOM_SIM_APP_EGIS, kEgisLatencies[i].group, kEgisLatencies[i].cmd}] =
+            kEgisLatencies[i].us;
+
+    const char *env = getenv("QSEECOM_SIM_LATENCY");
+    if (env)
+        ParseLatencyEnv(env);
+}
+
+std::unique_lock<std::mutex> LockLatencies() {
+    std::unique_lock<std::mutex> lock(gLatencyLock);
+    std::call_once(gLatencyOnce, InitLatenciesLocked);
+    return lock;
+}
+
+uint32_t Latency(qseecom_sim_app_t app, uint32_t group, uint32_t cmd) {
+    auto lock = LockLatencies();
+    auto it = gLatencies.find({app, group, static_cast<int32_t>(cmd)});
+    if (it == gLatencies.end())
+        it = gLatencies.find({app, 0, -1});
+    return it == gLatencies.end() ? kDefaultLatencyUs : it->second;
+}
+
+/**
+ * Maps the ION buffer of a modified command, like the TZ would.
+ */
+class IonMapping {
+    uint8_t *mAddr = nullptr;
+    size_t mLen = 0;
+
+   public:
+    explicit IonMapping(const QSEECom_ion_fd_info *ifd_data) {
+        struct stat st;
+        if (!ifd_data || ifd_data->data[0].fd <= 0 || fstat(ifd_data->data[0].fd, &st))
+            return;
+        void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          ifd_data->data[0].fd, 0);
+        if (addr == MAP_FAILED) {
+            ALOGE("Failed to map ION buffer %d: %s", ifd_data->data[0].fd, strerror(errno));
+            return;
+        }
+        mAddr = static_cast<uint8_t *>(addr);
+        mLen = st.st_size;
+    }
+
+    ~IonMapping() {
+        if (mAddr)
+            munmap(mAddr, mLen);
+    }
+
+    IonMapping(const IonMapping &) = delete;
+    IonMapping &operator=(const IonMapping &) = delete;
+
+    uint8_t *addr() const {
+        return mAddr;
+    }
+
+    size_t len() const {
+        return mLen;
+    }
+};
+
+int Dispatch(QSEECom_handle *handle, void *send_buf, uint32_t sbuf_len, void *rcv_buf,
+             uint32_t rbuf_len, const QSEECom_ion_fd_info *ifd_data) {
+    const int64_t begin = NowNs();
+    auto *sim_handle = reinterpret_cast<SimHandle *>(handle);
+    if (!sim_handle)
+        return -EINVAL;
+
+    IonMapping ion(ifd_data);
+    Request request = {
+        .send = static_cast<uint8_t *>(send_buf),
+        .send_len = sbuf_len,
+        .rcv = static_cast<uint8_t *>(rcv_buf),
+        .rcv_len = rbuf_len,
+        .ion = ion.addr(),
+        .ion_len = ion.len(),
+    };
+
+    int rc = -EINVAL;
+    switch (sim_handle->app) {
+        case QSEECOM_SIM_APP_FPC:
+            rc = HandleFpc(request);
+            break;
+        case QSEECOM_SIM_APP_EGIS:
+            rc = HandleEgis(request);
+            break;
+        case QSEECOM_SIM_APP_KEYMASTER:
+            rc = HandleKeymaster(request);
+            break;
+        case QSEECOM_SIM_APP_COUNT:
+            break;
+    }
+
+    SleepUntilNs(begin + Latency(sim_handle->app, request.group, request.cmd) * 1000LL);
+
+    ++gCalls[sim_handle->app];
+    gBusyUs[sim_handle->app] += (NowNs() - begin) / 1000;
+    ALOGV("%s: %s %#x:%#x = %d", __func__, kAppPrefixes[sim_handle->app], request.group,
+          request.cmd, rc);
+    return rc;
+}
+
+}  // namespace
+
+qseecom_sim_config_t Config() {
+    std::lock_guard<std::mutex> lock(gConfigLock);
+    return gConfig;
+}
+
+}  // namespace sim
+
+using namespace sim;
+
+void qseecom_sim_configure(const qseecom_sim_config_t *config) {
+    std::lock_guard<std::mutex> lock(gConfigLock);
+    gConfig = *config;
+}
+
+void qseecom_sim_get_config(qseecom_sim_config_t *config) {
+    *config = Config();
+}
+
+void qseecom_sim_set_latency(qseecom_sim_app_t app, uint32_t group, int32_t cmd, uint32_t us) {
+    auto lock = LockLatencies();
+    gLatencies[{app, cmd < 0 ? 0 : group, cmd}] = us;
+}
+
+qseecom_sim_stats_t qseecom_sim_stats(qseecom_sim_app_t app) {
+    return {
+        .calls = gCalls[app],
+        .busy_us = gBusyUs[app],
+    };
+}
+
+int QSEECom_start_app(struct QSEECom_handle **clnt_handle, const char *path, const char *fname,
+                      uint32_t sb_size) {
+    for (const auto &app : kAppNames) {
+        if (strcmp(fname, app.name))
+            continue;
+
+        auto *sim_handle = static_cast<SimHandle *>(calloc(1, sizeof(SimHandle)));
+        sim_handle->handle.ion_sbuffer = static_cast<unsigned char *>(calloc(1, sb_size));
+        sim_handle->app = app.app;
+        sim_handle->size = sb_size;
+        *clnt_handle = &sim_handle->handle;
+        ALOGI("Started %s from %s with a %u byte buffer", fname, path, sb_size);
+        return 0;
+    }
+
+    ALOGE("No emulation for app %s", fname);
+    return -1;
+}
+
+int QSEECom_shutdown_app(struct QSEECom_handle **handle) {
+    auto *sim_handle = reinterpret_cast<SimHandle *>(*handle);
+    if (!sim_handle)
+        return -EINVAL;
+    free(sim_handle->handle.ion_sbuffer);
+    free(sim_handle);
+    *handle = nullptr;
+    return 0;
+}
+
+int QSEECom_load_external_elf(struct QSEECom_handle **, const char *, const char *) {
+    return -ENOSYS;
+}
+
+int QSEECom_unload_external_elf(struct QSEECom_handle **) {
+    return -ENOSYS;
+}
+
+int QSEECom_register_listener(struct QSEECom_handle **, uint32_t, uint32_t, uint32_t) {
+    return QSEECOM_LISTENER_REGISTER_FAIL;
+}
+
+int QSEECom_unregister_listener(struct QSEECom_handle *) {
+    return QSEECOM_LISTENER_UNREGISTERED;
+}
+
+int QSEECom_send_cmd(struct QSEECom_handle *handle, void *send_buf, uint32_t sbuf_len,
+                     void *rcv_buf, uint32_t rbuf_len) {
+    return Dispatch(handle, send_buf, sbuf_len, rcv_buf, rbuf_len, nullptr);
+}
+
+int QSEECom_send_modified_cmd(struct QSEECom_handle *handle, void *send_buf, uint32_t sbuf_len,
+                              void *resp_buf, uint32_t rbuf_len,
+                              struct QSEECom_ion_fd_info *ifd_data) {
+    return Dispatch(handle, send_buf, sbuf_len, resp_buf, rbuf_len, ifd_data);
+}
+
+int QSEECom_receive_req(struct QSEECom_handle *, void *, uint32_t) {
+    return -ENOSYS;
+}
+
+int QSEECom_send_resp(struct QSEECom_handle *, void *, uint32_t) {
+    return -ENOSYS;
+}
+
+int QSEECom_set_bandwidth(struct QSEECom_handle *, bool) {
+    return 0;
+}
+
+int QSEECom_app_load_query(struct QSEECom_handle *, char *app_name) {
+    for (const auto &app : kAppNames)
+        if (!strcmp(app_name, app.name))
+            return QSEECOM_APP_ALREADY_LOADED;
+    return QSEECOM_APP_NOT_LOADED;
+}
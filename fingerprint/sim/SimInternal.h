@@ -0,0 +1,58 @@
+#pragma once
+
+#include <qseecom_sim.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sim {
+
+/**
+ * A command sent to an emulated TZ app. The handler identifies the command
+ * in group and cmd, for its latency and the statistics.
+ */
+struct Request {
+    uint8_t *send;
+    uint32_t send_len;
+    uint8_t *rcv;
+    uint32_t rcv_len;
+    // The ION buffer passed as the first fd of a modified command:
+    uint8_t *ion;
+    size_t ion_len;
+
+    uint32_t group = 0;
+    uint32_t cmd = 0;
+};
+
+struct DefaultLatency {
+    uint32_t group;
+    int32_t cmd;
+    uint32_t us;
+};
+
+// Returns the value of the QSEECom call:
+int HandleFpc(Request &);
+int HandleEgis(Request &);
+int HandleKeymaster(Request &);
+
+extern const DefaultLatency kFpcLatencies[];
+extern const size_t kFpcLatencyCount;
+extern const DefaultLatency kEgisLatencies[];
+extern const size_t kEgisLatencyCount;
+
+qseecom_sim_config_t Config();
+
+/*
+ * The sensor, shared by the apps:
+ */
+
+// Arm detection of a finger-down or finger-lost, raising the IRQ right away
+// when the finger is already in that state. Clears an earlier detection:
+void SensorArm(fp_sim_detect_t);
+// Read out the sensor: lowers the IRQ and disarms detection.
+void SensorService();
+bool SensorFinger();
+// Touches since the process started, to tell touches apart:
+uint32_t SensorTouches();
+
+}  // namespace sim
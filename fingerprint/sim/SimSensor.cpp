@@ -0,0 +1,274 @@
+/*
+ * The simulated sensor and its device nodes.
+ *
+ * The IRQ line is an eventfd that holds a count while the line is high.
+ * Every fd of the fake device is a dup() of it, so that poll and epoll on
+ * any of them see the level. The TZ apps arm detection of a finger-down or
+ * a finger-lost, and service the sensor when they capture, like the real
+ * sensors do.
+ */
+
+#include "SimInternal.h"
+
+#include "common.h"
+#include "egistec/EgisFpDevice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#define LOG_TAG "QSEEComSim Sensor"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+namespace sim {
+namespace {
+
+constexpr auto kUinputPath = "/dev/uinput";
+
+// Argument of FPC_IOCWAWAKE, see fpc_keep_awake():
+struct AwakeArgs {
+    int awake;
+    unsigned int timeout;
+};
+
+std::mutex gLock;
+std::condition_variable gCond;
+int gIrqFd = -1;
+bool gFinger = false;
+bool gLevel = false;
+fp_sim_detect_t gArmed = FP_SIM_DETECT_NONE;
+uint32_t gTouches = 0;
+fp_sim_device_stats_t gStats = {};
+
+// Device nodes handed out by fp_sim_open(). Separate from gLock, because
+// fake_device.c checks every close() of the process:
+std::mutex gFdLock;
+std::set<int> gDeviceFds, gUinputFds;
+
+int IrqFdLocked() {
+    if (gIrqFd < 0) {
+        gIrqFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        LOG_ALWAYS_FATAL_IF(gIrqFd < 0, "Failed to create the IRQ eventfd: %s", strerror(errno));
+    }
+    return gIrqFd;
+}
+
+void RaiseLocked() {
+    if (gLevel)
+        return;
+    gLevel = true;
+    ++gStats.irqs;
+    eventfd_write(IrqFdLocked(), 1);
+}
+
+void LowerLocked() {
+    if (!gLevel)
+        return;
+    gLevel = false;
+    eventfd_t value;
+    eventfd_read(IrqFdLocked(), &value);
+}
+
+void DetectLocked() {
+    if ((gArmed == FP_SIM_DETECT_DOWN && gFinger) || (gArmed == FP_SIM_DETECT_LOST && !gFinger))
+        RaiseLocked();
+}
+
+// Counts the key presses the HAL writes to the fake uinput device:
+void ReadKeys(int fd) {
+    input_event events[16];
+    size_t buffered = 0;
+
+    for (;;) {
+        ssize_t len = TEMP_FAILURE_RETRY(
+            read(fd, reinterpret_cast<char *>(events) + buffered, sizeof(events) - buffered));
+        if (len <= 0)
+            break;
+        buffered += len;
+
+        const size_t count = buffered / sizeof(*events);
+        uint32_t keys = 0;
+        for (size_t i = 0; i < count; ++i)
+            if (events[i].type == EV_KEY && events[i].value == 1)
+                ++keys;
+
+        buffered -= count * sizeof(*events);
+        memmove(events, events + count, buffered);
+
+        if (keys) {
+            std::lock_guard<std::mutex> lock(gLock);
+            gStats.keys += keys;
+            gCond.notify_all();
+        }
+    }
+    close(fd);
+}
+
+template <typename Predicate>
+bool WaitFor(int timeout_ms, Predicate predicate) {
+    std::unique_lock<std::mutex> lock(gLock);
+    if (timeout_ms < 0) {
+        gCond.wait(lock, predicate);
+        return true;
+    }
+    return gCond.wait_for(lock, std::chrono::milliseconds(timeout_ms), predicate);
+}
+
+int DeviceIoctl(unsigned long request, void *arg) {
+    std::lock_guard<std::mutex> lock(gLock);
+    ++gStats.ioctls;
+
+    // Values are passed as int, arguments of read ioctls as pointers:
+    const int value = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+
+    switch (request) {
+        case FPC_IOCWPREPARE:
+            gStats.powered = value;
+            if (!value)
+                LowerLocked();
+            return 0;
+        case FPC_IOCWDEVWAKE:
+            return 0;
+        case FPC_IOCWRESET:
+            LowerLocked();
+            gArmed = FP_SIM_DETECT_NONE;
+            return 0;
+        case FPC_IOCWAWAKE: {
+            const auto *args = static_cast<const AwakeArgs *>(arg);
+            if (args->awake) {
+                ++gStats.wakelocks;
+                if (args->timeout > gStats.wakelock_max_ms)
+                    gStats.wakelock_max_ms = args->timeout;
+            }
+            return 0;
+        }
+        case FPC_IOCRPREPARE:
+            *static_cast<uint32_t *>(arg) = gStats.powered;
+            return 0;
+        case FPC_IOCRDEVWAKE:
+            *static_cast<int *>(arg) = 1;
+            return 0;
+        case FPC_IOCRIRQ:
+        case FPC_IOCRIRQPOLL:
+            *static_cast<int *>(arg) = gLevel;
+            return 0;
+        case ET51X_IOCRHWTYPE:
+            *static_cast<int *>(arg) = FP_HW_TYPE_EGISTEC;
+            return 0;
+    }
+
+    ALOGW("%s: Unknown ioctl %#lx", __func__, request);
+    errno = ENOTTY;
+    return -1;
+}
+
+}  // namespace
+
+void SensorArm(fp_sim_detect_t detect) {
+    std::lock_guard<std::mutex> lock(gLock);
+    // Arming clears a detection that was not serviced:
+    LowerLocked();
+    gArmed = detect;
+    DetectLocked();
+    gCond.notify_all();
+}
+
+void SensorService() {
+    std::lock_guard<std::mutex> lock(gLock);
+    gArmed = FP_SIM_DETECT_NONE;
+    LowerLocked();
+}
+
+bool SensorFinger() {
+    std::lock_guard<std::mutex> lock(gLock);
+    return gFinger;
+}
+
+uint32_t SensorTouches() {
+    std::lock_guard<std::mutex> lock(gLock);
+    return gTouches;
+}
+
+}  // namespace sim
+
+using namespace sim;
+
+void fp_sim_touch(bool down) {
+    std::lock_guard<std::mutex> lock(gLock);
+    if (down && !gFinger)
+        ++gTouches;
+    gFinger = down;
+    DetectLocked();
+}
+
+bool fp_sim_wait_armed(fp_sim_detect_t detect, int timeout_ms) {
+    return WaitFor(timeout_ms, [detect] { return gArmed == detect; });
+}
+
+bool fp_sim_wait_keys(uint32_t count, int timeout_ms) {
+    return WaitFor(timeout_ms, [count] { return gStats.keys >= count; });
+}
+
+fp_sim_device_stats_t fp_sim_device_stats(void) {
+    std::lock_guard<std::mutex> lock(gLock);
+    return gStats;
+}
+
+int fp_sim_open(const char *path) {
+    if (!strcmp(path, FINGERPRINT_DEVICE_PATH)) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(gLock);
+            fd = fcntl(IrqFdLocked(), F_DUPFD_CLOEXEC, 0);
+        }
+        if (fd < 0)
+            return -1;
+        std::lock_guard<std::mutex> lock(gFdLock);
+        gDeviceFds.insert(fd);
+        return fd;
+    }
+
+    if (!strcmp(path, kUinputPath)) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC))
+            return -1;
+        std::thread(ReadKeys, fds[0]).detach();
+        std::lock_guard<std::mutex> lock(gFdLock);
+        gUinputFds.insert(fds[1]);
+        return fds[1];
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+bool fp_sim_owns(int fd) {
+    std::lock_guard<std::mutex> lock(gFdLock);
+    return gDeviceFds.count(fd) || gUinputFds.count(fd);
+}
+
+int fp_sim_ioctl(int fd, unsigned long request, void *arg) {
+    {
+        std::lock_guard<std::mutex> lock(gFdLock);
+        // UI_SET_*, UI_DEV_SETUP, UI_DEV_CREATE and UI_DEV_DESTROY:
+        if (gUinputFds.count(fd))
+            return 0;
+    }
+    return DeviceIoctl(request, arg);
+}
+
+void fp_sim_release(int fd) {
+    std::lock_guard<std::mutex> lock(gFdLock);
+    gDeviceFds.erase(fd);
+    gUinputFds.erase(fd);
+}
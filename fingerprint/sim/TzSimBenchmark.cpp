@@ -0,0 +1,511 @@
+/*
+ * Benchmarks the TZ-facing loops of the HALs on the host, against the
+ * emulated TZ apps and sensor of libQSEEComSim.
+ *
+ * The HIDL services themselves do not build for the host, so every session
+ * below mirrors the loop of the HAL method it is named after, on top of
+ * the same fpc_imp and EGISAPTrustlet code the HALs use. A session runs on
+ * a thread of its own, while the benchmark thread plays the user: it waits
+ * until the HAL armed finger detection, touches the sensor, and lifts the
+ * finger when the HAL waits for that.
+ *
+ * Iteration times are measured from the touch to the point the HAL reports
+ * its result. Latencies of the TZ commands are ballpark defaults, override
+ * them with measured ones through QSEECOM_SIM_LATENCY, see qseecom_sim.h.
+ *
+ * Counters are per iteration: TZ calls and the time they took, IRQs the
+ * sensor raised and wakelocks the HAL requested.
+ */
+
+#include <benchmark/benchmark.h>
+#include <qseecom_sim.h>
+
+#include "EventMultiplexer.h"
+#include "egistec/EgisFpDevice.h"
+#include "egistec/current/EGISAPTrustlet.h"
+#include "tz_api_common.h"
+
+extern "C" {
+#include "fpc_imp.h"
+}
+
+#include <hardware/fingerprint.h>
+#include <linux/input.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOG_TAG "TzSimBenchmark"
+#include <log/log.h>
+
+using namespace egistec;
+using namespace egistec::current;
+
+namespace {
+
+// Longest the user waits for the HAL before the benchmark is aborted:
+constexpr int kTimeoutMs = 5000;
+constexpr uint32_t kGid = 0;
+
+int64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Await(bool done, const char *what) {
+    LOG_ALWAYS_FATAL_IF(!done, "Timed out waiting for %s", what);
+}
+
+// Returns when the finger was put on the sensor:
+int64_t Touch() {
+    Await(fp_sim_wait_armed(FP_SIM_DETECT_DOWN, kTimeoutMs), "finger-down detection");
+    const int64_t touch_ns = NowNs();
+    fp_sim_touch(true);
+    return touch_ns;
+}
+
+void Lift() {
+    Await(fp_sim_wait_armed(FP_SIM_DETECT_LOST, kTimeoutMs), "finger-lost detection");
+    fp_sim_touch(false);
+}
+
+void Configure(uint32_t capture_retries) {
+    qseecom_sim_config_t config;
+    qseecom_sim_get_config(&config);
+    config.capture_retries = capture_retries;
+    qseecom_sim_configure(&config);
+}
+
+void ConfigureNavigation(uint32_t gesture_ms) {
+    qseecom_sim_config_t config;
+    qseecom_sim_get_config(&config);
+    config.navi_gesture_ms = gesture_ms;
+    qseecom_sim_configure(&config);
+}
+
+// CPU time of the whole process, the session thread included:
+int64_t CpuUs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+uint32_t EnrollTouches() {
+    qseecom_sim_config_t config;
+    qseecom_sim_get_config(&config);
+    return config.enroll_touches;
+}
+
+/**
+ * Counts TZ calls and sensor activity from construction until Report().
+ */
+class Counters {
+    const qseecom_sim_app_t mApp;
+    const qseecom_sim_stats_t mTz;
+    const fp_sim_device_stats_t mDevice;
+
+   public:
+    explicit Counters(qseecom_sim_app_t app)
+        : mApp(app), mTz(qseecom_sim_stats(app)), mDevice(fp_sim_device_stats()) {
+    }
+
+    void Report(benchmark::State &state) const {
+        const auto tz = qseecom_sim_stats(mApp);
+        const auto device = fp_sim_device_stats();
+        const auto avg = benchmark::Counter::kAvgIterations;
+
+        state.counters["tz_calls"] = benchmark::Counter(tz.calls - mTz.calls, avg);
+        state.counters["tz_ms"] = benchmark::Counter((tz.busy_us - mTz.busy_us) / 1000., avg);
+        state.counters["irqs"] = benchmark::Counter(device.irqs - mDevice.irqs, avg);
+        state.counters["wakelocks"] = benchmark::Counter(device.wakelocks - mDevice.wakelocks, avg);
+    }
+};
+
+/*
+ * FPC
+ */
+
+std::string DbPath() {
+    const char *tmpdir = getenv("TMPDIR");
+    return std::string(tmpdir ? tmpdir : "/tmp") + "/fingerprint-sim-" + std::to_string(getpid()) +
+           ".db";
+}
+
+/**
+ * Mirrors fpc::BiometricsFingerprint::EnrollAsync(). Records when every
+ * onEnrollResult would be sent.
+ */
+uint32_t FpcEnroll(fpc_imp_data_t *fpc, std::vector<int64_t> &results_ns) {
+    std::string db_path = DbPath();
+    uint32_t print_id = 0;
+    int status;
+
+    fpc_enroll_start(fpc, 0);
+    while ((status = fpc_capture_image(fpc)) >= 0) {
+        if (status != FINGERPRINT_ACQUIRED_GOOD)
+            continue;
+
+        uint32_t remaining_touches = 0;
+        int ret = fpc_enroll_step(fpc, &remaining_touches);
+        if (ret > 0) {
+            results_ns.push_back(NowNs());
+            continue;
+        }
+        if (!ret && fpc_enroll_end(fpc, &print_id) >= 0 &&
+            !fpc_store_user_db(fpc, &db_path[0]))
+            results_ns.push_back(NowNs());
+        break;
+    }
+
+    fpc_session_release(&fpc->event, &fpc->wakelock);
+    return print_id;
+}
+
+/**
+ * Mirrors fpc::BiometricsFingerprint::AuthenticateAsync() for a keyguard
+ * unlock, without a challenge. Returns when onAuthenticated would be sent.
+ */
+int64_t FpcAuthenticate(fpc_imp_data_t *fpc) {
+    int64_t authenticated_ns = 0;
+    int status;
+
+    fpc_auth_start(fpc);
+    while ((status = fpc_capture_image(fpc)) >= 0) {
+        if (status != FINGERPRINT_ACQUIRED_GOOD)
+            continue;
+
+        uint32_t print_id = 0;
+        if (fpc_auth_step(fpc, &print_id) < 0)
+            break;
+        if (!print_id)
+            continue;
+
+        authenticated_ns = NowNs();
+        fpc_update_template(fpc);
+        break;
+    }
+
+    fpc_session_release(&fpc->event, &fpc->wakelock);
+    return authenticated_ns;
+}
+
+/**
+ * Enrolls a print, touching the sensor as often as the TZ app asks for.
+ * Returns the touch-to-result latency of every touch.
+ */
+std::vector<int64_t> EnrollPrint(fpc_imp_data_t *fpc, uint32_t *print_id) {
+    const uint32_t touches = EnrollTouches();
+    std::vector<int64_t> touches_ns, results_ns;
+
+    std::thread session([&] { *print_id = FpcEnroll(fpc, results_ns); });
+    for (uint32_t i = 0; i < touches; ++i) {
+        touches_ns.push_back(Touch());
+        if (i + 1 < touches)
+            Lift();
+    }
+    session.join();
+    fp_sim_touch(false);
+
+    LOG_ALWAYS_FATAL_IF(results_ns.size() != touches, "Enrolled with %zu of %u touches",
+                        results_ns.size(), touches);
+    for (size_t i = 0; i < touches; ++i)
+        results_ns[i] -= touches_ns[i];
+    return results_ns;
+}
+
+fpc_imp_data_t *Fpc() {
+    static fpc_imp_data_t *fpc = [] {
+        fpc_imp_data_t *data = nullptr;
+        const int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        LOG_ALWAYS_FATAL_IF(fpc_init(&data, event_fd) < 0, "Failed to initialize FPC");
+        LOG_ALWAYS_FATAL_IF(fpc_set_power(&data->event, FPC_PWRON) < 0, "Failed to power up");
+        LOG_ALWAYS_FATAL_IF(fpc_load_empty_db(data) || fpc_set_gid(data, kGid),
+                            "Failed to set up the database");
+
+        atexit([] { unlink(DbPath().c_str()); });
+
+        uint32_t print_id;
+        EnrollPrint(data, &print_id);
+        LOG_ALWAYS_FATAL_IF(!print_id, "Failed to enroll a print");
+        return data;
+    }();
+    return fpc;
+}
+
+void BM_FpcAuthenticate(benchmark::State &state) {
+    auto *fpc = Fpc();
+    Configure(state.range(0));
+    Counters counters(QSEECOM_SIM_APP_FPC);
+
+    for (auto _ : state) {
+        int64_t authenticated_ns = 0;
+        std::thread session([&] { authenticated_ns = FpcAuthenticate(fpc); });
+        const int64_t touch_ns = Touch();
+        session.join();
+        fp_sim_touch(false);
+
+        LOG_ALWAYS_FATAL_IF(!authenticated_ns, "Authentication failed");
+        state.SetIterationTime((authenticated_ns - touch_ns) / 1e9);
+    }
+
+    counters.Report(state);
+}
+// The argument is the number of captures that ask for more data:
+BENCHMARK(BM_FpcAuthenticate)->Arg(0)->Arg(1)->Arg(3)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+/**
+ * Authentication with wake-on-finger: the wake key is clicked at
+ * finger-down instead of the display powering up after onAuthenticated.
+ * display_lead_ms is how much earlier the display starts powering up,
+ * which is what a touch-to-first-frame measurement gains as long as the
+ * panel takes at least that long to power up.
+ */
+void BM_FpcAuthenticateWakeOnFinger(benchmark::State &state) {
+    auto *fpc = Fpc();
+    Configure(state.range(0));
+    Counters counters(QSEECOM_SIM_APP_FPC);
+    int64_t wake_key_ns = 0, display_lead_ns = 0;
+
+    fpc->wake_on_finger = true;
+    for (auto _ : state) {
+        int64_t authenticated_ns = 0;
+        std::thread session([&] { authenticated_ns = FpcAuthenticate(fpc); });
+        const int64_t touch_ns = Touch();
+        session.join();
+        fp_sim_touch(false);
+
+        const int64_t key_ns = fpc->capture_timing.wake_key_ns;
+        LOG_ALWAYS_FATAL_IF(!authenticated_ns || !key_ns, "Authentication failed");
+        state.SetIterationTime((authenticated_ns - touch_ns) / 1e9);
+        wake_key_ns += key_ns - touch_ns;
+        display_lead_ns += authenticated_ns - key_ns;
+    }
+    fpc->wake_on_finger = false;
+
+    counters.Report(state);
+    const auto avg = benchmark::Counter::kAvgIterations;
+    state.counters["wake_key_ms"] = benchmark::Counter(wake_key_ns / 1e6, avg);
+    state.counters["display_lead_ms"] = benchmark::Counter(display_lead_ns / 1e6, avg);
+}
+BENCHMARK(BM_FpcAuthenticateWakeOnFinger)->Arg(0)->Arg(1)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+void BM_FpcEnroll(benchmark::State &state) {
+    auto *fpc = Fpc();
+    Configure(0);
+    Counters counters(QSEECOM_SIM_APP_FPC);
+    int64_t touches = 0;
+
+    for (auto _ : state) {
+        uint32_t print_id;
+        int64_t total_ns = 0;
+        for (auto latency_ns : EnrollPrint(fpc, &print_id)) {
+            total_ns += latency_ns;
+            ++touches;
+        }
+        state.SetIterationTime(total_ns / 1e9);
+
+        state.PauseTiming();
+        fpc_del_print_id(fpc, print_id);
+        state.ResumeTiming();
+    }
+
+    counters.Report(state);
+    state.counters["touches"] = benchmark::Counter(touches, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_FpcEnroll)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+/**
+ * A finger resting on the sensor that never gives enough data, like an
+ * accidental touch: the TZ load of one capture session, from the touch
+ * until fpc_capture_image() gives up with INSUFFICIENT.
+ */
+void BM_FpcCaptureInsufficient(benchmark::State &state) {
+    auto *fpc = Fpc();
+    Configure(UINT32_MAX);
+    Counters counters(QSEECOM_SIM_APP_FPC);
+
+    for (auto _ : state) {
+        int status = -1;
+        std::thread session([&] { status = fpc_capture_image(fpc); });
+        const int64_t touch_ns = Touch();
+        session.join();
+        state.SetIterationTime((NowNs() - touch_ns) / 1e9);
+        fpc_session_release(&fpc->event, &fpc->wakelock);
+        fp_sim_touch(false);
+
+        LOG_ALWAYS_FATAL_IF(status != FINGERPRINT_ACQUIRED_INSUFFICIENT,
+                            "Capture ended with %d", status);
+        // Don't let the spurious captures back off detection:
+        irq_filter_report(&fpc->event.irq, 1);
+    }
+
+    counters.Report(state);
+}
+BENCHMARK(BM_FpcCaptureInsufficient)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+/**
+ * One gesture per iteration, from the touch to the key the HAL clicks.
+ */
+void BM_FpcNavigation(benchmark::State &state) {
+    auto *fpc = Fpc();
+    Counters counters(QSEECOM_SIM_APP_FPC);
+
+    LOG_ALWAYS_FATAL_IF(fpc_navi_enter(fpc), "Failed to enter navigation");
+    std::thread session([fpc] { fpc_navi_poll(fpc); });
+
+    for (auto _ : state) {
+        const uint32_t keys = fp_sim_device_stats().keys;
+        const int64_t touch_ns = Touch();
+        Await(fp_sim_wait_keys(keys + 1, kTimeoutMs), "a navigation key");
+        state.SetIterationTime((NowNs() - touch_ns) / 1e9);
+        fp_sim_touch(false);
+    }
+
+    // Leave navigation like a state request does:
+    eventfd_write(fpc->event.event_fd, 1);
+    session.join();
+    eventfd_t value;
+    eventfd_read(fpc->event.event_fd, &value);
+    fpc_navi_exit(fpc);
+
+    counters.Report(state);
+}
+BENCHMARK(BM_FpcNavigation)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+/**
+ * A finger resting on the sensor during navigation, without a gesture:
+ * the cost of fpc_navi_poll() per second of contact.
+ */
+void BM_FpcNavigationRest(benchmark::State &state) {
+    auto *fpc = Fpc();
+    qseecom_sim_config_t config;
+    qseecom_sim_get_config(&config);
+    ConfigureNavigation(UINT32_MAX);
+
+    LOG_ALWAYS_FATAL_IF(fpc_navi_enter(fpc), "Failed to enter navigation");
+    std::thread session([fpc] { fpc_navi_poll(fpc); });
+
+    Counters counters(QSEECOM_SIM_APP_FPC);
+    const int64_t cpu_us = CpuUs();
+    for (auto _ : state) {
+        Touch();
+        usleep(1000000);
+        fp_sim_touch(false);
+    }
+    state.counters["cpu_ms"] =
+        benchmark::Counter((CpuUs() - cpu_us) / 1000., benchmark::Counter::kAvgIterations);
+    counters.Report(state);
+
+    eventfd_write(fpc->event.event_fd, 1);
+    session.join();
+    eventfd_t value;
+    eventfd_read(fpc->event.event_fd, &value);
+    fpc_navi_exit(fpc);
+
+    qseecom_sim_configure(&config);
+}
+BENCHMARK(BM_FpcNavigationRest)->Unit(benchmark::kMillisecond)->Iterations(3);
+
+/*
+ * Egistec
+ */
+
+struct Egis {
+    EGISAPTrustlet trustlet;
+    EgisFpDevice dev;
+    const int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    EventMultiplexer mux{dev.GetFd(), event_fd, ET51X_IOCRIRQPOLL};
+
+    Egis() {
+        MasterKey key = QSEEKeymasterTrustlet().GetKey();
+        dev.Enable();
+        LOG_ALWAYS_FATAL_IF(trustlet.SetMasterKey(key) || trustlet.InitializeSensor() ||
+                                trustlet.InitializeAlgo(),
+                            "Failed to initialize EGISAP");
+        Seed();
+    }
+
+    /**
+     * Enrolls a print with the finger kept on the sensor, without waiting
+     * for IRQs like the HAL does.
+     */
+    void Seed() {
+        enroll_result_t result = {};
+        ImageResult image;
+
+        fp_sim_touch(true);
+        LOG_ALWAYS_FATAL_IF(trustlet.InitializeEnroll(), "Failed to start enrolling");
+        while (result.percentage < 100)
+            LOG_ALWAYS_FATAL_IF(trustlet.GetImage(image) || trustlet.Enroll(kGid, 0, result),
+                                "Failed to enroll");
+        LOG_ALWAYS_FATAL_IF(trustlet.SaveEnrolledPrint(kGid, 1) || trustlet.FinalizeEnroll(),
+                            "Failed to save the print");
+        fp_sim_touch(false);
+    }
+};
+
+/**
+ * Mirrors egistec::current::BiometricsFingerprint::AuthenticateAsync() up
+ * to the first match. Returns when onAuthenticated would be sent.
+ */
+int64_t EgisAuthenticate(Egis &egis) {
+    auto &trustlet = egis.trustlet;
+    int64_t authenticated_ns = 0;
+    identify_result_t result;
+    ImageResult image;
+    bool updated;
+
+    LOG_ALWAYS_FATAL_IF(trustlet.InitializeIdentify(), "Failed to start identifying");
+    while (!trustlet.SetWorkMode(WorkMode::Detect)) {
+        if (egis.mux.waitForEvent() != WakeupReason::Finger)
+            break;
+        if (trustlet.GetImage(image))
+            break;
+        egis.mux.reportCapture(image != ImageResult::Nothing);
+        if (image != ImageResult::Good)
+            continue;
+
+        if (trustlet.Identify(kGid, 0, result) || !result.status || result.status >= 3)
+            break;
+
+        authenticated_ns = NowNs();
+        if (!trustlet.UpdateTemplate(updated) && updated)
+            trustlet.SaveTemplate();
+        break;
+    }
+
+    trustlet.SetSpiState(0);
+    trustlet.FinalizeIdentify();
+    return authenticated_ns;
+}
+
+void BM_EgisAuthenticate(benchmark::State &state) {
+    static Egis egis;
+    Counters counters(QSEECOM_SIM_APP_EGIS);
+
+    for (auto _ : state) {
+        int64_t authenticated_ns = 0;
+        std::thread session([&] { authenticated_ns = EgisAuthenticate(egis); });
+        const int64_t touch_ns = Touch();
+        session.join();
+        fp_sim_touch(false);
+
+        LOG_ALWAYS_FATAL_IF(!authenticated_ns, "Authentication failed");
+        state.SetIterationTime((authenticated_ns - touch_ns) / 1e9);
+    }
+
+    counters.Report(state);
+}
+BENCHMARK(BM_EgisAuthenticate)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,84 @@
+/*
+ * Routes the device nodes of the fingerprint sensor and uinput to the
+ * simulated sensor of libQSEEComSim, see qseecom_sim.h.
+ *
+ * Linked into the executable, these definitions take precedence over those
+ * of libc for the executable and the libraries it loads. Every other path
+ * and fd is passed through.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <qseecom_sim.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define REAL(name)                                                    \
+    ({                                                                \
+        static __typeof__(name) *real_##name;                         \
+        if (!real_##name)                                             \
+            real_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name); \
+        real_##name;                                                  \
+    })
+
+static int open_mode(int flags, va_list args)
+{
+    return flags & (O_CREAT | O_TMPFILE) ? va_arg(args, int) : 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list args;
+    int mode, fd;
+
+    va_start(args, flags);
+    mode = open_mode(flags, args);
+    va_end(args);
+
+    fd = fp_sim_open(path);
+    if (fd >= 0 || errno != ENOENT)
+        return fd;
+    return REAL(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list args;
+    int mode, fd;
+
+    va_start(args, flags);
+    mode = open_mode(flags, args);
+    va_end(args);
+
+    fd = fp_sim_open(path);
+    if (fd >= 0 || errno != ENOENT)
+        return fd;
+    return REAL(open64)(path, flags, mode);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    void *arg;
+
+    va_start(args, request);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    if (fp_sim_owns(fd))
+        return fp_sim_ioctl(fd, request, arg);
+    return REAL(ioctl)(fd, request, arg);
+}
+
+int close(int fd)
+{
+    if (fp_sim_owns(fd))
+        fp_sim_release(fd);
+    return REAL(close)(fd);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Host stand-in for libion, implemented by libQSEEComSim (ion_sim.c).
+ * ion_alloc_fd() returns the fd of an unlinked temporary file that can be
+ * mapped like an ION buffer, and passed to the simulated TZ apps.
+ */
+
+int ion_open(void);
+int ion_close(int fd);
+int ion_alloc_fd(int fd, size_t len, size_t align, unsigned int heap_mask, unsigned int flags,
+                 int *handle_fd);
+
+__END_DECLS
@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ * Host stand-in for the msm ION UAPI, with just what ion_buffer.c and
+ * IonBuffer.h use. Buffers are backed by files, see ion_sim.c.
+ */
+
+#define ION_QSECOM_HEAP_ID 27
+#define ION_HEAP(bit) (1U << (bit))
+
+typedef int ion_user_handle_t;
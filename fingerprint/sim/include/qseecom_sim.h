@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Host-side stand-in for libQSEEComAPI.so and the fingerprint sensor.
+ *
+ * libQSEEComSim exports the QSEECom_* entry points that QSEEComFunc.c and
+ * QSEETrustlet.cpp dlopen, and emulates the FPC (tama), EGISAP and
+ * keymaster TZ apps on top of a simulated sensor. Every command blocks the
+ * caller for its configured latency, like a call into the TZ does, and is
+ * counted per app.
+ *
+ * The sensor is exposed through a fake FINGERPRINT_DEVICE_PATH: an eventfd
+ * that is readable while the IRQ line is high, and answers the ioctls of
+ * the FPC and ET51X drivers. /dev/uinput is faked as well, to observe the
+ * keys the HAL clicks. fake_device.c routes open(), ioctl() and close() of
+ * a process to fp_sim_open(), fp_sim_ioctl() and fp_sim_release().
+ */
+
+// The TZ apps that are emulated:
+typedef enum {
+    QSEECOM_SIM_APP_FPC,
+    QSEECOM_SIM_APP_EGIS,
+    QSEECOM_SIM_APP_KEYMASTER,
+    QSEECOM_SIM_APP_COUNT,
+} qseecom_sim_app_t;
+
+/**
+ * Set the latency of a command, in us. FPC commands are identified by
+ * their group and command id, EGISAP and keymaster commands by their
+ * command id with a group of 0. A \p cmd of -1 sets the latency of every
+ * command of \p app that has none of its own.
+ *
+ * Latencies are also read from QSEECOM_SIM_LATENCY in the environment, a
+ * comma separated list of app:group:cmd=us or app:*=us entries, where app
+ * is one of fpc, egis or keymaster. Numbers may be given in hex.
+ */
+void qseecom_sim_set_latency(qseecom_sim_app_t app, uint32_t group, int32_t cmd, uint32_t us);
+
+typedef struct {
+    // Commands sent to the app, and the time they blocked the caller:
+    uint64_t calls;
+    uint64_t busy_us;
+} qseecom_sim_stats_t;
+
+qseecom_sim_stats_t qseecom_sim_stats(qseecom_sim_app_t app);
+
+/**
+ * Behaviour of the emulated fingerprint TZ apps.
+ */
+typedef struct {
+    // FPC captures that ask for more data before the image is good:
+    uint32_t capture_retries;
+    // Touches needed to enroll a print:
+    uint32_t enroll_touches;
+    // Whether a captured finger matches the first enrolled print:
+    bool match;
+    // Whether a matching identify updates the template:
+    bool template_update;
+    // Finger contact in ms before navigation reports a gesture, like the
+    // duration of a swipe, and the FPC_GESTURE_* that is reported. A
+    // finger that rests longer is only reported once:
+    uint32_t navi_gesture_ms;
+    uint32_t navi_gesture;
+} qseecom_sim_config_t;
+
+void qseecom_sim_configure(const qseecom_sim_config_t *config);
+void qseecom_sim_get_config(qseecom_sim_config_t *config);
+
+typedef enum {
+    FP_SIM_DETECT_NONE,
+    FP_SIM_DETECT_DOWN,
+    FP_SIM_DETECT_LOST,
+} fp_sim_detect_t;
+
+/**
+ * Put a finger on the sensor, or lift it. Raises the IRQ when the TZ app
+ * armed detection for the new state.
+ */
+void fp_sim_touch(bool down);
+/**
+ * Wait until the TZ app arms detection of \p detect, like a user that waits
+ * for the HAL to be ready before touching or lifting.
+ *
+ * @return false when \p timeout_ms passes first.
+ */
+bool fp_sim_wait_armed(fp_sim_detect_t detect, int timeout_ms);
+/**
+ * Wait until the HAL clicked \p count keys on the fake uinput device since
+ * the process started.
+ *
+ * @return false when \p timeout_ms passes first.
+ */
+bool fp_sim_wait_keys(uint32_t count, int timeout_ms);
+
+typedef struct {
+    // Times the IRQ line was raised, and ioctls on the device:
+    uint32_t irqs;
+    uint32_t ioctls;
+    // Wakelock requests, and the longest timeout requested, in ms:
+    uint32_t wakelocks;
+    uint32_t wakelock_max_ms;
+    // Keys clicked on the fake uinput device:
+    uint32_t keys;
+    bool powered;
+} fp_sim_device_stats_t;
+
+fp_sim_device_stats_t fp_sim_device_stats(void);
+
+/**
+ * Hooks for fake_device.c.
+ *
+ * fp_sim_open() returns a new fd for a simulated device node, or -1 with
+ * errno set to ENOENT when \p path is not simulated. fp_sim_owns() tells
+ * whether \p fd was returned by it. fp_sim_release() forgets \p fd before
+ * the caller closes it.
+ */
+int fp_sim_open(const char *path);
+bool fp_sim_owns(int fd);
+int fp_sim_ioctl(int fd, unsigned long request, void *arg);
+void fp_sim_release(int fd);
+
+__END_DECLS
@@ -0,0 +1,55 @@
+#include <ion/ion.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "QSEEComSim ION"
+#include <log/log.h>
+
+int ion_open(void)
+{
+    // Only used as a handle, every buffer is a file of its own:
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int ion_close(int fd)
+{
+    return close(fd);
+}
+
+int ion_alloc_fd(int fd, size_t len, size_t align, unsigned int heap_mask, unsigned int flags,
+                 int *handle_fd)
+{
+    char path[PATH_MAX];
+    const char *tmpdir = getenv("TMPDIR");
+    int buffer_fd;
+
+    (void)fd;
+    (void)align;
+    (void)heap_mask;
+    (void)flags;
+
+    snprintf(path, sizeof(path), "%s/qseecom-sim-ion-XXXXXX", tmpdir ? tmpdir : "/tmp");
+    buffer_fd = mkstemp(path);
+    if (buffer_fd < 0) {
+        ALOGE("Failed to create %s: %s", path, strerror(errno));
+        return -errno;
+    }
+    unlink(path);
+    fcntl(buffer_fd, F_SETFD, FD_CLOEXEC);
+
+    if (ftruncate(buffer_fd, len)) {
+        int rc = -errno;
+        ALOGE("Failed to size ION buffer to %zu bytes: %s", len, strerror(errno));
+        close(buffer_fd);
+        return rc;
+    }
+
+    *handle_fd = buffer_fd;
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Stress test for the tail latency of cancel() with several binder threads.
+ *
+ * Models the HALs: serialized calls (slow ones like remove(), and
+ * authenticate()) hold HalCallSerializer from a pool of threads, while
+ * cancel() bypasses it and only queues a state request for the worker.
+ * cancel() must never end up waiting for the serialized calls.
+ */
+
+#include "HalCallSerializer.h"
+#include "SynchronizedWorkerThread.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace ::SynchronizedWorker;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Binder threads busy with serialized calls, next to the one cancelling:
+constexpr auto serialized_threads = 3;
+// Like a remove() or setActiveGroup() that stores the database:
+constexpr auto slow_call = 40ms;
+constexpr auto cancel_count = 200;
+
+struct FakeHal : public WorkHandler {
+    HalCallSerializer mCalls;
+    Thread mWt{this};
+    std::atomic<bool> mAuthenticating{false};
+
+    FakeHal() {
+        mWt.Start();
+    }
+
+    ~FakeHal() {
+        mWt.Stop();
+    }
+
+    Thread &getWorker() override {
+        return mWt;
+    }
+
+    void AuthenticateAsync() override {
+        mAuthenticating = true;
+        mWt.isEventAvailable(-1);
+        mAuthenticating = false;
+    }
+
+    void EnrollAsync() override {
+        mWt.isEventAvailable(-1);
+    }
+
+    void SlowCall() {
+        auto call = mCalls.Enter();
+        std::this_thread::sleep_for(slow_call);
+    }
+
+    void Authenticate() {
+        auto call = mCalls.Enter();
+        mWt.waitForState(AsyncState::Authenticate);
+    }
+
+    void Cancel() {
+        auto call = mCalls.Bypass();
+        mWt.Resume();
+    }
+};
+
+}  // namespace
+
+TEST(HalCallSerializerTest, CancelDoesNotWaitForSerializedCalls) {
+    FakeHal hal;
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < serialized_threads; ++i)
+        threads.emplace_back([&, i] {
+            while (!stop) {
+                if (i % 2)
+                    hal.Authenticate();
+                else
+                    hal.SlowCall();
+            }
+        });
+
+    std::vector<std::chrono::steady_clock::duration> latencies;
+    for (int i = 0; i < cancel_count; ++i) {
+        std::this_thread::sleep_for(2ms);
+        const auto begin = std::chrono::steady_clock::now();
+        hal.Cancel();
+        latencies.push_back(std::chrono::steady_clock::now() - begin);
+    }
+
+    stop = true;
+    hal.mWt.Resume();
+    for (auto &thread : threads)
+        thread.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto us = [](auto d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    const auto p50 = latencies[latencies.size() / 2];
+    const auto p99 = latencies[latencies.size() * 99 / 100];
+    printf("cancel() latency: p50 %lldus, p99 %lldus, max %lldus\n",
+           static_cast<long long>(us(p50)), static_cast<long long>(us(p99)),
+           static_cast<long long>(us(latencies.back())));
+
+    // A cancel() that queued behind a serialized call would take up to
+    // serialized_threads * slow_call:
+    EXPECT_LT(p99, slow_call / 2);
+}
+
+// The worker leaves the operation promptly after cancel(), while the
+// serialized calls keep coming.
+TEST(HalCallSerializerTest, CancelStopsAuthenticationUnderLoad) {
+    FakeHal hal;
+    std::atomic<bool> stop{false};
+
+    std::thread slow([&] {
+        while (!stop)
+            hal.SlowCall();
+    });
+
+    for (int i = 0; i < 20; ++i) {
+        hal.Authenticate();
+        auto deadline = std::chrono::steady_clock::now() + slow_call;
+        while (!hal.mAuthenticating && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::yield();
+        EXPECT_TRUE(hal.mAuthenticating) << "round " << i;
+
+        hal.Cancel();
+        deadline = std::chrono::steady_clock::now() + slow_call / 2;
+        while (hal.mAuthenticating && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::yield();
+        EXPECT_FALSE(hal.mAuthenticating) << "round " << i;
+    }
+
+    stop = true;
+    slow.join();
+}
@@ -0,0 +1,140 @@
+/*
+ * Microbenchmark of the state handoff of SynchronizedWorker::Thread:
+ * round trips through Pause() and Resume() like enumerate() and remove()
+ * do, and how long the worker takes to leave an operation after cancel().
+ *
+ * Only the public interface that the original mutex-based implementation
+ * had as well is used, so the numbers can be compared against it.
+ */
+
+#include "SynchronizedWorkerThread.h"
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace ::SynchronizedWorker;
+
+namespace {
+
+// Context switches of the whole process, worker included:
+long ContextSwitches() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+void ReportContextSwitches(benchmark::State &state, long begin) {
+    state.counters["switches"] =
+        benchmark::Counter(ContextSwitches() - begin, benchmark::Counter::kAvgIterations);
+}
+
+struct BenchHandler : public WorkHandler {
+    Thread mWt{this};
+    std::atomic<AsyncState> mActive{AsyncState::Invalid};
+    // Idle like the Egistec HALs, or the FPC HAL while navigating: not in
+    // waitForStateRequest(), so every pause is handed to the worker:
+    const bool mBusyIdle;
+
+    BenchHandler(bool busy_idle = false) : mBusyIdle(busy_idle) {
+        mWt.Start();
+    }
+
+    ~BenchHandler() {
+        mWt.Stop();
+    }
+
+    Thread &getWorker() override {
+        return mWt;
+    }
+
+    void Run(AsyncState state) {
+        mActive = state;
+        mWt.isEventAvailable(-1);
+    }
+
+    void IdleAsync() override {
+        mActive = AsyncState::Idle;
+        if (mBusyIdle)
+            mWt.isEventAvailable(-1);
+        else
+            WorkHandler::IdleAsync();
+    }
+
+    void AuthenticateAsync() override {
+        Run(AsyncState::Authenticate);
+    }
+
+    void EnrollAsync() override {
+        Run(AsyncState::Enroll);
+    }
+
+    void WaitActive(AsyncState state) {
+        while (mActive != state)
+            std::this_thread::yield();
+    }
+};
+
+// Pause() waits for the worker, Resume() does not; both are one transition.
+// With an argument of 1, the worker is busy while idle:
+void BM_PauseResume(benchmark::State &state) {
+    BenchHandler handler(state.range(0));
+    handler.WaitActive(AsyncState::Idle);
+
+    const auto switches = ContextSwitches();
+    for (auto _ : state) {
+        handler.mWt.Pause();
+        handler.mWt.Resume();
+    }
+    handler.WaitActive(AsyncState::Idle);
+    ReportContextSwitches(state, switches);
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_PauseResume)->Arg(0)->Arg(1);
+
+// From cancel() to the worker running IdleAsync() again:
+void BM_CancelToIdle(benchmark::State &state) {
+    BenchHandler handler;
+
+    const auto switches = ContextSwitches();
+    for (auto _ : state) {
+        handler.mWt.waitForState(AsyncState::Authenticate);
+        handler.WaitActive(AsyncState::Authenticate);
+
+        const auto begin = std::chrono::steady_clock::now();
+        handler.mWt.Resume();
+        handler.WaitActive(AsyncState::Idle);
+        state.SetIterationTime(
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+    ReportContextSwitches(state, switches);
+}
+BENCHMARK(BM_CancelToIdle)->UseManualTime();
+
+// The framework restarting authentication: authenticate(), cancel() and
+// authenticate() back to back, until the worker authenticates again.
+void BM_AuthenticateCancelBurst(benchmark::State &state) {
+    BenchHandler handler;
+
+    const auto switches = ContextSwitches();
+    for (auto _ : state) {
+        handler.mWt.moveToState(AsyncState::Authenticate);
+        handler.mWt.Resume();
+        handler.mWt.waitForState(AsyncState::Authenticate);
+        handler.WaitActive(AsyncState::Authenticate);
+
+        state.PauseTiming();
+        handler.mWt.Resume();
+        handler.WaitActive(AsyncState::Idle);
+        state.ResumeTiming();
+    }
+    ReportContextSwitches(state, switches);
+}
+BENCHMARK(BM_AuthenticateCancelBurst);
+
+}  // namespace
+
+BENCHMARK_MAIN();
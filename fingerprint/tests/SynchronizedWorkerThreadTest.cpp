@@ -0,0 +1,366 @@
+/*
+ * Stress tests for the state request queue of SynchronizedWorker::Thread.
+ *
+ * Several producers race state requests and posted work against the
+ * worker, and the worker must always settle in the last requested state.
+ * Meant to be run under TSan as well (see Android.bp).
+ */
+
+#include "SynchronizedWorkerThread.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace ::SynchronizedWorker;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr auto producer_count = 4;
+constexpr auto settle_timeout = 2s;
+
+template <typename Predicate>
+bool WaitFor(Predicate predicate, std::chrono::milliseconds timeout = settle_timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!predicate()) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+struct TestHandler : public WorkHandler {
+    Thread mWt{this};
+    std::atomic<AsyncState> mActive{AsyncState::Idle};
+    std::atomic<uint32_t> mEntered{0};
+    std::atomic<uint32_t> mIdle{0};
+
+    Thread &getWorker() override {
+        return mWt;
+    }
+
+    // Like the HALs: run until anything interrupts the operation.
+    void Run(AsyncState state) {
+        ++mEntered;
+        mActive = state;
+        mWt.isEventAvailable(-1);
+        mActive = AsyncState::Idle;
+    }
+
+    void IdleAsync() override {
+        ++mIdle;
+        WorkHandler::IdleAsync();
+    }
+
+    void AuthenticateAsync() override {
+        Run(AsyncState::Authenticate);
+    }
+
+    void EnrollAsync() override {
+        Run(AsyncState::Enroll);
+    }
+
+    // Requests that raced with the worker may still restart the operation,
+    // but it must end up staying in it:
+    bool Settled(AsyncState state) {
+        const auto deadline = std::chrono::steady_clock::now() + settle_timeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (mActive != state) {
+                std::this_thread::yield();
+                continue;
+            }
+            const uint32_t entered = mEntered;
+            std::this_thread::sleep_for(2ms);
+            if (mActive == state && mEntered == entered)
+                return true;
+        }
+        return false;
+    }
+};
+
+// Starts the worker once the handler is fully constructed, and stops it
+// before the handler is torn down, so it never calls into a partial object:
+template <typename Handler>
+struct Running : public Handler {
+    Running() {
+        this->mWt.Start();
+    }
+
+    ~Running() {
+        this->mWt.Stop();
+    }
+};
+
+template <typename Producer>
+void RunProducers(Producer producer) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < producer_count; ++i)
+        threads.emplace_back([&, i] {
+            while (!go)
+                std::this_thread::yield();
+            producer(i);
+        });
+    go = true;
+    for (auto &thread : threads)
+        thread.join();
+}
+
+}  // namespace
+
+// A burst of identical requests from several threads must never pass through
+// Idle: every request is counted before the worker can consume it, so the
+// worker is never woken up for a request it consumed already.
+TEST(SynchronizedWorkerThreadTest, ConcurrentRequestsAreNotLost) {
+    Running<TestHandler> handler;
+    ASSERT_TRUE(WaitFor([&] { return handler.mIdle == 1; }));
+
+    for (uint32_t round = 0; round < 500; ++round) {
+        RunProducers([&](int) {
+            for (int i = 0; i < 3; ++i)
+                ASSERT_TRUE(handler.mWt.moveToState(AsyncState::Authenticate));
+        });
+
+        ASSERT_TRUE(handler.Settled(AsyncState::Authenticate)) << "round " << round;
+        ASSERT_EQ(handler.mIdle, round + 1) << "Stale wakeup in round " << round;
+
+        ASSERT_TRUE(handler.mWt.Resume());
+        ASSERT_TRUE(WaitFor([&] { return handler.mIdle == round + 2; }));
+    }
+}
+
+// Random mixes of requests, waited and not, always settle in the state that
+// was requested last.
+TEST(SynchronizedWorkerThreadTest, MixedRequestsSettleInLastState) {
+    Running<TestHandler> handler;
+
+    for (int round = 0; round < 200; ++round) {
+        RunProducers([&](int id) {
+            std::minstd_rand rand(round * producer_count + id);
+            for (int i = 0; i < 8; ++i) {
+                switch (rand() % 5) {
+                    case 0:
+                        handler.mWt.moveToState(AsyncState::Authenticate);
+                        break;
+                    case 1:
+                        handler.mWt.moveToState(AsyncState::Enroll);
+                        break;
+                    case 2:
+                        handler.mWt.Resume();
+                        break;
+                    case 3:
+                        // May be cancelled out by a concurrent Resume():
+                        handler.mWt.Pause();
+                        break;
+                    case 4:
+                        handler.mWt.waitForState(AsyncState::Enroll);
+                        break;
+                }
+            }
+        });
+
+        ASSERT_TRUE(handler.mWt.waitForState(AsyncState::Enroll));
+        ASSERT_TRUE(handler.Settled(AsyncState::Enroll)) << "round " << round;
+
+        ASSERT_TRUE(handler.mWt.moveToState(AsyncState::Authenticate));
+        ASSERT_TRUE(handler.Settled(AsyncState::Authenticate)) << "round " << round;
+    }
+}
+
+// Posted work always runs, also while other threads keep changing states,
+// and a later request still wins.
+TEST(SynchronizedWorkerThreadTest, PostedWorkCompletesUnderStateChanges) {
+    Running<TestHandler> handler;
+    std::atomic<uint32_t> ran{0};
+    constexpr auto posts_per_producer = 200;
+
+    RunProducers([&](int id) {
+        for (int i = 0; i < posts_per_producer; ++i) {
+            if (id % 2)
+                handler.mWt.post([&] { ++ran; }).get();
+            else
+                handler.mWt.moveToState(i % 2 ? AsyncState::Authenticate : AsyncState::Idle);
+        }
+    });
+
+    EXPECT_EQ(ran, producer_count / 2 * posts_per_producer);
+
+    ASSERT_TRUE(handler.mWt.moveToState(AsyncState::Authenticate));
+    EXPECT_TRUE(handler.Settled(AsyncState::Authenticate));
+}
+
+namespace {
+
+// Offers posted work a chance to run while authenticating or enrolling,
+// like the FPC HAL does while it waits for the sensor:
+struct InlineHandler : public TestHandler {
+    void Run(AsyncState state) {
+        ++mEntered;
+        mActive = state;
+        while (!(mWt.isEventAvailable(-1) && mWt.runPosted()))
+            ;
+        mActive = AsyncState::Idle;
+    }
+
+    void AuthenticateAsync() override {
+        Run(AsyncState::Authenticate);
+    }
+
+    void EnrollAsync() override {
+        Run(AsyncState::Enroll);
+    }
+};
+
+}  // namespace
+
+// Posted work waits for an operation to end, unless it is meant to
+// cancel it. Deferred work runs before the next operation starts.
+TEST(SynchronizedWorkerThreadTest, PostedWorkWaitsForOperation) {
+    Running<InlineHandler> handler;
+
+    ASSERT_TRUE(handler.mWt.waitForState(AsyncState::Authenticate));
+    ASSERT_TRUE(handler.Settled(AsyncState::Authenticate));
+    const uint32_t entered = handler.mEntered;
+
+    auto deferred = handler.mWt.post([] { return 1; });
+    EXPECT_EQ(deferred.wait_for(50ms), std::future_status::timeout);
+    EXPECT_EQ(handler.mActive, AsyncState::Authenticate);
+    EXPECT_EQ(handler.mEntered, entered);
+
+    // Straight into the next operation, without going idle in between:
+    ASSERT_TRUE(handler.mWt.waitForState(AsyncState::Enroll));
+    EXPECT_EQ(deferred.get(), 1);
+    ASSERT_TRUE(handler.Settled(AsyncState::Enroll));
+
+    EXPECT_EQ(handler.mWt.post([] { return 2; }, WhenBusy::Cancel).get(), 2);
+    EXPECT_TRUE(WaitFor([&] { return handler.mActive == AsyncState::Idle; }));
+}
+
+namespace {
+
+// Checks for requests in between captures, while it is not waiting for
+// the eventfd, like the FPC HAL does after every fpc_capture_image():
+struct CaptureLoopHandler : public TestHandler {
+    void Run(AsyncState state) {
+        ++mEntered;
+        mActive = state;
+        do
+            std::this_thread::sleep_for(1ms);
+        while (!mWt.runPosted());
+        mActive = AsyncState::Idle;
+    }
+
+    void AuthenticateAsync() override {
+        Run(AsyncState::Authenticate);
+    }
+
+    void EnrollAsync() override {
+        Run(AsyncState::Enroll);
+    }
+};
+
+}  // namespace
+
+// Work posted while the handler is busy in between waits neither ends
+// the operation nor runs in it, a state request ends it.
+TEST(SynchronizedWorkerThreadTest, PostedWorkDoesNotCancelCaptureLoop) {
+    Running<CaptureLoopHandler> handler;
+
+    ASSERT_TRUE(handler.mWt.waitForState(AsyncState::Authenticate));
+    ASSERT_TRUE(handler.Settled(AsyncState::Authenticate));
+    const uint32_t entered = handler.mEntered;
+
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 20; ++i)
+        results.push_back(handler.mWt.post([i] { return i; }));
+    std::this_thread::sleep_for(50ms);
+    for (auto &result : results)
+        EXPECT_EQ(result.wait_for(0ms), std::future_status::timeout);
+    EXPECT_EQ(handler.mActive, AsyncState::Authenticate);
+    EXPECT_EQ(handler.mEntered, entered);
+
+    ASSERT_TRUE(handler.mWt.Resume());
+    for (int i = 0; i < 20; ++i)
+        EXPECT_EQ(results[i].get(), i);
+    EXPECT_TRUE(WaitFor([&] { return handler.mActive == AsyncState::Idle; }));
+}
+
+namespace {
+
+// Waits for requests in short slices, like the FPC HAL does before it
+// navigates, and counts the slices that ran out:
+struct SlicedIdleHandler : public TestHandler {
+    std::atomic<uint32_t> mTimeouts{0};
+
+    void IdleAsync() override {
+        ++mIdle;
+        while (!mWt.waitForStateRequest(5))
+            ++mTimeouts;
+    }
+};
+
+}  // namespace
+
+// A worker that is paused while it waits for requests sits out its
+// timeouts and posted work until Resume(), a state request ends the pause.
+TEST(SynchronizedWorkerThreadTest, PauseWhileWaitingHoldsWorker) {
+    Running<SlicedIdleHandler> handler;
+    ASSERT_TRUE(WaitFor([&] { return handler.mTimeouts > 0; }));
+
+    for (int round = 0; round < 3; ++round) {
+        ASSERT_TRUE(handler.mWt.Pause());
+        const uint32_t timeouts = handler.mTimeouts;
+        auto result = handler.mWt.post([round] { return round; });
+        EXPECT_EQ(result.wait_for(30ms), std::future_status::timeout);
+        EXPECT_EQ(handler.mTimeouts, timeouts);
+
+        ASSERT_TRUE(handler.mWt.Resume());
+        EXPECT_EQ(result.get(), round);
+        EXPECT_TRUE(WaitFor([&] { return handler.mTimeouts > timeouts; }));
+    }
+
+    ASSERT_TRUE(handler.mWt.Pause());
+    ASSERT_TRUE(handler.mWt.waitForState(AsyncState::Authenticate));
+    EXPECT_TRUE(handler.Settled(AsyncState::Authenticate));
+}
+
+namespace {
+
+// Idle without waiting in waitForStateRequest(), like the Egistec HALs, so
+// that every pause is handed over to the worker:
+struct BusyIdleHandler : public TestHandler {
+    void IdleAsync() override {
+        ++mIdle;
+        mWt.isEventAvailable(-1);
+    }
+};
+
+}  // namespace
+
+// A pause right after Resume(), before the worker got to leave the pause,
+// keeps it paused, and still holds back posted work.
+TEST(SynchronizedWorkerThreadTest, PauseAfterResumeHoldsWorker) {
+    Running<BusyIdleHandler> handler;
+    ASSERT_TRUE(WaitFor([&] { return handler.mIdle > 0; }));
+
+    for (int round = 0; round < 100; ++round) {
+        ASSERT_TRUE(handler.mWt.Pause());
+        ASSERT_TRUE(handler.mWt.Resume());
+        ASSERT_TRUE(handler.mWt.Pause());
+        const uint32_t idle = handler.mIdle;
+
+        auto result = handler.mWt.post([round] { return round; });
+        EXPECT_EQ(result.wait_for(round % 10 ? 0ms : 10ms), std::future_status::timeout);
+        EXPECT_EQ(handler.mIdle, idle);
+
+        ASSERT_TRUE(handler.mWt.Resume());
+        EXPECT_EQ(result.get(), round);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Microbenchmark of UnlockLatencyTracer: the time one authentication
+ * attempt spends on recording its stages, which is added to every unlock,
+ * with and without debug() dumping the tracer at the same time.
+ */
+
+#include "UnlockLatencyTracer.h"
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+namespace {
+
+// Records the stages the FPC HAL records for a matching attempt:
+void RecordAttempt(UnlockLatencyTracer &tracer) {
+    const auto finger_down = systemTime(SYSTEM_TIME_MONOTONIC);
+    tracer.FingerDown(finger_down);
+    tracer.Record(UnlockStage::Wake, finger_down);
+    tracer.Record(UnlockStage::WakeKey, finger_down);
+    tracer.Record(UnlockStage::Capture, finger_down);
+    { auto trace = tracer.Trace(UnlockStage::Identify); }
+    { auto trace = tracer.Trace(UnlockStage::HatFetch); }
+    { auto trace = tracer.Trace(UnlockStage::Authenticated); }
+    tracer.Finish(true);
+    { auto trace = tracer.Trace(UnlockStage::TemplateUpdate); }
+}
+
+void BM_RecordAttempt(benchmark::State &state) {
+    UnlockLatencyTracer tracer;
+
+    for (auto _ : state)
+        RecordAttempt(tracer);
+}
+BENCHMARK(BM_RecordAttempt);
+
+// The worker records while lshal debug reads the ring and the histograms:
+void BM_RecordAttemptWhileDumping(benchmark::State &state) {
+    UnlockLatencyTracer tracer;
+    std::atomic<bool> stop{false};
+    std::atomic<long> dumps{0};
+
+    std::thread reader([&] {
+        const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        while (!stop) {
+            tracer.Dump(fd);
+            ++dumps;
+        }
+        close(fd);
+    });
+
+    for (auto _ : state)
+        RecordAttempt(tracer);
+
+    stop = true;
+    reader.join();
+    state.counters["dumps"] = dumps.load();
+}
+BENCHMARK(BM_RecordAttemptWhileDumping);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,231 @@
+#include "tz_trace.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "FPC TZ trace"
+// #define LOG_NDEBUG 0
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include <cutils/properties.h>
+#include <cutils/trace.h>
+#include <log/log.h>
+
+#define TZ_TRACE_PROPERTY "persist.vendor.fingerprint.tz_trace"
+// Distinct commands that can be tracked, more than any TZ app here uses:
+#define MAX_COMMANDS 64
+// Power-of-two latency buckets: < 16us, < 32us, ..., >= 262ms:
+#define HIST_MIN_SHIFT 4
+#define HIST_BUCKETS 16
+
+typedef struct {
+    // Set once the key and name are filled in, before any counter is used:
+    atomic_bool used;
+    const char *app;
+    uint32_t group;
+    uint32_t cmd;
+    char name[32];
+
+    atomic_uint_fast32_t calls;
+    atomic_uint_fast32_t errors;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast32_t hist[HIST_BUCKETS];
+} tz_command_stats_t;
+
+static tz_command_stats_t commands[MAX_COMMANDS];
+// Serializes adding commands; lookups are lock-free:
+static pthread_mutex_t commands_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool commands_full;
+
+static pthread_once_t property_once = PTHREAD_ONCE_INIT;
+static bool property_enabled;
+
+static void read_property(void)
+{
+    property_enabled = property_get_bool(TZ_TRACE_PROPERTY, false);
+    ALOGI_IF(property_enabled, "TZ command tracing enabled");
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t tz_trace_begin(void)
+{
+    pthread_once(&property_once, read_property);
+    if (!property_enabled && !ATRACE_ENABLED())
+        return 0;
+    return now_ns();
+}
+
+static bool matches(const tz_command_stats_t *stats, const char *app, uint32_t group, uint32_t cmd)
+{
+    return stats->group == group && stats->cmd == cmd &&
+           (stats->app == app || !strcmp(stats->app, app));
+}
+
+static tz_command_stats_t *find_command(const char *app, uint32_t group, uint32_t cmd)
+{
+    tz_command_stats_t *stats;
+    size_t i;
+
+    for (i = 0; i < MAX_COMMANDS; ++i) {
+        stats = &commands[i];
+        if (!atomic_load_explicit(&stats->used, memory_order_acquire))
+            break;
+        if (matches(stats, app, group, cmd))
+            return stats;
+    }
+
+    if (atomic_load_explicit(&commands_full, memory_order_relaxed))
+        return NULL;
+
+    pthread_mutex_lock(&commands_lock);
+    // Continue where the lock-free search stopped, another thread might
+    // have added more commands in the meantime:
+    for (; i < MAX_COMMANDS; ++i) {
+        stats = &commands[i];
+        if (!atomic_load_explicit(&stats->used, memory_order_relaxed)) {
+            stats->app = app;
+            stats->group = group;
+            stats->cmd = cmd;
+            snprintf(stats->name, sizeof(stats->name), "TZ %s %#x:%#x", app, group, cmd);
+            atomic_store_explicit(&stats->used, true, memory_order_release);
+            break;
+        }
+        if (matches(stats, app, group, cmd))
+            break;
+    }
+    if (i == MAX_COMMANDS) {
+        ALOGW("Too many distinct TZ commands, not tracing %s %#x:%#x", app, group, cmd);
+        atomic_store_explicit(&commands_full, true, memory_order_relaxed);
+        stats = NULL;
+    }
+    pthread_mutex_unlock(&commands_lock);
+
+    return stats;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000 >> HIST_MIN_SHIFT;
+    unsigned int bucket = 0;
+
+    while (us && bucket < HIST_BUCKETS - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void tz_trace_end(int64_t begin_ns, const char *app, uint32_t group, uint32_t cmd,
+                  uint32_t bytes, int result)
+{
+    if (!begin_ns)
+        return;
+
+    const uint64_t ns = now_ns() - begin_ns;
+    tz_command_stats_t *stats = find_command(app, group, cmd);
+    if (!stats)
+        return;
+
+    atomic_fetch_add_explicit(&stats->calls, 1, memory_order_relaxed);
+    if (result)
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->hist[hist_bucket(ns)], 1, memory_order_relaxed);
+
+    uint_fast64_t max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max, ns,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    ATRACE_INT(stats->name, (int32_t)(ns / 1000));
+}
+
+typedef struct {
+    const tz_command_stats_t *stats;
+    uint64_t total_ns;
+} dump_entry_t;
+
+static int compare_total(const void *a, const void *b)
+{
+    const uint64_t ta = ((const dump_entry_t *)a)->total_ns;
+    const uint64_t tb = ((const dump_entry_t *)b)->total_ns;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+// Describe the latency bucket containing the given fraction of calls:
+static void format_percentile(char *buf, size_t size, const uint32_t *hist, uint32_t calls,
+                              unsigned int percent)
+{
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; ++i) {
+        seen += hist[i];
+        if (seen * 100 >= (uint64_t)calls * percent)
+            break;
+    }
+
+    if (i < HIST_BUCKETS - 1)
+        snprintf(buf, size, "<%uus", 1u << (HIST_MIN_SHIFT + i));
+    else
+        snprintf(buf, size, ">=%uus", 1u << (HIST_MIN_SHIFT + i - 1));
+}
+
+void tz_trace_dump(int fd)
+{
+    dump_entry_t entries[MAX_COMMANDS];
+    size_t count = 0;
+
+    pthread_once(&property_once, read_property);
+
+    for (size_t i = 0; i < MAX_COMMANDS; ++i) {
+        const tz_command_stats_t *stats = &commands[i];
+        if (!atomic_load_explicit(&stats->used, memory_order_acquire))
+            break;
+        entries[count].stats = stats;
+        entries[count++].total_ns = atomic_load_explicit(&stats->total_ns, memory_order_relaxed);
+    }
+    qsort(entries, count, sizeof(*entries), compare_total);
+
+    dprintf(fd, "TZ commands (traced %s):\n",
+            property_enabled ? "always" : "while atrace is enabled, set " TZ_TRACE_PROPERTY " for always");
+    for (size_t i = 0; i < count; ++i) {
+        const tz_command_stats_t *stats = entries[i].stats;
+        uint32_t hist[HIST_BUCKETS];
+        uint32_t calls = atomic_load_explicit(&stats->calls, memory_order_relaxed);
+
+        if (!calls)
+            continue;
+        for (size_t b = 0; b < HIST_BUCKETS; ++b)
+            hist[b] = atomic_load_explicit(&stats->hist[b], memory_order_relaxed);
+
+        char p50[16], p99[16];
+        format_percentile(p50, sizeof(p50), hist, calls, 50);
+        format_percentile(p99, sizeof(p99), hist, calls, 99);
+
+        dprintf(fd, "  %-12s %#6x:%-#6x %6u calls %4u errors %9" PRIu64 " bytes "
+                "total %7" PRIu64 "ms avg %6" PRIu64 "us max %7" PRIu64 "us p50 %s p99 %s\n",
+                stats->app, stats->group, stats->cmd, calls,
+                (uint32_t)atomic_load_explicit(&stats->errors, memory_order_relaxed),
+                (uint64_t)atomic_load_explicit(&stats->bytes, memory_order_relaxed),
+                entries[i].total_ns / 1000000, entries[i].total_ns / 1000 / calls,
+                (uint64_t)atomic_load_explicit(&stats->max_ns, memory_order_relaxed) / 1000,
+                p50, p99);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * Per-command statistics of calls into TZ apps.
+ *
+ * Commands are identified by the name of the app, and a group and command
+ * id within that app. Every command keeps its call count, errors, bytes
+ * moved and a latency histogram, exposed through tz_trace_dump(). While
+ * tracing the HAL tag, the latency of every call is also emitted as an
+ * atrace counter named after the command.
+ *
+ * Statistics are collected when persist.vendor.fingerprint.tz_trace is set,
+ * or while atrace is tracing the HAL tag. Otherwise tz_trace_begin() costs
+ * a couple of loads, and tz_trace_end() nothing at all.
+ */
+
+/**
+ * @return The start time of a call to pass to tz_trace_end(), or 0 when
+ *         tracing is disabled.
+ */
+int64_t tz_trace_begin(void);
+/**
+ * Record a call that started at \p begin_ns. Does nothing when \p begin_ns
+ * is 0. \p app must be a string that outlives the process, like the name
+ * of the TZ app.
+ */
+void tz_trace_end(int64_t begin_ns, const char *app, uint32_t group, uint32_t cmd,
+                  uint32_t bytes, int result);
+/**
+ * Print all statistics to \p fd, sorted by total time spent.
+ */
+void tz_trace_dump(int fd);
+
+__END_DECLS
@@ -18,10 +18,7 @@
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
-#include <fcntl.h>
-#include <linux/input.h>
-#include <linux/uinput.h>
-#include <unistd.h>
+#include <uinput_emitter.h>
 
 #include "uevent_listener.h"
 
@@ -38,9 +35,12 @@ using android::Uevent;
 using android::UeventListener;
 
 int main() {
-    int err;
-    int uinputFd;
-    struct uinput_user_dev uidev {};
+    static const unsigned short keycodes[] = {
+        KEY_MODE_NORMAL,
+        KEY_MODE_VIBRATION,
+        KEY_MODE_SILENCE,
+    };
+    uinput_emitter_t* emitter;
     UeventListener uevent_listener;
 
     LOG(INFO) << "Started";
@@ -50,42 +50,16 @@ int main() {
         WriteStringToFile(hallData, HALL_CALIBRATION_DATA);
     }
 
-    uinputFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (uinputFd < 0) {
-        LOG(ERROR) << "Unable to open uinput node";
-        return 1;
-    }
-
-    err = ioctl(uinputFd, UI_SET_EVBIT, EV_KEY) |
-          ioctl(uinputFd, UI_SET_KEYBIT, KEY_MODE_NORMAL) |
-          ioctl(uinputFd, UI_SET_KEYBIT, KEY_MODE_VIBRATION) |
-          ioctl(uinputFd, UI_SET_KEYBIT, KEY_MODE_SILENCE);
-    if (err != 0) {
-        LOG(ERROR) << "Unable to enable KEY events";
-        goto out;
-    }
-
-    sprintf(uidev.name, "uinput-tri-state-key");
-    uidev.id.bustype = BUS_VIRTUAL;
-
-    err = write(uinputFd, &uidev, sizeof(uidev));
-    if (err < 0) {
-        LOG(ERROR) << "Write user device to uinput node failed";
-        goto out;
-    }
-
-    err = ioctl(uinputFd, UI_DEV_CREATE);
-    if (err < 0) {
+    emitter = uinput_emitter_create("uinput-tri-state-key", keycodes,
+                                    sizeof(keycodes) / sizeof(*keycodes));
+    if (emitter == nullptr) {
         LOG(ERROR) << "Unable to create uinput device";
-        goto out;
+        return 1;
     }
 
     LOG(INFO) << "Successfully registered uinput-tri-state-key for KEY events";
 
-    uevent_listener.Poll([&uinputFd](const Uevent& uevent) {
-        int err;
-        struct input_event event {};
-
+    uevent_listener.Poll([emitter](const Uevent& uevent) {
         if (uevent.action != "change" || uevent.name != "soc:tri_state_key") {
             return;
         }
@@ -94,7 +68,7 @@ int main() {
         bool vibration = uevent.state.find("USB-HOST=0") != std::string::npos;
         bool silent = uevent.state.find("null)=0") != std::string::npos;
 
-        int keyCode;
+        unsigned short keyCode;
         if (none && !vibration && !silent) {
             keyCode = KEY_MODE_NORMAL;
         } else if (!none && vibration && !silent) {
@@ -106,52 +80,14 @@ int main() {
             return;
         }
 
-        // Report the key
-        event.type = EV_KEY;
-        event.code = keyCode;
-        event.value = 1;
-        err = write(uinputFd, &event, sizeof(event));
-        if (err < 0) {
-            LOG(ERROR) << "Write EV_KEY to uinput node failed";
-            return;
+        // Report the key press and release, with a single write
+        if (uinput_emitter_click(emitter, &keyCode, 1) != 0) {
+            LOG(ERROR) << "Write key click to uinput node failed";
         }
-
-        // Force a flush with an EV_SYN
-        event.type = EV_SYN;
-        event.code = SYN_REPORT;
-        event.value = 0;
-        err = write(uinputFd, &event, sizeof(event));
-        if (err < 0) {
-            LOG(ERROR) << "Write EV_SYN to uinput node failed";
-            return;
-        }
-
-        // Report the key
-        event.type = EV_KEY;
-        event.code = keyCode;
-        event.value = 0;
-        err = write(uinputFd, &event, sizeof(event));
-        if (err < 0) {
-            LOG(ERROR) << "Write EV_KEY to uinput node failed";
-            return;
-        }
-
-        // Force a flush with an EV_SYN
-        event.type = EV_SYN;
-        event.code = SYN_REPORT;
-        event.value = 0;
-        err = write(uinputFd, &event, sizeof(event));
-        if (err < 0) {
-            LOG(ERROR) << "Write EV_SYN to uinput node failed";
-            return;
-        }
-
-        return;
     });
 
-out:
     // Clean up
-    close(uinputFd);
+    uinput_emitter_destroy(emitter);
 
     // The loop can only be exited via failure or signal
     return 1;
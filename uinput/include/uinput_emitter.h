@@ -0,0 +1,46 @@
+#pragma once
+
+#include <linux/uinput.h>
+#include <stddef.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * A uinput device that reports key clicks, shared by the daemons that
+ * turn hardware events into key presses.
+ *
+ * Every click is a down and an up event, each followed by a SYN_REPORT.
+ * All events of a call are stamped with the same CLOCK_MONOTONIC time and
+ * handed to the kernel with a single write.
+ */
+typedef struct uinput_emitter uinput_emitter_t;
+
+// Maximum number of keys accepted by a single click call:
+#define UINPUT_EMITTER_MAX_KEYS 8
+
+/*
+ * Creates a device that can report \p keycodes. The name must match the
+ * keylayout/idc filename in /vendor/usr/{keylayout,idc}.
+ * Returns NULL on failure.
+ */
+uinput_emitter_t *uinput_emitter_create(const char *name, const unsigned short *keycodes,
+                                        size_t num_keycodes);
+// Delivers clicks still queued by uinput_emitter_post_click first:
+void uinput_emitter_destroy(uinput_emitter_t *);
+
+// Reports a single key event followed by a synchronize:
+int uinput_emitter_send(uinput_emitter_t *, unsigned short keycode, int value);
+// Clicks every key in order, from the calling thread:
+int uinput_emitter_click(uinput_emitter_t *, const unsigned short *keycodes, size_t count);
+/*
+ * Like uinput_emitter_click, but leaves the write to a thread of the
+ * emitter so that the caller never waits on input dispatch. Clicks posted
+ * while that thread is busy are coalesced into its next write.
+ * Returns -EAGAIN when the queue is full.
+ */
+int uinput_emitter_post_click(uinput_emitter_t *, const unsigned short *keycodes, size_t count);
+
+void uinput_emitter_dump(uinput_emitter_t *, int fd);
+
+__END_DECLS
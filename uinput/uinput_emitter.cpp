@@ -0,0 +1,266 @@
+#include "uinput_emitter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOG_TAG "UInputEmitter"
+// #define LOG_NDEBUG 0
+#include <log/log.h>
+
+// Down, synchronize, up, synchronize:
+constexpr size_t events_per_click = 4;
+// Events that may wait for the emitter thread before clicks are dropped:
+constexpr size_t max_queued_events = 4 * UINPUT_EMITTER_MAX_KEYS * events_per_click;
+
+struct uinput_emitter {
+    int fd = -1;
+    char name[UINPUT_MAX_NAME_SIZE] = {};
+
+    std::mutex lock;
+    std::condition_variable cond;
+    // Started by the first uinput_emitter_post_click:
+    std::thread thread;
+    bool stop = false;
+    std::vector<input_event> queue;
+
+    std::atomic<uint32_t> clicks{0}, writes{0}, dropped{0};
+    // Time posted clicks waited for the emitter thread to write them:
+    std::atomic<int64_t> queue_ns_total{0}, queue_ns_max{0};
+    std::atomic<uint32_t> queue_batches{0};
+};
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t event_ns(const input_event &ie) {
+    return ie.input_event_sec * 1000000000LL + ie.input_event_usec * 1000LL;
+}
+
+static void fill_event(input_event *ie, int64_t ns, unsigned short type, unsigned short code,
+                       int value) {
+    ie->input_event_sec = ns / 1000000000LL;
+    ie->input_event_usec = (ns % 1000000000LL) / 1000;
+    ie->type = type;
+    ie->code = code;
+    ie->value = value;
+}
+
+/**
+ * Appends a click on every key to \p ie, stamped with \p ns.
+ * Returns the number of events added.
+ */
+static size_t fill_clicks(input_event *ie, int64_t ns, const unsigned short *keycodes,
+                          size_t count) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+        fill_event(&ie[n++], ns, EV_KEY, keycodes[i], 1);
+        fill_event(&ie[n++], ns, EV_SYN, SYN_REPORT, 0);
+        fill_event(&ie[n++], ns, EV_KEY, keycodes[i], 0);
+        fill_event(&ie[n++], ns, EV_SYN, SYN_REPORT, 0);
+    }
+    return n;
+}
+
+static int write_events(uinput_emitter_t *emitter, const input_event *ie, size_t n) {
+    const size_t len = n * sizeof(*ie);
+    ssize_t written = TEMP_FAILURE_RETRY(write(emitter->fd, ie, len));
+    ++emitter->writes;
+    if (written < 0) {
+        ALOGE("%s: Failed to write uinput events: %s", emitter->name, strerror(errno));
+        return -errno;
+    } else if ((size_t)written != len) {
+        ALOGE("%s: Didn't write all input_events, only %zd/%zu bytes!", emitter->name, written, len);
+        return -EIO;
+    }
+    return 0;
+}
+
+static size_t clamp_keys(const uinput_emitter_t *emitter, size_t count) {
+    if (count > UINPUT_EMITTER_MAX_KEYS) {
+        ALOGW("%s: Can't click %zu keys at once, dropping %zu", emitter->name, count,
+              count - UINPUT_EMITTER_MAX_KEYS);
+        return UINPUT_EMITTER_MAX_KEYS;
+    }
+    return count;
+}
+
+static void emitter_thread(uinput_emitter_t *emitter) {
+    std::vector<input_event> batch;
+    batch.reserve(max_queued_events);
+
+    std::unique_lock<std::mutex> lock(emitter->lock);
+    for (;;) {
+        emitter->cond.wait(lock, [emitter] { return emitter->stop || !emitter->queue.empty(); });
+        if (emitter->queue.empty())
+            return;
+
+        // Everything posted so far goes out with a single write:
+        batch.swap(emitter->queue);
+        lock.unlock();
+
+        int64_t waited = now_ns() - event_ns(batch.front());
+        emitter->queue_ns_total += waited;
+        ++emitter->queue_batches;
+        if (waited > emitter->queue_ns_max)
+            emitter->queue_ns_max = waited;
+        ALOGV("%s: Writing %zu events queued %" PRId64 "us ago", emitter->name, batch.size(),
+              waited / 1000);
+
+        write_events(emitter, batch.data(), batch.size());
+        batch.clear();
+
+        lock.lock();
+    }
+}
+
+uinput_emitter_t *uinput_emitter_create(const char *name, const unsigned short *keycodes,
+                                        size_t num_keycodes) {
+    int rc = 0;
+    struct uinput_setup usetup = {};
+    usetup.id.bustype = BUS_VIRTUAL;
+    strlcpy(usetup.name, name, sizeof(usetup.name));
+
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        ALOGE("%s: Failed to open /dev/uinput: %s", name, strerror(errno));
+        return nullptr;
+    }
+
+    rc |= ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (size_t i = 0; i < num_keycodes; ++i)
+        rc |= ioctl(fd, UI_SET_KEYBIT, keycodes[i]);
+
+    if (rc < 0) {
+        ALOGE("%s: Failed to set up event- or key_bit: rc=%d: %s", name, rc, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    rc = ioctl(fd, UI_DEV_SETUP, &usetup);
+    if (rc < 0) {
+        ALOGW("%s: Failed to setup uinput device! rc=%d: %s, falling back to write.", name, rc,
+              strerror(errno));
+
+        struct uinput_user_dev usetup_legacy = {};
+        usetup_legacy.id.bustype = BUS_VIRTUAL;
+        strlcpy(usetup_legacy.name, name, sizeof(usetup_legacy.name));
+
+        rc = TEMP_FAILURE_RETRY(write(fd, &usetup_legacy, sizeof(usetup_legacy)));
+        if (rc < 0) {
+            ALOGE("%s: Failed to setup uinput device! rc=%d: %s", name, rc, strerror(errno));
+            close(fd);
+            return nullptr;
+        } else if (rc != sizeof(usetup_legacy)) {
+            /* The kernel _should_ always accept the full object. */
+            ALOGE("%s: Didn't write full usetup_legacy, only %d/%zu bytes!", name, rc,
+                  sizeof(usetup_legacy));
+            close(fd);
+            return nullptr;
+        }
+    }
+
+    rc = ioctl(fd, UI_DEV_CREATE);
+    if (rc < 0) {
+        ALOGE("%s: Failed to create uinput device! rc=%d: %s", name, rc, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    ALOGI("%s: Successfully created uinput device", name);
+
+    uinput_emitter_t *emitter = new uinput_emitter;
+    emitter->fd = fd;
+    strlcpy(emitter->name, name, sizeof(emitter->name));
+    return emitter;
+}
+
+void uinput_emitter_destroy(uinput_emitter_t *emitter) {
+    if (!emitter)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(emitter->lock);
+        emitter->stop = true;
+    }
+    emitter->cond.notify_one();
+    if (emitter->thread.joinable())
+        emitter->thread.join();
+
+    int rc = ioctl(emitter->fd, UI_DEV_DESTROY);
+    if (rc < 0)
+        ALOGE("%s: Failed to close uinput device! rc=%d: %s", emitter->name, rc, strerror(errno));
+    close(emitter->fd);
+    delete emitter;
+}
+
+int uinput_emitter_send(uinput_emitter_t *emitter, unsigned short keycode, int value) {
+    struct input_event ie[2];
+    const int64_t ns = now_ns();
+    fill_event(&ie[0], ns, EV_KEY, keycode, value);
+    fill_event(&ie[1], ns, EV_SYN, SYN_REPORT, 0);
+    return write_events(emitter, ie, 2);
+}
+
+int uinput_emitter_click(uinput_emitter_t *emitter, const unsigned short *keycodes, size_t count) {
+    struct input_event ie[UINPUT_EMITTER_MAX_KEYS * events_per_click];
+
+    count = clamp_keys(emitter, count);
+    if (!count)
+        return 0;
+
+    size_t n = fill_clicks(ie, now_ns(), keycodes, count);
+    emitter->clicks += count;
+    return write_events(emitter, ie, n);
+}
+
+int uinput_emitter_post_click(uinput_emitter_t *emitter, const unsigned short *keycodes,
+                              size_t count) {
+    struct input_event ie[UINPUT_EMITTER_MAX_KEYS * events_per_click];
+
+    count = clamp_keys(emitter, count);
+    if (!count)
+        return 0;
+
+    size_t n = fill_clicks(ie, now_ns(), keycodes, count);
+
+    {
+        std::lock_guard<std::mutex> lock(emitter->lock);
+        if (emitter->queue.size() + n > max_queued_events) {
+            emitter->dropped += count;
+            ALOGW("%s: Queue full, dropping %zu clicks", emitter->name, count);
+            return -EAGAIN;
+        }
+        emitter->queue.insert(emitter->queue.end(), ie, ie + n);
+        if (!emitter->thread.joinable())
+            emitter->thread = std::thread(emitter_thread, emitter);
+    }
+    emitter->clicks += count;
+    emitter->cond.notify_one();
+    return 0;
+}
+
+void uinput_emitter_dump(uinput_emitter_t *emitter, int fd) {
+    dprintf(fd, "UInput %s: %u clicks in %u writes, %u dropped\n", emitter->name,
+            emitter->clicks.load(), emitter->writes.load(), emitter->dropped.load());
+
+    uint32_t batches = emitter->queue_batches;
+    if (batches)
+        dprintf(fd, "  queued for %" PRId64 "us on average, %" PRId64 "us at most\n",
+                emitter->queue_ns_total / batches / 1000, emitter->queue_ns_max / 1000);
+}